@@ -51,6 +51,13 @@ struct {
 				.gicv_base = 0x03886000,
 				.gic_version = 2,
 				.maintenance_irq = 25,
+				.memguard_timer_irq = 26,
+				.gic_priority_bits = 4,
+				/* A57 cluster from SPI 296, Denvers from 320 */
+				.memguard_pmu_irqs = {
+					32 + 296, 32 + 320, 32 + 321,
+					32 + 297, 32 + 298, 32 + 299,
+				},
 			}
 		},
 		.root_cell = {
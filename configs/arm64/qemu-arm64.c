@@ -49,6 +49,11 @@ struct {
 				.gicd_base = 0x08000000,
 				.gicr_base = 0x080a0000,
 				.maintenance_irq = 25,
+				/* PMU on PPI 7 with -cpu ...,pmu=on */
+				.memguard_timer_irq = 26,
+				.memguard_pmu_irqs = {
+					23, 23, 23, 23, 23, 23, 23, 23,
+				},
 			},
 		},
 		.root_cell = {
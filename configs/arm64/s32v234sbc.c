@@ -55,6 +55,9 @@ struct {
 				.gich_base = 0x7d004000,
 				.gicv_base = 0x7d006000,
 				.maintenance_irq = 25,
+				.memguard_timer_irq = 26,
+				.gic_priority_bits = 8,
+				.memguard_pmu_irqs = { 195, 196, 197, 198 },
 			}
 		},
 		.root_cell = {
@@ -62,6 +62,12 @@ struct {
 				.gich_base = 0xf9040000,
 				.gicv_base = 0xf906f000,
 				.maintenance_irq = 25,
+				.memguard_timer_irq = 26,
+				.gic_priority_bits = 4,
+				.memguard_pmu_irqs = { 175, 176, 177, 178 },
+				/* Share the last colors with the root cell
+				 * only */
+				.hypervisor_colors = 0x000f,
 			},
 		},
 		.root_cell = {
@@ -51,6 +51,9 @@ struct {
 				.gich_base = 0xf9040000,
 				.gicv_base = 0xf906f000,
 				.maintenance_irq = 25,
+				.memguard_timer_irq = 26,
+				.gic_priority_bits = 4,
+				.memguard_pmu_irqs = { 175, 176, 177, 178 },
 			},
 		},
 
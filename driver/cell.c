@@ -14,7 +14,11 @@
 #include <linux/version.h>
 
 #include <linux/cpu.h>
+#include <linux/err.h>
+#include <linux/file.h>
+#include <linux/fs.h>
 #include <linux/mm.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include <asm/cacheflush.h>
@@ -316,6 +320,47 @@ static int cell_management_prologue(struct jailhouse_cell_id *cell_id,
 
 #define MEM_REQ_FLAGS	(JAILHOUSE_MEM_WRITE | JAILHOUSE_MEM_LOADABLE)
 
+/*
+ * Images are written through a temporary mapping of at most this size, so
+ * that loading large images neither needs vmalloc space for the whole
+ * image nor flushes more than what was written.
+ */
+#define LOAD_CHUNK_SIZE	(2UL * 1024 * 1024)
+
+static int load_image_chunk(void *dst,
+			    const struct jailhouse_preload_image *image,
+			    struct file *file, u64 offset, size_t size)
+{
+	loff_t pos = image->source_address + offset;
+	ssize_t result;
+
+	if (!file) {
+		if (copy_from_user(dst, (void __user *)(unsigned long)
+				   (image->source_address + offset), size))
+			return -EFAULT;
+		return 0;
+	}
+
+	/* Copy straight out of the page cache */
+	while (size > 0) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0)
+		result = kernel_read(file, pos, dst, size);
+		if (result > 0)
+			pos += result;
+#else
+		result = kernel_read(file, dst, size, &pos);
+#endif
+		if (result < 0)
+			return result;
+		if (result == 0)
+			return -EIO;
+		dst += result;
+		size -= result;
+	}
+
+	return 0;
+}
+
 static int load_image(struct cell *cell,
 		      struct jailhouse_preload_image __user *uimage)
 {
@@ -323,8 +368,10 @@ static int load_image(struct cell *cell,
 	const struct jailhouse_memory *mem;
 	const struct jailhouse_memory_colored *col_mem;
 	unsigned int regions, page_offs;
-	u64 image_offset, phys_start;
+	u64 image_offset, phys_start, done;
+	struct file *file = NULL;
 	void *image_mem;
+	size_t size;
 	int err = 0;
 
 	if (copy_from_user(&image, uimage, sizeof(image)))
@@ -348,18 +395,7 @@ static int load_image(struct cell *cell,
 	}
 
 	if (regions > 0) {
-		phys_start = (mem->phys_start + image_offset) & PAGE_MASK;
-		page_offs = offset_in_page(image_offset);
-		image_mem = jailhouse_ioremap(phys_start, 0,
-					      PAGE_ALIGN(image.size + page_offs));
-
-		if (!image_mem) {
-			pr_err("jailhouse: Unable to map cell RAM at %08llx "
-			       "for image loading\n",
-			       (unsigned long long)(mem->phys_start + image_offset));
-			return -EBUSY;
-		}
-
+		phys_start = mem->phys_start + image_offset;
 	} else {
 		/* search colored regions next */	
 		col_mem = cell->memory_regions_colored;
@@ -376,44 +412,69 @@ static int load_image(struct cell *cell,
 			col_mem++;
 		}
 
-		if (regions > 0) {
-			phys_start = (col_mem->memory.virt_start + (ROOT_MAP_OFFSET + image_offset)) & PAGE_MASK;
-			page_offs = offset_in_page(image_offset);
-			image_mem = jailhouse_ioremap(phys_start, 0,
-					      PAGE_ALIGN(image.size + page_offs));
-
-			if (!image_mem) {
-				pr_err("jailhouse: Unable to map cell RAM at %08llx "
-				       "for image loading\n",
-				       (unsigned long long)(phys_start + image_offset));
-				return -EBUSY;
-			}
-
-		}
+		/* The hypervisor maps the colored region linearly at
+		 * ROOT_MAP_OFFSET while the cell is loadable */
+		if (regions > 0)
+			phys_start = col_mem->memory.virt_start +
+				ROOT_MAP_OFFSET + image_offset;
 	}
 
 	if (regions == 0)
 		return -EINVAL;
 
-	if (copy_from_user(image_mem + page_offs,
-			   (void __user *)(unsigned long)image.source_address,
-			   image.size))
-		err = -EFAULT;
-	/*
-	 * ARMv7 and ARMv8 require to clean D-cache and invalidate I-cache for
-	 * memory containing new instructions. On x86 this is a NOP.
-	 */
-	flush_icache_range((unsigned long)(image_mem + page_offs),
-			   (unsigned long)(image_mem + page_offs) + image.size);
+	if (image.flags & JAILHOUSE_IMAGE_FROM_FD) {
+		file = fget(image.fd);
+		if (!file)
+			return -EBADF;
+	}
+
+	page_offs = offset_in_page(phys_start);
+	phys_start &= PAGE_MASK;
+
+	for (done = 0; done < image.size; done += size) {
+		size = min_t(u64, image.size - done,
+			     LOAD_CHUNK_SIZE - page_offs);
+
+		image_mem = jailhouse_ioremap(phys_start, 0, page_offs + size);
+		if (!image_mem) {
+			pr_err("jailhouse: Unable to map cell RAM at %08llx "
+			       "for image loading\n",
+			       (unsigned long long)(phys_start + page_offs));
+			err = -EBUSY;
+			break;
+		}
+
+		err = load_image_chunk(image_mem + page_offs, &image, file,
+				       done, size);
+
+		/*
+		 * ARMv7 and ARMv8 require to clean D-cache and invalidate
+		 * I-cache for memory containing new instructions. On x86 this
+		 * is a NOP.
+		 */
+		flush_icache_range((unsigned long)(image_mem + page_offs),
+				   (unsigned long)(image_mem + page_offs) +
+				   size);
 #ifdef CONFIG_ARM
-	/*
-	 * ARMv7 requires to flush the written code and data out of D-cache to
-	 * allow the guest starting off with caches disabled.
-	 */
-	__cpuc_flush_dcache_area(image_mem + page_offs, image.size);
+		/*
+		 * ARMv7 requires to flush the written code and data out of
+		 * D-cache to allow the guest starting off with caches
+		 * disabled.
+		 */
+		__cpuc_flush_dcache_area(image_mem + page_offs, size);
 #endif
 
-	vunmap(image_mem);
+		vunmap(image_mem);
+
+		if (err)
+			break;
+
+		phys_start += page_offs + size;
+		page_offs = 0;
+	}
+
+	if (file)
+		fput(file);
 
 	return err;
 }
@@ -536,62 +597,125 @@ int jailhouse_cmd_cell_destroy_non_root(void)
 	return 0;
 }
 
-static int __memguard_call_one_cpu(void * args)
+static int __memguard_call_one_cpu(void *params)
 {
-	struct jailhouse_memguard_args * mg_args = (struct jailhouse_memguard_args *)args;
-	
-	return jailhouse_call_arg1(JAILHOUSE_HC_MEMGUARD, __pa(&mg_args->params));
+	unsigned long ret = jailhouse_call_arg1(JAILHOUSE_HC_MEMGUARD,
+						__pa(params));
+
+	/* Overrun flags in the upper bits make valid results negative, but
+	 * never reach the errno range, bits 57 to 61 are always clear */
+	if (IS_ERR_VALUE(ret))
+		return (int)ret;
+
+	/* Bit 0 of the result flags an error, the statistics are written
+	 * back to the parameters */
+	return ret & 1;
 }
 
-static int memguard_call(struct cell * cell, struct jailhouse_memguard_args * mg_args)
+static int memguard_call(struct cell *cell,
+			 const struct memguard_params *params,
+			 struct jailhouse_memguard_result *results)
 {
-	unsigned int cpu;
+	unsigned int cpu, n = 0;
 	int err;
 
-	/* NOTE: not sure on which CPU the memguard call will have an effect!! */
+	/* Each CPU gets its own copy of the parameters to report back */
 	for_each_cpu(cpu, &cell->cpus_assigned) {
-		err = smp_call_on_cpu(cpu, __memguard_call_one_cpu, (void *)mg_args, true);
+		results[n].cpu = cpu;
+		results[n].params = *params;
 
-		err &= 1; //MGRET_ERROR_MASK;
-		
+		err = smp_call_on_cpu(cpu, __memguard_call_one_cpu,
+				      &results[n].params, true);
 		if (err) {
-			pr_err("Jailhouse memguard call failed on CPU %d\n", cpu);
-			return err;
+			pr_err("Jailhouse memguard call failed on CPU %d\n",
+			       cpu);
+			return err < 0 ? err : -EINVAL;
 		}
+		n++;
 	}
-	
-	return 0;
+
+	return n;
 }
 
 int jailhouse_cmd_cell_memguard(struct jailhouse_memguard_args __user *arg)
 {
-	struct jailhouse_memguard_args * mg_args;
+	struct jailhouse_memguard_result *results;
+	struct jailhouse_memguard_args mg_args;
+	unsigned int num_results;
 	struct cell *cell;
 	int err;
 
-	mg_args = kmalloc(sizeof(struct jailhouse_memguard_args), GFP_USER | __GFP_NOWARN);
-	if (!mg_args)
-		return -ENOMEM;
-	
-	if (copy_from_user(mg_args, arg, sizeof(struct jailhouse_memguard_args)))
+	if (copy_from_user(&mg_args, arg, sizeof(mg_args)))
 		return -EFAULT;
-	
-	err = cell_management_prologue(&mg_args->cell_id, &cell);
+
+	err = cell_management_prologue(&mg_args.cell_id, &cell);
 	if (err)
 		return err;
 
-	err = memguard_call(cell, mg_args);
+	results = kcalloc(cpumask_weight(&cell->cpus_assigned),
+			  sizeof(*results), GFP_KERNEL);
+	if (!results) {
+		err = -ENOMEM;
+		goto out_unlock;
+	}
 
-	kfree(mg_args);
-	
-	if (err) {
-		pr_err("Jailhouse: unable to set memguard parameters for cell \"%s\"\n",
-		       cell->name);
-		return err;
+	err = memguard_call(cell, &mg_args.params, results);
+	if (err < 0) {
+		pr_err("Jailhouse: unable to set memguard parameters for cell "
+		       "\"%s\"\n", cell->name);
+		goto out_free;
 	}
-	
+
+	/* On success, the number of CPUs of the cell is returned */
+	num_results = min_t(unsigned int, err, mg_args.max_results);
+	if (copy_to_user((void __user *)(unsigned long)mg_args.results,
+			 results, num_results * sizeof(*results)))
+		err = -EFAULT;
+
+out_free:
+	kfree(results);
+out_unlock:
 	mutex_unlock(&jailhouse_lock);
 
 	return err;
-	
+}
+
+int jailhouse_cmd_cell_recolor(struct jailhouse_cell_recolor __user *arg)
+{
+	struct jailhouse_recolor_params *params;
+	struct jailhouse_cell_recolor recolor;
+	struct cell *cell;
+	int err;
+
+	if (copy_from_user(&recolor, arg, sizeof(recolor)))
+		return -EFAULT;
+
+	/* The hypervisor reads the parameters by physical address */
+	params = kmalloc(sizeof(*params), GFP_KERNEL);
+	if (!params)
+		return -ENOMEM;
+	params->region = recolor.region;
+	params->flags = 0;
+	params->colors = recolor.colors;
+
+	err = cell_management_prologue(&recolor.cell_id, &cell);
+	if (err)
+		goto out_free;
+
+	/* Each call moves a batch of pages, let Linux run in between */
+	do {
+		err = jailhouse_call_arg2(JAILHOUSE_HC_CELL_RECOLOR, cell->id,
+					  __pa(params));
+		params->flags = JAILHOUSE_RECOLOR_CONTINUE;
+		cond_resched();
+	} while (err > 0);
+	if (err)
+		pr_err("Jailhouse: failed to recolor region %u of cell "
+		       "\"%s\"\n", recolor.region, cell->name);
+
+	mutex_unlock(&jailhouse_lock);
+
+out_free:
+	kfree(params);
+	return err;
 }
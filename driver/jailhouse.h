@@ -53,10 +53,12 @@ struct jailhouse_cell_create {
 };
 
 struct jailhouse_preload_image {
+	/* User address, or file offset with JAILHOUSE_IMAGE_FROM_FD */
 	__u64 source_address;
 	__u64 size;
 	__u64 target_address;
-	__u64 padding;
+	__u32 flags;
+	__s32 fd;
 };
 
 struct jailhouse_cell_id {
@@ -75,6 +77,25 @@ struct jailhouse_cell_load {
 struct jailhouse_memguard_args {
 	struct jailhouse_cell_id cell_id;
 	struct memguard_params params;
+	/* Entries of the results array, at most one per CPU of the cell */
+	__u32 max_results;
+	__u32 padding;
+	/* Address of an array of struct jailhouse_memguard_result */
+	__u64 results;
+};
+
+/* Statistics of a CPU, see struct memguard_params */
+struct jailhouse_memguard_result {
+	__u32 cpu;
+	__u32 padding;
+	struct memguard_params params;
+};
+
+struct jailhouse_cell_recolor {
+	struct jailhouse_cell_id cell_id;
+	__u32 region;
+	__u32 padding;
+	__u64 colors;
 };
 
 struct jailhouse_qos_args {
@@ -82,8 +103,44 @@ struct jailhouse_qos_args {
 	struct qos_setting settings[];
 };
 
+struct jailhouse_qos_compile {
+	__u32 num_settings;
+	/* Capacity of ops */
+	__u32 max_ops;
+	/* User addresses of struct qos_setting and struct qos_op arrays */
+	__u64 settings;
+	__u64 ops;
+};
+
+struct jailhouse_qos_apply {
+	__u32 num_ops;
+	__u32 padding;
+	/* User address of a struct qos_op array */
+	__u64 ops;
+};
+
+/* Arguments of JAILHOUSE_QOS_QUERY and JAILHOUSE_QOS_SNAPSHOT */
+struct jailhouse_qos_readback {
+	/* Capacity of buffer, in entries */
+	__u32 max_entries;
+	__u32 padding;
+	/* User address of a struct qos_setting resp. struct qos_op array */
+	__u64 buffer;
+};
+
+struct jailhouse_qos_loop {
+	__u32 num_settings;
+	__u32 steps;
+	__s32 slack_low;
+	__s32 slack_high;
+	/* User address of a struct qos_loop_setting array */
+	__u64 settings;
+};
+
 #define JAILHOUSE_CELL_ID_UNUSED	(-1)
 
+#define JAILHOUSE_IMAGE_FROM_FD		0x0001
+
 #define JAILHOUSE_ENABLE		_IOW(0, 0, void *)
 #define JAILHOUSE_DISABLE		_IO(0, 1)
 #define JAILHOUSE_CELL_CREATE		_IOW(0, 2, struct jailhouse_cell_create)
@@ -92,5 +149,11 @@ struct jailhouse_qos_args {
 #define JAILHOUSE_CELL_DESTROY		_IOW(0, 5, struct jailhouse_cell_id)
 #define JAILHOUSE_CELL_MEMGUARD		_IOW(0, 6, struct jailhouse_memguard_args)
 #define JAILHOUSE_QOS		        _IOW(0, 7, struct jailhouse_qos_args)
+#define JAILHOUSE_CELL_RECOLOR		_IOW(0, 8, struct jailhouse_cell_recolor)
+#define JAILHOUSE_QOS_COMPILE		_IOW(0, 9, struct jailhouse_qos_compile)
+#define JAILHOUSE_QOS_APPLY		_IOW(0, 10, struct jailhouse_qos_apply)
+#define JAILHOUSE_QOS_QUERY		_IOW(0, 11, struct jailhouse_qos_readback)
+#define JAILHOUSE_QOS_SNAPSHOT		_IOW(0, 12, struct jailhouse_qos_readback)
+#define JAILHOUSE_QOS_LOOP		_IOW(0, 13, struct jailhouse_qos_loop)
 
 #endif /* !_JAILHOUSE_DRIVER_H */
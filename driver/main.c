@@ -845,6 +845,214 @@ int jailhouse_cmd_qos(struct jailhouse_qos_args __user *arg)
 	
 }
 
+static int jailhouse_cmd_qos_compile(struct jailhouse_qos_compile __user *arg)
+{
+	struct jailhouse_qos_compile compile;
+	struct qos_compile_params *params;
+	struct qos_setting *settings;
+	struct qos_op *ops;
+	int err;
+
+	if (copy_from_user(&compile, arg, sizeof(compile)))
+		return -EFAULT;
+
+	/* Empty buffers have no physical address to pass on */
+	if (compile.num_settings == 0 || compile.max_ops == 0)
+		return -EINVAL;
+
+	if (compile.max_ops > QOS_MAX_OPS)
+		compile.max_ops = QOS_MAX_OPS;
+
+	params = kmalloc(sizeof(*params), GFP_KERNEL);
+	settings = kmalloc_array(compile.num_settings, sizeof(*settings),
+				 GFP_KERNEL);
+	ops = kmalloc_array(compile.max_ops, sizeof(*ops), GFP_KERNEL);
+	if (!params || !settings || !ops) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if (copy_from_user(settings,
+			   (void __user *)(unsigned long)compile.settings,
+			   compile.num_settings * sizeof(*settings))) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	params->num_settings = compile.num_settings;
+	params->max_ops = compile.max_ops;
+	params->settings_address = __pa(settings);
+	params->ops_address = __pa(ops);
+
+	if (mutex_lock_interruptible(&jailhouse_lock) != 0) {
+		err = -EINTR;
+		goto out;
+	}
+
+	if (jailhouse_enabled)
+		err = jailhouse_call_arg1(JAILHOUSE_HC_QOS_COMPILE,
+					  __pa(params));
+	else
+		err = -EINVAL;
+
+	mutex_unlock(&jailhouse_lock);
+
+	/* On success, the number of register writes is returned */
+	if (err > 0 &&
+	    copy_to_user((void __user *)(unsigned long)compile.ops, ops,
+			 err * sizeof(*ops)))
+		err = -EFAULT;
+
+out:
+	kfree(ops);
+	kfree(settings);
+	kfree(params);
+
+	return err;
+}
+
+static int jailhouse_cmd_qos_apply(struct jailhouse_qos_apply __user *arg)
+{
+	struct jailhouse_qos_apply apply;
+	struct qos_op *ops;
+	int err;
+
+	if (copy_from_user(&apply, arg, sizeof(apply)))
+		return -EFAULT;
+
+	if (apply.num_ops == 0)
+		return -EINVAL;
+	if (apply.num_ops > QOS_MAX_OPS)
+		return -E2BIG;
+
+	ops = kmalloc_array(apply.num_ops, sizeof(*ops), GFP_KERNEL);
+	if (!ops)
+		return -ENOMEM;
+
+	if (copy_from_user(ops, (void __user *)(unsigned long)apply.ops,
+			   apply.num_ops * sizeof(*ops))) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	if (mutex_lock_interruptible(&jailhouse_lock) != 0) {
+		err = -EINTR;
+		goto out;
+	}
+
+	if (jailhouse_enabled)
+		err = jailhouse_call_arg2(JAILHOUSE_HC_QOS_APPLY,
+					  apply.num_ops, __pa(ops));
+	else
+		err = -EINVAL;
+
+	mutex_unlock(&jailhouse_lock);
+
+out:
+	kfree(ops);
+
+	return err;
+}
+
+static int jailhouse_cmd_qos_loop(struct jailhouse_qos_loop __user *arg)
+{
+	struct qos_loop_setting *settings;
+	struct jailhouse_qos_loop loop;
+	struct qos_loop_params *params;
+	int err;
+
+	if (copy_from_user(&loop, arg, sizeof(loop)))
+		return -EFAULT;
+
+	if (loop.num_settings > QOS_LOOP_MAX_SETTINGS)
+		return -E2BIG;
+
+	params = kmalloc(sizeof(*params), GFP_KERNEL);
+	settings = kmalloc_array(loop.num_settings ? : 1, sizeof(*settings),
+				 GFP_KERNEL);
+	if (!params || !settings) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	if (copy_from_user(settings,
+			   (void __user *)(unsigned long)loop.settings,
+			   loop.num_settings * sizeof(*settings))) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	params->num_settings = loop.num_settings;
+	params->steps = loop.steps;
+	params->slack_low = loop.slack_low;
+	params->slack_high = loop.slack_high;
+	params->settings_address = __pa(settings);
+
+	if (mutex_lock_interruptible(&jailhouse_lock) != 0) {
+		err = -EINTR;
+		goto out;
+	}
+
+	if (jailhouse_enabled)
+		err = jailhouse_call_arg1(JAILHOUSE_HC_QOS_LOOP, __pa(params));
+	else
+		err = -EINVAL;
+
+	mutex_unlock(&jailhouse_lock);
+
+out:
+	kfree(settings);
+	kfree(params);
+
+	return err;
+}
+
+/* Common part of JAILHOUSE_QOS_QUERY and JAILHOUSE_QOS_SNAPSHOT */
+static int jailhouse_cmd_qos_readback(struct jailhouse_qos_readback __user *arg,
+				      unsigned long code, size_t entry_size,
+				      unsigned int max_entries)
+{
+	struct jailhouse_qos_readback readback;
+	void *buffer;
+	int err;
+
+	if (copy_from_user(&readback, arg, sizeof(readback)))
+		return -EFAULT;
+
+	if (readback.max_entries == 0)
+		return -EINVAL;
+	if (readback.max_entries > max_entries)
+		readback.max_entries = max_entries;
+
+	buffer = kmalloc_array(readback.max_entries, entry_size, GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
+
+	if (mutex_lock_interruptible(&jailhouse_lock) != 0) {
+		err = -EINTR;
+		goto out;
+	}
+
+	if (jailhouse_enabled)
+		err = jailhouse_call_arg2(code, readback.max_entries,
+					  __pa(buffer));
+	else
+		err = -EINVAL;
+
+	mutex_unlock(&jailhouse_lock);
+
+	/* On success, the number of entries is returned */
+	if (err > 0 &&
+	    copy_to_user((void __user *)(unsigned long)readback.buffer, buffer,
+			 err * entry_size))
+		err = -EFAULT;
+
+out:
+	kfree(buffer);
+
+	return err;
+}
+
 static long jailhouse_ioctl(struct file *file, unsigned int ioctl,
 			    unsigned long arg)
 {
@@ -876,10 +1084,38 @@ static long jailhouse_ioctl(struct file *file, unsigned int ioctl,
 		err = jailhouse_cmd_cell_memguard(
 			(struct jailhouse_memguard_args __user *)arg);
 		break;
+	case JAILHOUSE_CELL_RECOLOR:
+		err = jailhouse_cmd_cell_recolor(
+			(struct jailhouse_cell_recolor __user *)arg);
+		break;
 	case JAILHOUSE_QOS:
 		err = jailhouse_cmd_qos(
 			(struct jailhouse_qos_args __user *)arg);
 	    break;		
+	case JAILHOUSE_QOS_COMPILE:
+		err = jailhouse_cmd_qos_compile(
+			(struct jailhouse_qos_compile __user *)arg);
+		break;
+	case JAILHOUSE_QOS_APPLY:
+		err = jailhouse_cmd_qos_apply(
+			(struct jailhouse_qos_apply __user *)arg);
+		break;
+	case JAILHOUSE_QOS_QUERY:
+		err = jailhouse_cmd_qos_readback(
+			(struct jailhouse_qos_readback __user *)arg,
+			JAILHOUSE_HC_QOS_QUERY, sizeof(struct qos_setting),
+			QOS_MAX_QUERY);
+		break;
+	case JAILHOUSE_QOS_SNAPSHOT:
+		err = jailhouse_cmd_qos_readback(
+			(struct jailhouse_qos_readback __user *)arg,
+			JAILHOUSE_HC_QOS_SNAPSHOT, sizeof(struct qos_op),
+			QOS_MAX_OPS);
+		break;
+	case JAILHOUSE_QOS_LOOP:
+		err = jailhouse_cmd_qos_loop(
+			(struct jailhouse_qos_loop __user *)arg);
+		break;
 	default:
 		err = -EINVAL;
 		break;
@@ -15,6 +15,7 @@
 #include "main.h"
 #include "sysfs.h"
 
+#include <jailhouse/header.h>
 #include <jailhouse/hypercall.h>
 
 /* For compatibility with older kernel versions */
@@ -532,6 +533,17 @@ static ssize_t core_show(struct file *filp, struct kobject *kobj,
 				       attr->size);
 }
 
+static ssize_t memguard_trace_show(struct file *filp, struct kobject *kobj,
+				   struct bin_attribute *attr, char *buf,
+				   loff_t off, size_t count)
+{
+	struct jailhouse_header *header = hypervisor_mem;
+
+	return memory_read_from_buffer(buf, count, &off,
+				       hypervisor_mem + header->memguard_trace,
+				       attr->size);
+}
+
 static DEVICE_ATTR_RO(console);
 static DEVICE_ATTR_RO(enabled);
 static DEVICE_ATTR_RO(mem_pool_size);
@@ -560,14 +572,33 @@ static struct bin_attribute bin_attr_core = {
 	.read = core_show,
 };
 
+static struct bin_attribute bin_attr_memguard_trace = {
+	.attr.name = "memguard_trace",
+	.attr.mode = S_IRUSR,
+	.read = memguard_trace_show,
+};
+
 int jailhouse_sysfs_core_init(struct device *dev, size_t hypervisor_size)
 {
+	struct jailhouse_header *header = hypervisor_mem;
+	int err;
+
 	bin_attr_core.size = hypervisor_size;
-	return sysfs_create_bin_file(&dev->kobj, &bin_attr_core);
+	err = sysfs_create_bin_file(&dev->kobj, &bin_attr_core);
+	if (err || header->memguard_trace_size == 0)
+		return err;
+
+	bin_attr_memguard_trace.size = header->memguard_trace_size;
+	err = sysfs_create_bin_file(&dev->kobj, &bin_attr_memguard_trace);
+	if (err)
+		sysfs_remove_bin_file(&dev->kobj, &bin_attr_core);
+
+	return err;
 }
 
 void jailhouse_sysfs_core_exit(struct device *dev)
 {
+	sysfs_remove_bin_file(&dev->kobj, &bin_attr_memguard_trace);
 	sysfs_remove_bin_file(&dev->kobj, &bin_attr_core);
 }
 
@@ -107,8 +107,10 @@ static void check_events(struct public_per_cpu *cpu_public)
 	 */
 	if (cpu_public->wait_for_poweron)
 		arm_cpu_park();
-	else if (reset)
+	else if (reset) {
 		arm_cpu_reset(cpu_public->cpu_on_entry);
+		memguard_cpu_reset(this_cell());
+	}
 }
 
 void arch_handle_sgi(u32 irqn, unsigned int count_event)
@@ -157,6 +159,12 @@ bool arch_handle_phys_irq(u32 irqn, unsigned int count_event)
 
 int arch_cell_create(struct cell *cell)
 {
+	int err;
+
+	err = memguard_cell_init(cell);
+	if (err)
+		return err;
+
 	return arm_paging_cell_init(cell);
 }
 
@@ -15,7 +15,6 @@
 #include <asm/gic.h>
 #include <asm/gic_v2.h>
 #include <asm/irqchip.h>
-#include <asm/memguard.h>
 
 /* The GICv2 interface numbering does not necessarily match the logical map */
 static u8 gicv2_target_cpu_map[8];
@@ -90,9 +89,6 @@ static void gicv2_cpu_reset(struct per_cpu *cpu_data)
 	/* Disable PPIs, except for the maintenance interrupt. */
 	mmio_write32(gicd_base + GICD_ICENABLER, 0xffff0000 & ~(1 << mnt_irq));
 
-	/* Initialize MemGuard */
-	memguard_init(gicv2_target_cpu_map[cpu_data->public.cpu_id]);
-
 	/* Deactivate all active PPIs */
 	mmio_write32(gicd_base + GICD_ICACTIVER, 0xffff0000);
 
@@ -180,8 +176,6 @@ static int gicv2_cpu_init(struct per_cpu *cpu_data)
 		}
 	}
 
-	memguard_init(gicv2_target_cpu_map[cpu_data->public.cpu_id]);
-	
 	return 0;
 }
 
@@ -193,9 +187,6 @@ static int gicv2_cpu_shutdown(struct public_per_cpu *cpu_public)
 	if (!cpu_public->gicc_initialized)
 		return -ENODEV;
 
-	/* Stop MemGuard */
-	memguard_exit();
-	
 	mmio_write32(gich_base + GICH_HCR, 0);
 
 	/* Disable the maintenance interrupt - not used by Linux. */
@@ -512,6 +503,34 @@ static u64 gicv2_get_cluster_target(unsigned int cpu_id)
 	return 0;
 }
 
+static u8 gicv2_get_irq_priority(u16 irq_id)
+{
+	return mmio_read8(gicd_base + GICD_IPRIORITYR + irq_id);
+}
+
+static void gicv2_set_irq_priority(u16 irq_id, u8 prio)
+{
+	mmio_write8(gicd_base + GICD_IPRIORITYR + irq_id, prio);
+}
+
+static void gicv2_enable_irq(u16 irq_id, bool enable)
+{
+	mmio_write32(gicd_base + (enable ? GICD_ISENABLER : GICD_ICENABLER) +
+		     (irq_id / 32) * 4, 1 << (irq_id % 32));
+}
+
+static void gicv2_route_irq(u16 irq_id, unsigned int cpu_id)
+{
+	if (is_spi(irq_id))
+		mmio_write8(gicd_base + GICD_ITARGETSR + irq_id,
+			    gicv2_target_cpu_map[cpu_id]);
+}
+
+static void gicv2_set_priority_mask(u8 mask)
+{
+	mmio_write32(gicc_base + GICC_PMR, mask);
+}
+
 const struct irqchip gicv2_irqchip = {
 	.init = gicv2_init,
 	.cpu_init = gicv2_cpu_init,
@@ -537,5 +556,11 @@ const struct irqchip gicv2_irqchip = {
 	.get_cpu_target = gicv2_get_cpu_target,
 	.get_cluster_target = gicv2_get_cluster_target,
 
+	.get_irq_priority = gicv2_get_irq_priority,
+	.set_irq_priority = gicv2_set_irq_priority,
+	.enable_irq = gicv2_enable_irq,
+	.route_irq = gicv2_route_irq,
+	.set_priority_mask = gicv2_set_priority_mask,
+
 	.gicd_size = 0x1000,
 };
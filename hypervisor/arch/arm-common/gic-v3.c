@@ -680,6 +680,43 @@ static u64 gicv3_get_cluster_target(unsigned int cpu_id)
 	return public_per_cpu(cpu_id)->mpidr & MPIDR_CLUSTERID_MASK;
 }
 
+/* SGIs and PPIs are configured in the redistributor of the current CPU */
+static void *gicv3_irq_regs(u16 irq_id)
+{
+	if (is_spi(irq_id))
+		return gicd_base;
+	return this_cpu_public()->gicr.base + GICR_SGI_BASE;
+}
+
+static u8 gicv3_get_irq_priority(u16 irq_id)
+{
+	return mmio_read8(gicv3_irq_regs(irq_id) + GICD_IPRIORITYR + irq_id);
+}
+
+static void gicv3_set_irq_priority(u16 irq_id, u8 prio)
+{
+	mmio_write8(gicv3_irq_regs(irq_id) + GICD_IPRIORITYR + irq_id, prio);
+}
+
+static void gicv3_enable_irq(u16 irq_id, bool enable)
+{
+	mmio_write32(gicv3_irq_regs(irq_id) +
+		     (enable ? GICD_ISENABLER : GICD_ICENABLER) +
+		     (irq_id / 32) * 4, 1 << (irq_id % 32));
+}
+
+static void gicv3_route_irq(u16 irq_id, unsigned int cpu_id)
+{
+	if (is_spi(irq_id))
+		mmio_write64(gicd_base + GICD_IROUTER + 8 * irq_id,
+			     public_per_cpu(cpu_id)->mpidr & MPIDR_CPUID_MASK);
+}
+
+static void gicv3_set_priority_mask(u8 mask)
+{
+	arm_write_sysreg(ICC_PMR_EL1, mask);
+}
+
 const struct irqchip gicv3_irqchip = {
 	.init = gicv3_init,
 	.cpu_init = gicv3_cpu_init,
@@ -701,5 +738,11 @@ const struct irqchip gicv3_irqchip = {
 	.get_cpu_target = gicv3_get_cpu_target,
 	.get_cluster_target = gicv3_get_cluster_target,
 
+	.get_irq_priority = gicv3_get_irq_priority,
+	.set_irq_priority = gicv3_set_irq_priority,
+	.enable_irq = gicv3_enable_irq,
+	.route_irq = gicv3_route_irq,
+	.set_priority_mask = gicv3_set_priority_mask,
+
 	.gicd_size = 0x10000,
 };
@@ -16,6 +16,7 @@
 #include <jailhouse/paging.h>
 
 struct pvu_tlb_entry;
+struct col_run;
 
 struct arch_cell {
 	struct paging_structures mm;
@@ -31,6 +32,13 @@ struct arch_cell {
 		/* For SMMUv2 and SMMUv3 */
 		struct paging_structures iomm;
 	};
+
+	/* Translation of the colored memory, sorted by guest address */
+	struct col_run *col_runs;
+	unsigned int col_num_runs;
+
+	/* QoS profile is part of the applied interconnect configuration */
+	bool qos_active;
 };
 
 #endif /* !_JAILHOUSE_ASM_CELL_H */
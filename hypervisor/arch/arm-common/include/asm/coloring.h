@@ -22,7 +22,22 @@
 
 typedef enum {CREATE, DESTROY, START, LOAD, DCACHE,
 	      SMMU_CREATE, SMMU_DESTROY,
-	      HV_CREATE, HV_DESTROY} col_operation;
+	      HV_CREATE, HV_DESTROY, REMAP, RUNS} col_operation;
+
+/**
+ * Physically contiguous piece of the colored memory of a cell. The runs
+ * of a cell are computed once when it is created.
+ */
+struct col_run {
+	/** Guest-physical start address. */
+	unsigned long gphys;
+	/** Physical start address. */
+	unsigned long phys;
+	/** Length in pages. */
+	u32 pages;
+	/** Index of the colored region in the cell configuration. */
+	u32 region;
+};
 
 extern struct jailhouse_system *system_config;
 
@@ -48,6 +63,8 @@ struct col_manage_ops {
 	int (*unmap_f)(struct cell *cell, const struct jailhouse_memory *mem);
 	/* Unmap a memory region from the SMMU tables of the cell */
 	int (*smmu_unmap_f)(struct cell *cell, const struct jailhouse_memory *mem);
+	/* Invalidate the SMMU TLBs after live mappings were changed */
+	void (*smmu_flush_f)(void);
 
 	/* unmap_from_root_cell if cell is starting and mem is loadable*/
 	int (*unmap_root_f)(const struct jailhouse_memory* mem);
@@ -66,6 +83,89 @@ extern struct col_manage_ops col_ops;
 */
 int __coloring_cell_apply_to_col_mem(struct cell *cell, col_operation type, void * extra);
 
+/**
+ * Translate a guest-physical address inside the colored memory of a cell.
+ * @param cell		Cell the address belongs to.
+ * @param gphys		Guest-physical address.
+ *
+ * @return Physical address or @c INVALID_PHYS_ADDR if @c gphys is not
+ * part of a colored region.
+ */
+unsigned long coloring_gphys2phys(struct cell *cell, unsigned long gphys);
+
+/**
+ * Help with a pending root-cell recoloring, if any. Called by root-cell
+ * CPUs while they wait for the master CPU during enable and disable.
+ */
+void coloring_recolor_assist(void);
+
+/**
+ * Identify the caches of the master CPU and place the hypervisor page pool
+ * in the colors given by the system configuration, if any. Called from
+ * arch_paging_init().
+ */
+void coloring_paging_init(void);
+
+/**
+ * Identify the caches of the calling CPU if its cluster is not known yet
+ * and reduce the common number of colors accordingly. Called on each CPU
+ * from arch_cpu_init().
+ *
+ * @return 0 on success, negative error code otherwise.
+ */
+int coloring_cpu_init(void);
+
+/**
+ * Move the hypervisor code and read-only data into the colors of the page
+ * pool. They are never written, so the copies can replace the originals
+ * in the hypervisor page tables before any CPU switched to them.
+ *
+ * @return 0 on success, negative error code otherwise.
+ */
+int coloring_hv_text(void);
+
+/**
+ * Prepare moving a colored region of a running cell to another set of
+ * colors. The move is then carried out by coloring_cell_recolor_step(),
+ * the root cell may run between the steps.
+ * @param cell		Target cell, neither the root cell nor loadable.
+ * @param region	Index of the colored region in the cell config.
+ * @param colors	New color mask of the region.
+ *
+ * @return 0 on success, negative error code otherwise.
+ */
+int coloring_cell_recolor_prepare(struct cell *cell, unsigned int region,
+				  u64 colors);
+
+/**
+ * Move the next batch of pages of a prepared recoloring. Has to be
+ * called with the cell suspended, its TLBs flushed before resuming it.
+ * After an error, the recoloring stays pending and the cell can only be
+ * destroyed.
+ * @param cell		Cell passed to coloring_cell_recolor_prepare().
+ *
+ * @return Positive value while pages are left, 0 when the region reached
+ * its new colors, negative error code otherwise.
+ */
+int coloring_cell_recolor_step(struct cell *cell);
+
+/**
+ * Check if a recoloring is in progress. Cells cannot be created or managed
+ * until it completed.
+ *
+ * @return True while a prepared recoloring has pages left or failed.
+ */
+bool coloring_recolor_pending(void);
+
+/**
+ * Check if the recoloring of a cell failed. Destroying the cell ends the
+ * recoloring.
+ * @param cell		Cell to check.
+ *
+ * @return True if a step of the recoloring of @c cell failed.
+ */
+bool coloring_recolor_failed(struct cell *cell);
+
 #define coloring_cell_create(cell)	\
     __coloring_cell_apply_to_col_mem(cell, CREATE, NULL)
 
@@ -58,6 +58,13 @@ struct irqchip {
 	int 	(*get_cpu_target)(unsigned int cpu_id);
 	u64 	(*get_cluster_target)(unsigned int cpu_id);
 
+	/* Physical interrupts owned by the hypervisor (e.g. MemGuard) */
+	u8	(*get_irq_priority)(u16 irq_id);
+	void	(*set_irq_priority)(u16 irq_id, u8 prio);
+	void	(*enable_irq)(u16 irq_id, bool enable);
+	void	(*route_irq)(u16 irq_id, unsigned int cpu_id);
+	void	(*set_priority_mask)(u8 mask);
+
 	enum mmio_result (*handle_irq_route)(struct mmio_access *mmio,
 					     unsigned int irq);
 	enum mmio_result (*handle_irq_target)(struct mmio_access *mmio,
@@ -99,6 +106,13 @@ void irqchip_set_pending(struct public_per_cpu *cpu_public, u16 irq_id);
 
 void irqchip_trigger_external_irq(u16 irq_id);
 
+unsigned int irqchip_num_irqs(void);
+u8 irqchip_get_irq_priority(u16 irq_id);
+void irqchip_set_irq_priority(u16 irq_id, u8 prio);
+void irqchip_enable_irq(u16 irq_id, bool enable);
+void irqchip_route_irq(u16 irq_id, unsigned int cpu_id);
+void irqchip_set_priority_mask(u8 mask);
+
 bool irqchip_irq_in_cell(struct cell *cell, unsigned int irq_id);
 
 #endif /* __ASSEMBLY__ */
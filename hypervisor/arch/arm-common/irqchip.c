@@ -316,6 +316,41 @@ void irqchip_trigger_external_irq(u16 irq_id)
 		     1 << (irq_id % 32));
 }
 
+/* Number of interrupt IDs implemented by the distributor */
+unsigned int irqchip_num_irqs(void)
+{
+	u32 typer = mmio_read32(gicd_base + GICD_TYPER);
+
+	return MIN(((typer & GICD_TYPER_ITLINES_MASK) + 1) * 32, 1020);
+}
+
+u8 irqchip_get_irq_priority(u16 irq_id)
+{
+	return irqchip.get_irq_priority(irq_id);
+}
+
+void irqchip_set_irq_priority(u16 irq_id, u8 prio)
+{
+	irqchip.set_irq_priority(irq_id, prio);
+}
+
+void irqchip_enable_irq(u16 irq_id, bool enable)
+{
+	irqchip.enable_irq(irq_id, enable);
+}
+
+/* Route an SPI to a CPU, no-op for banked SGIs and PPIs */
+void irqchip_route_irq(u16 irq_id, unsigned int cpu_id)
+{
+	irqchip.route_irq(irq_id, cpu_id);
+}
+
+/* Set the priority mask of the physical CPU interface of this CPU */
+void irqchip_set_priority_mask(u8 mask)
+{
+	irqchip.set_priority_mask(mask);
+}
+
 int irqchip_send_sgi(struct sgi *sgi)
 {
 	return irqchip.send_sgi(sgi);
@@ -351,7 +386,13 @@ int irqchip_cpu_init(struct per_cpu *cpu_data)
 		irqchip_is_init = true;
 	}
 
-	return irqchip.cpu_init(cpu_data);
+	err = irqchip.cpu_init(cpu_data);
+	if (err)
+		return err;
+
+	memguard_init();
+
+	return 0;
 }
 
 int irqchip_get_cpu_target(unsigned int cpu_id)
@@ -370,6 +411,8 @@ void irqchip_cpu_reset(struct per_cpu *cpu_data)
 	cpu_data->public.pending_irqs.tail = 0;
 
 	irqchip.cpu_reset(cpu_data);
+
+	memguard_init();
 }
 
 void irqchip_cpu_shutdown(struct public_per_cpu *cpu_public)
@@ -386,6 +429,8 @@ void irqchip_cpu_shutdown(struct public_per_cpu *cpu_public)
 	if (irqchip.cpu_shutdown(cpu_public) < 0)
 		return;
 
+	memguard_exit();
+
 	/*
 	 * Migrate interrupts queued in the GICV.
 	 * No locking required at this stage because no other CPU is able to
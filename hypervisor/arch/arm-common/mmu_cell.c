@@ -18,11 +18,13 @@
 #include <asm/iommu.h>
 #include <asm/coloring.h>
 
-int arch_map_memory_region(struct cell *cell,
-			   const struct jailhouse_memory *mem)
+int arm_map_memory_region_flags(struct cell *cell,
+				const struct jailhouse_memory *mem,
+				unsigned long extra_flags)
 {
 	u64 phys_start = mem->phys_start;
-	unsigned long access_flags = PTE_FLAG_VALID | PTE_ACCESS_FLAG;
+	unsigned long access_flags =
+		PTE_FLAG_VALID | PTE_ACCESS_FLAG | extra_flags;
 	unsigned long paging_flags = PAGING_COHERENT | PAGING_HUGE;
 	int err = 0;
 
@@ -55,6 +57,12 @@ int arch_map_memory_region(struct cell *cell,
 	return err;
 }
 
+int arch_map_memory_region(struct cell *cell,
+			   const struct jailhouse_memory *mem)
+{
+	return arm_map_memory_region_flags(cell, mem, 0);
+}
+
 int arch_unmap_memory_region(struct cell *cell,
 			     const struct jailhouse_memory *mem)
 {
@@ -74,6 +82,42 @@ unsigned long arch_paging_gphys2phys(unsigned long gphys, unsigned long flags)
 	return paging_virt2phys(&this_cell()->arch.mm, gphys, flags);
 }
 
+/*
+ * The stage-2 walk of arch_paging_gphys2phys() only checks that an entry is
+ * valid. Before the hypervisor writes to cell memory, the cell itself has
+ * to be allowed to write it.
+ */
+bool arm_cell_mem_writable(struct cell *cell, unsigned long gphys,
+			   unsigned long size)
+{
+	unsigned long end = gphys + size;
+	const struct paging *paging;
+	page_table_t pt;
+	pt_entry_t pte;
+
+	if (end < gphys)
+		return false;
+
+	for (gphys &= PAGE_MASK; gphys < end; gphys += PAGE_SIZE) {
+		paging = cell->arch.mm.root_paging;
+		pt = cell->arch.mm.root_table;
+		while (1) {
+			pte = paging->get_entry(pt, gphys);
+			if (!paging->entry_valid(pte, PTE_FLAG_VALID))
+				return false;
+			if (paging->get_phys(pte, gphys) != INVALID_PHYS_ADDR)
+				break;
+			pt = paging_phys2hvirt(paging->get_next_pt(pte));
+			paging++;
+		}
+		if ((paging->get_flags(pte) & S2_PTE_ACCESS_RW) !=
+		    S2_PTE_ACCESS_RW)
+			return false;
+	}
+
+	return true;
+}
+
 void arm_cell_dcaches_flush(struct cell *cell, enum dcache_flush flush)
 {
 	unsigned long region_addr, region_size, size;
@@ -10,7 +10,9 @@
  * the COPYING file in the top-level directory.
  */
 
+#include <jailhouse/control.h>
 #include <jailhouse/paging.h>
+#include <asm/coloring.h>
 
 unsigned int cpu_parange = 0;
 
@@ -227,4 +229,6 @@ void arch_paging_init(void)
 		cell_paging = arm_paging;
 
 	hv_paging_structs.root_paging = arm_paging;
+
+	coloring_paging_init();
 }
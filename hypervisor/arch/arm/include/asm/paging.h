@@ -174,6 +174,7 @@
 #ifndef __ASSEMBLY__
 
 struct cell;
+struct jailhouse_memory;
 struct paging_structures;
 
 typedef u64 *pt_entry_t;
@@ -182,7 +183,12 @@ extern unsigned int cpu_parange;
 extern unsigned int cache_line_size;
 
 int arm_paging_cell_init(struct cell *cell);
+int arm_map_memory_region_flags(struct cell *cell,
+				const struct jailhouse_memory *mem,
+				unsigned long extra_flags);
 void arm_paging_cell_destroy(struct cell *cell);
+bool arm_cell_mem_writable(struct cell *cell, unsigned long gphys,
+			   unsigned long size);
 
 void arm_paging_vcpu_init(struct paging_structures *pg_structs);
 
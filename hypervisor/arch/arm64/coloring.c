@@ -18,12 +18,14 @@
 #include <jailhouse/control.h>
 #include <jailhouse/paging.h>
 #include <jailhouse/printk.h>
+#include <jailhouse/processor.h>
 #include <jailhouse/string.h>
 #include <asm/control.h>
 #include <jailhouse/unit.h>
 #include <jailhouse/cell.h>
 #include <jailhouse/mmio.h>
 #include <asm/coloring.h>
+#include <asm/spinlock.h>
 
 #define col_print(fmt, ...)			\
 	printk("[COL] " fmt, ##__VA_ARGS__)
@@ -53,26 +55,58 @@ enum clidr_ctype {
 #define flush_colored_region(col_mem, cell, flush)	\
     __manage_colored_regions(col_mem, cell, DCACHE, (void *)flush)
 
+/* Smallest block descriptor and contiguous-hint run of stage 2 */
+#define COL_BLOCK_SIZE		(BLOCK_2M_VADDR_MASK + 1)
+#define COL_CONT_SIZE		(PTE_CONT_PAGES * PAGE_SIZE)
+
+extern u8 __text_start[], __rodata_end[];
+
 const char * cache_types[] = {"Not present", "Instr. Only", "Data Only", "I+D Split", "Unified"};
 
-/* An SMMUv2 instance */
+/* Common coloring granularity of all clusters */
 static struct cache {
 	u64 fragment_unit_size;
 	u64 fragment_unit_offset;
-	/* Total size of the cache in bytes */
-	u64 size;
-	/* Size of a single way in bytes */
-	u64 line_size;
-	/* Size of each cache line in bytes */
+	/* Size of a single way in bytes, the smallest of all clusters */
 	u64 way_size;
-	/* Associativity */
-	u32 assoc;
-	/* Max number of colors supported by this cache */
+	/* Max number of colors supported by all clusters */
 	u64 colors;
-	/* Which level is this cache at */
+	/* Coloring level of the first cluster, -1 if coloring is not
+	 * possible in at least one cluster */
 	int level;
 } cache;
 
+#define COL_MAX_CLUSTERS	8
+
+/* Caches of one CPU cluster */
+struct col_cluster {
+	/* MPIDR affinity levels 1 to 3 */
+	unsigned long id;
+	/* Level used for coloring, -1 if none */
+	int level;
+	/* Size of each cache line in bytes */
+	u64 line_size;
+	/* Size of a single way in bytes */
+	u64 way_size;
+	/* Associativity */
+	u32 assoc;
+};
+
+static struct col_cluster clusters[COL_MAX_CLUSTERS];
+static unsigned int num_clusters;
+
+/* Translation statistics of the last colored CREATE operation */
+static struct {
+	/* Color-contiguous fragments of the colored regions */
+	unsigned long fragments;
+	/* Mappings left after merging physically adjacent fragments */
+	unsigned long mappings;
+	/* Bytes covered by block descriptors */
+	unsigned long block_size;
+	/* Bytes mapped with the contiguous hint */
+	unsigned long cont_size;
+} col_map_stats;
+
 /* This is a global struct initialized at setup time */
 struct col_manage_ops col_ops = {
 	.map_f = arch_map_memory_region,
@@ -81,13 +115,30 @@ struct col_manage_ops col_ops = {
 	.unmap_root_f = unmap_from_root_cell,
 	.unmap_f = arch_unmap_memory_region,
 	.smmu_unmap_f = NULL, /* Will be initialized by the SMMU support */
+	.smmu_flush_f = NULL, /* Will be initialized by the SMMU support */
 	.remap_root_f = remap_to_root_cell,
 };
 
-static int coloring_cache_detect(void)
+static struct col_cluster *col_cluster_find(unsigned long mpidr)
+{
+	unsigned int n;
+
+	for (n = 0; n < num_clusters; n++)
+		if (clusters[n].id == (mpidr & MPIDR_CLUSTERID_MASK))
+			return &clusters[n];
+	return NULL;
+}
+
+/*
+ * Read the caches of the calling CPU. The coloring level is the one given
+ * by the system configuration or, if none is given, the last unified one.
+ */
+static void col_cluster_detect(struct col_cluster *cl)
 {
 	/* First, parse CLIDR_EL1 to understand how many levels are
 	 * present in the system. */
+	unsigned int selected =
+		system_config->platform_info.arm.coloring_cache_level;
 	u64 reg, type;
 	int i;
 	
@@ -95,7 +146,7 @@ static int coloring_cache_detect(void)
 
 	/* Initialize this field to detect when no suitable caches
 	 * have been found */
-	cache.level = -1;
+	cl->level = -1;
 	
 	for (i = 1; i <= MAX_CACHE_LEVELS; ++i) {
 		u64 geom, assoc, ls, sets;
@@ -119,6 +170,22 @@ static int coloring_cache_detect(void)
 		col_print("\t\tAssoc.: %lld\n", assoc);
 		col_print("\t\tNum. sets: %lld\n", sets);
 
+		/* Perform coloring at the selected or the last unified
+		 * cache level, if a way holds at least one page */
+		if (((selected == 0 && type == CLIDR_CTYPE_UNIFIED) ||
+		     (selected == i && type != CLIDR_CTYPE_IONLY)) &&
+		    ls * sets >= PAGE_SIZE) {
+			cl->level = i;
+			
+			cl->line_size = ls;
+			cl->way_size = ls * sets;
+			cl->assoc = assoc;
+
+			/* Compute the max. number of colors */
+			col_print("\t\tNum. colors: %lld\n",
+				  sets / (PAGE_SIZE / ls));
+		}
+
 		if (type == CLIDR_CTYPE_IDSPLIT) {
 			arm_write_sysreg(csselr_el1, FIELD_PREP(CSSELR_LEVEL, i-1) | CSSELR_IND);
 			arm_read_sysreg(ccsidr_el1, geom);
@@ -131,115 +198,486 @@ static int coloring_cache_detect(void)
 			col_print("\t\tLine size (I): %lld\n", ls);
 			col_print("\t\tAssoc. (I): %lld\n", assoc);
 			col_print("\t\tNum. sets (I): %lld\n", sets);
-
 		}
 		
-		/* Perform coloring at the last unified cache level */
-		if (type == CLIDR_CTYPE_UNIFIED) {
-			cache.level = i;
-			
-			cache.size = ls * assoc * sets;
-			cache.line_size = ls;
-			cache.way_size = ls * sets;
-			cache.assoc = assoc;
-			cache.colors = sets / (PAGE_SIZE / ls);
+	}
 
-			/* Compute the max. number of colors */
-			col_print("\t\tNum. colors: %lld\n", cache.colors);			
-		}
-		
+	if (cl->level == -1)
+		col_print("\tNOTE: No cache suitable for coloring.\n");
+	else
+		col_print("\tNOTE: L%d Cache selected for coloring.\n",
+			  cl->level);
+}
+
+/*
+ * A page of color c in a cache of N colors falls into colors c, c + N,
+ * ... of a cache with a multiple of N colors. Coloring with the smallest
+ * way size of all clusters therefore keeps cells apart in every cluster,
+ * as long as all way sizes are multiples of it.
+ */
+static void col_cluster_merge(const struct col_cluster *cl)
+{
+	unsigned int n;
+
+	if (cache.level == -1)
+		return;
+
+	if (cl->level == -1) {
+		printk("WARNING: Cluster 0x%lx has no cache to color, "
+		       "coloring disabled\n", cl->id);
+		cache.level = -1;
+		return;
 	}
 
-	col_print("\tNOTE: L%d Cache selected for coloring.\n", cache.level);
-	
+	if (cl->way_size < cache.way_size)
+		cache.way_size = cl->way_size;
+
+	for (n = 0; n < num_clusters; n++)
+		if (clusters[n].way_size % cache.way_size) {
+			printk("WARNING: Cache way sizes of the clusters "
+			       "are incompatible, coloring disabled\n");
+			cache.level = -1;
+			return;
+		}
+
 	/* Backward compatibility properties. TODO: remove these */
+	cache.colors = cache.way_size / PAGE_SIZE;
 	cache.fragment_unit_size = PAGE_SIZE;
 	cache.fragment_unit_offset = cache.way_size;
+}
+
+int coloring_cpu_init(void)
+{
+	unsigned long mpidr = phys_processor_id();
+	struct col_cluster *cl;
+
+	if (col_cluster_find(mpidr))
+		return 0;
+
+	if (num_clusters == COL_MAX_CLUSTERS) {
+		printk("ERROR: Too many clusters for coloring\n");
+		return -E2BIG;
+	}
+
+	cl = &clusters[num_clusters++];
+	cl->id = mpidr & MPIDR_CLUSTERID_MASK;
+
+	col_print("Caches of cluster 0x%lx:\n", cl->id);
+	col_cluster_detect(cl);
 
-	return (cache.level == -1);
+	if (num_clusters == 1) {
+		cache.level = cl->level;
+		cache.way_size = cl->way_size;
+	}
+	col_cluster_merge(cl);
+
+	return 0;
 }
 
-/** 
- *   Perform a copy of memory from a non-colored space to a colored
- *   space. The two spaces could be overlapping in physical memory, so
- *   go in reverse. Also map the contiguous space a bit at a time to
- *   take it easy on the pool pages.
+/*
+ * DRAM bank partitioning. Bank bits must lie in the range of address
+ * bits allowed below, which bounds the period after which the layout
+ * of a colored region repeats.
  */
-static void colored_copy(const struct jailhouse_memory_colored * col_mem)
+#define COL_BANK_MIN_SHIFT	PAGE_SHIFT
+#define COL_BANK_MAX_SHIFT	22
+#define COL_PERIOD_PAGES	(1UL << (COL_BANK_MAX_SHIFT - PAGE_SHIFT))
+
+static int col_bank_check(const struct jailhouse_memory_colored *col_mem)
 {
-	unsigned long phys_addr, tot_size, size;
-	int i;
-	
-	tot_size = col_mem->memory.size;
+	unsigned int bits = 0;
+	u64 mask;
 
-	/* Find the first page that does not belong to the non-colored
-	 * mapping */
-	phys_addr = col_mem->memory.phys_start + tot_size;
-	
-	while (tot_size > 0) {
-		size = MIN(tot_size,
-			   NUM_TEMPORARY_PAGES * PAGE_SIZE);
-		
-		phys_addr -= size;
-		/* If we have reached the beginning (end of copy),
-		 * make sure we do not exceed the boundary of the
-		 * region */
-		if (phys_addr < col_mem->memory.phys_start)
-			phys_addr = col_mem->memory.phys_start;
-		
-		/* cannot fail, mapping area is preallocated */
-		paging_create(&this_cpu_data()->pg_structs, phys_addr,
-			      size, TEMPORARY_MAPPING_BASE,
-			      PAGE_DEFAULT_FLAGS,
-			      PAGING_NON_COHERENT | PAGING_NO_HUGE);
+	if (col_mem->bank_mask == 0)
+		return 0;
+
+	for (mask = col_mem->bank_mask; mask; mask &= mask - 1)
+		bits++;
+
+	if (col_mem->bank_mask & ((1UL << COL_BANK_MIN_SHIFT) - 1) ||
+	    col_mem->bank_mask >> COL_BANK_MAX_SHIFT ||
+	    bits > JAILHOUSE_MAX_BANK_BITS ||
+	    (col_mem->banks & (((1ULL << bits) - 1))) == 0)
+		return trace_error(-EINVAL);
+
+	return 0;
+}
+
+/* Whether the page at @phys belongs to a DRAM bank of the region */
+static bool col_bank_allowed(const struct jailhouse_memory_colored *col_mem,
+			     unsigned long phys)
+{
+	unsigned int bank = 0, n = 0;
+	u64 mask;
+
+	if (col_mem->bank_mask == 0)
+		return true;
+
+	for (mask = col_mem->bank_mask; mask; mask &= mask - 1, n++)
+		bank |= ((phys >> ffsl(mask)) & 1) << n;
+
+	return (col_mem->banks >> bank) & 1;
+}
+
+/* Length of the period after which the layout of the region repeats */
+static unsigned long col_period(const struct jailhouse_memory_colored *col_mem)
+{
+	unsigned long bank_period = col_mem->bank_mask ?
+		2UL << (63 - clz(col_mem->bank_mask)) : 0;
+
+	return MAX(cache.fragment_unit_offset, bank_period);
+}
 
-		/* Actual data copy operation */
-		for (i = (size >> PAGE_SHIFT) - 1; i >= 0; --i) {
-			/* Destination: colored mapping created via HV_CREATE */
-			/* Source: non-colored mapping defined above */
-			memcpy((void *)ROOT_MAP_OFFSET + phys_addr + (i << PAGE_SHIFT),
-			       (void *)TEMPORARY_MAPPING_BASE + (i << PAGE_SHIFT),
-			       PAGE_SIZE);
+#define COL_PAGE_UNUSED		0xffff
+#define COL_INVALID_OFFSET	(~0UL)
+
+/*
+ * Layout of a colored region: the pages of one period it uses, which
+ * map region offsets to physical addresses and back. Same page
+ * selection as __manage_colored_region().
+ */
+struct col_layout {
+	unsigned long phys_start;
+	unsigned long size;
+	unsigned long period;
+	unsigned int num_pages;
+	/* Page index inside the period of each used page, in address order */
+	u16 page[COL_PERIOD_PAGES];
+	/* Rank of each page of the period among the used ones */
+	u16 rank[COL_PERIOD_PAGES];
+};
+
+static int col_layout_init(struct col_layout *layout,
+			   const struct jailhouse_memory_colored *col_mem,
+			   u64 colors)
+{
+	unsigned long max_colors = cache.fragment_unit_offset /
+		cache.fragment_unit_size;
+	unsigned long page, color;
+
+	layout->phys_start = col_mem->memory.phys_start;
+	layout->size = col_mem->memory.size;
+	layout->period = col_period(col_mem);
+	layout->num_pages = 0;
+
+	if (col_bank_check(col_mem) ||
+	    layout->period / PAGE_SIZE > COL_PERIOD_PAGES)
+		return -EINVAL;
+
+	for (page = 0; page < layout->period / PAGE_SIZE; page++) {
+		color = page % max_colors;
+		layout->rank[page] = COL_PAGE_UNUSED;
+		if (colors & (1ULL << (max_colors - 1 - color)) &&
+		    col_bank_allowed(col_mem, layout->phys_start +
+				     page * PAGE_SIZE)) {
+			layout->rank[page] = layout->num_pages;
+			layout->page[layout->num_pages++] = page;
 		}
-		
-		tot_size -= size;
 	}
-	
+
+	return layout->num_pages > 0 ? 0 : -EINVAL;
 }
 
-static void colored_uncopy(const struct jailhouse_memory_colored * col_mem)
+/* Physical address of the page at @offset into the region */
+static unsigned long col_layout_phys(const struct col_layout *layout,
+				     unsigned long offset)
 {
-	unsigned long phys_addr, tot_size, size;
-	int i;
-	
-	tot_size = col_mem->memory.size;
+	unsigned long page = offset >> PAGE_SHIFT;
+
+	return layout->phys_start +
+		(page / layout->num_pages) * layout->period +
+		layout->page[page % layout->num_pages] * PAGE_SIZE;
+}
+
+/* Region offset of the page at @phys, COL_INVALID_OFFSET if unused */
+static unsigned long col_layout_offset(const struct col_layout *layout,
+				       unsigned long phys)
+{
+	unsigned long delta = phys - layout->phys_start;
+	unsigned long rank, offset;
+
+	if (phys < layout->phys_start)
+		return COL_INVALID_OFFSET;
+
+	rank = layout->rank[(delta % layout->period) >> PAGE_SHIFT];
+	if (rank == COL_PAGE_UNUSED)
+		return COL_INVALID_OFFSET;
+
+	offset = ((delta / layout->period) * layout->num_pages + rank) <<
+		PAGE_SHIFT;
+	return offset < layout->size ? offset : COL_INVALID_OFFSET;
+}
+
+/*
+ * Root-cell recoloring engine.
+ *
+ * The content of a colored root-cell region is moved between its linear
+ * physical layout, the one Linux used before enabling, and the colored
+ * one. The region is cut into chunks of half a temporary window, and
+ * every root-cell CPU waiting in entry() or in the disable hypercall
+ * joins the master in copying them, each through its own temporary
+ * mappings.
+ *
+ * The colored copy of a page never lies below its linear copy. Chunks
+ * are therefore handed out from the top when coloring and from the
+ * bottom when un-coloring, pages are copied in the same direction, and
+ * a chunk whose destination overlaps the source of a chunk handed out
+ * earlier waits for that one to complete.
+ */
+#define RECOLOR_CHUNK_PAGES	(NUM_TEMPORARY_PAGES / 2)
+#define RECOLOR_CHUNK_SIZE	(RECOLOR_CHUNK_PAGES * PAGE_SIZE)
+#define RECOLOR_SRC_WINDOW	TEMPORARY_MAPPING_BASE
+#define RECOLOR_DST_WINDOW	(TEMPORARY_MAPPING_BASE + RECOLOR_CHUNK_SIZE)
+#define RECOLOR_IDLE		(~0UL)
+
+static struct {
+	spinlock_t lock;
+	const struct jailhouse_memory_colored *col_mem;
+	/* Copy into the colored layout (enable) or out of it (disable) */
+	bool to_colored;
+	unsigned long num_chunks;
+	/* Chunks handed out so far */
+	unsigned long claimed;
+	volatile unsigned long completed;
+	volatile unsigned int workers;
+	volatile bool active;
+	struct col_layout layout;
+} recolor;
+
+static unsigned long recolor_linear_phys(unsigned long offset)
+{
+	return recolor.col_mem->memory.phys_start + offset;
+}
+
+static unsigned long recolor_colored_phys(unsigned long offset)
+{
+	return col_layout_phys(&recolor.layout, offset);
+}
+
+static unsigned long recolor_src_phys(unsigned long offset)
+{
+	return recolor.to_colored ? recolor_linear_phys(offset) :
+		recolor_colored_phys(offset);
+}
+
+static unsigned long recolor_dst_phys(unsigned long offset)
+{
+	return recolor.to_colored ? recolor_colored_phys(offset) :
+		recolor_linear_phys(offset);
+}
+
+static unsigned long recolor_chunk_size(unsigned long chunk)
+{
+	return MIN(recolor.col_mem->memory.size - chunk * RECOLOR_CHUNK_SIZE,
+		   RECOLOR_CHUNK_SIZE);
+}
+
+/* Whether [start, end) of the @phys layout overlaps the other chunk */
+static bool recolor_overlaps(unsigned long chunk,
+			     unsigned long (*phys)(unsigned long),
+			     unsigned long start, unsigned long end)
+{
+	unsigned long offset = chunk * RECOLOR_CHUNK_SIZE;
+	unsigned long last = offset + recolor_chunk_size(chunk) - PAGE_SIZE;
+
+	/* Both layouts are monotonic in the region offset */
+	return phys(offset) < end && phys(last) + PAGE_SIZE > start;
+}
+
+/* Whether @chunk has to wait for the earlier handed out @other */
+static bool recolor_depends(unsigned long chunk, unsigned long other)
+{
+	unsigned long offset = chunk * RECOLOR_CHUNK_SIZE;
+	unsigned long last = offset + recolor_chunk_size(chunk) - PAGE_SIZE;
+
+	if (other == RECOLOR_IDLE ||
+	    (recolor.to_colored ? other < chunk : other > chunk))
+		return false;
+
+	return recolor_overlaps(other, recolor_src_phys,
+				recolor_dst_phys(offset),
+				recolor_dst_phys(last) + PAGE_SIZE) ||
+		recolor_overlaps(other, recolor_dst_phys,
+				 recolor_src_phys(offset),
+				 recolor_src_phys(last) + PAGE_SIZE);
+}
+
+/* Copy a page with non-temporal accesses, sparing the caches */
+static inline void recolor_copy_page(void *dst, const void *src)
+{
+	unsigned long left = PAGE_SIZE;
+	u64 a, b, c, d, e, f, g, h;
+
+	asm volatile(
+		"1:	ldnp	%[a], %[b], [%[src]]\n"
+		"	ldnp	%[c], %[d], [%[src], #16]\n"
+		"	ldnp	%[e], %[f], [%[src], #32]\n"
+		"	ldnp	%[g], %[h], [%[src], #48]\n"
+		"	stnp	%[a], %[b], [%[dst]]\n"
+		"	stnp	%[c], %[d], [%[dst], #16]\n"
+		"	stnp	%[e], %[f], [%[dst], #32]\n"
+		"	stnp	%[g], %[h], [%[dst], #48]\n"
+		"	add	%[src], %[src], #64\n"
+		"	add	%[dst], %[dst], #64\n"
+		"	subs	%[left], %[left], #64\n"
+		"	b.ne	1b\n"
+		: [src] "+r" (src), [dst] "+r" (dst), [left] "+r" (left),
+		  [a] "=&r" (a), [b] "=&r" (b), [c] "=&r" (c), [d] "=&r" (d),
+		  [e] "=&r" (e), [f] "=&r" (f), [g] "=&r" (g), [h] "=&r" (h)
+		: : "cc", "memory");
+}
+
+/* Map a layout of the chunk at @offset in one of the windows */
+static void recolor_map(unsigned long window,
+			unsigned long (*phys)(unsigned long),
+			unsigned long offset, unsigned long size)
+{
+	unsigned long start, run;
+
+	while (size > 0) {
+		start = phys(offset);
+		for (run = PAGE_SIZE;
+		     run < size && phys(offset + run) == start + run;
+		     run += PAGE_SIZE)
+			;
 
-	/* Find the first page in the non-colored mapping */
-	phys_addr = col_mem->memory.phys_start;
-	
-	while (tot_size > 0) {
-		size = MIN(tot_size,
-			   NUM_TEMPORARY_PAGES * PAGE_SIZE);
-		
 		/* cannot fail, mapping area is preallocated */
-		paging_create(&this_cpu_data()->pg_structs, phys_addr,
-			      size, TEMPORARY_MAPPING_BASE,
-			      PAGE_DEFAULT_FLAGS,
+		paging_create(&this_cpu_data()->pg_structs, start, run,
+			      window, PAGE_DEFAULT_FLAGS,
 			      PAGING_NON_COHERENT | PAGING_NO_HUGE);
 
-		/* Actual data copy operation */
-		for (i = 0; i < (size >> PAGE_SHIFT); ++i) {
-			/* Destination: colored mapping created via HV_CREATE */
-			/* Source: non-colored mapping defined above */
-			memcpy((void *)TEMPORARY_MAPPING_BASE + (i << PAGE_SHIFT),
-			       (void *)ROOT_MAP_OFFSET + phys_addr + (i << PAGE_SHIFT),
-			       PAGE_SIZE);
+		window += run;
+		offset += run;
+		size -= run;
+	}
+}
+
+static void recolor_chunk(unsigned long chunk)
+{
+	unsigned long offset = chunk * RECOLOR_CHUNK_SIZE;
+	unsigned long size = recolor_chunk_size(chunk);
+	unsigned long pages = size >> PAGE_SHIFT;
+	unsigned long n, page;
+
+	/* Nothing to move if all colors are selected */
+	if (recolor_colored_phys(offset) == recolor_linear_phys(offset) &&
+	    recolor_colored_phys(offset + size - PAGE_SIZE) ==
+	    recolor_linear_phys(offset + size - PAGE_SIZE))
+		return;
+
+	recolor_map(RECOLOR_SRC_WINDOW, recolor_src_phys, offset, size);
+	recolor_map(RECOLOR_DST_WINDOW, recolor_dst_phys, offset, size);
+
+	for (n = 0; n < pages; n++) {
+		page = recolor.to_colored ? pages - 1 - n : n;
+		if (recolor_src_phys(offset + page * PAGE_SIZE) ==
+		    recolor_dst_phys(offset + page * PAGE_SIZE))
+			continue;
+		recolor_copy_page((void *)RECOLOR_DST_WINDOW + page * PAGE_SIZE,
+				  (void *)RECOLOR_SRC_WINDOW + page * PAGE_SIZE);
+	}
+
+	/* Complete the copy before the windows are reused */
+	dsb(ish);
+}
+
+static void recolor_work(void)
+{
+	volatile unsigned long *my_chunk = &this_cpu_data()->recolor_chunk;
+	unsigned long chunk;
+	unsigned int cpu;
+
+	while (1) {
+		spin_lock(&recolor.lock);
+		if (recolor.claimed == recolor.num_chunks) {
+			spin_unlock(&recolor.lock);
+			break;
 		}
+		chunk = recolor.to_colored ?
+			recolor.num_chunks - 1 - recolor.claimed :
+			recolor.claimed;
+		recolor.claimed++;
+		*my_chunk = chunk;
+		spin_unlock(&recolor.lock);
+
+		for_each_cpu(cpu, root_cell.cpu_set)
+			while (cpu != this_cpu_id() &&
+			       recolor_depends(chunk,
+					       per_cpu(cpu)->recolor_chunk))
+				cpu_relax();
+
+		recolor_chunk(chunk);
+
+		spin_lock(&recolor.lock);
+		*my_chunk = RECOLOR_IDLE;
+		recolor.completed++;
+		spin_unlock(&recolor.lock);
+	}
+}
 
-		phys_addr += size;
-		tot_size -= size;
+void coloring_recolor_assist(void)
+{
+	if (!recolor.active)
+		return;
+
+	spin_lock(&recolor.lock);
+	if (!recolor.active) {
+		spin_unlock(&recolor.lock);
+		return;
 	}
-	
+	recolor.workers++;
+	spin_unlock(&recolor.lock);
+
+	recolor_work();
+
+	spin_lock(&recolor.lock);
+	recolor.workers--;
+	spin_unlock(&recolor.lock);
+}
+
+/**
+ * Move the content of a colored root-cell region into its colored
+ * layout (@to_colored) or back into its linear one, using all root-cell
+ * CPUs that call coloring_recolor_assist().
+ */
+static void colored_recolor(const struct jailhouse_memory_colored *col_mem,
+			    bool to_colored)
+{
+	unsigned int n;
+	u64 start, end, freq;
+
+	if (col_layout_init(&recolor.layout, col_mem, col_mem->colors))
+		return;
+
+	for_each_cpu(n, root_cell.cpu_set)
+		per_cpu(n)->recolor_chunk = RECOLOR_IDLE;
+
+	recolor.col_mem = col_mem;
+	recolor.to_colored = to_colored;
+	recolor.num_chunks = (col_mem->memory.size + RECOLOR_CHUNK_SIZE - 1) /
+		RECOLOR_CHUNK_SIZE;
+	recolor.claimed = 0;
+	recolor.completed = 0;
+
+	arm_read_sysreg(CNTPCT_EL0, start);
+
+	memory_barrier();
+	recolor.active = true;
+
+	recolor_work();
+
+	spin_lock(&recolor.lock);
+	recolor.active = false;
+	spin_unlock(&recolor.lock);
+
+	while (recolor.completed < recolor.num_chunks || recolor.workers > 0)
+		cpu_relax();
+
+	arm_read_sysreg(CNTPCT_EL0, end);
+	arm_read_sysreg(CNTFRQ_EL0, freq);
+	col_print("\t%s 0x%llx bytes in %llu us\n",
+		  to_colored ? "Colored" : "Uncolored", col_mem->memory.size,
+		  (end - start) * 1000 / (freq / 1000));
 }
 
 
@@ -267,12 +705,215 @@ static void ranges_in_mask(bool* mask, int size, int* values)
 }
 
 
+/**
+ * Map a colored fragment in the stage-2 tables of a cell, picking the
+ * largest translation granule its geometry allows: block descriptors
+ * when it spans an aligned block, the contiguous hint when it is made
+ * of aligned runs of PTE_CONT_PAGES pages, plain pages otherwise.
+ */
+static int colored_map_fragment(struct cell *cell,
+				struct jailhouse_memory *frag)
+{
+	unsigned long block_start, block_end;
+
+	if (frag->flags & (JAILHOUSE_MEM_COMM_REGION | JAILHOUSE_MEM_IO |
+			   JAILHOUSE_MEM_NO_HUGEPAGES))
+		return col_ops.map_f(cell, frag);
+
+	block_start = (frag->virt_start + COL_BLOCK_SIZE - 1) &
+		~(COL_BLOCK_SIZE - 1);
+	block_end = (frag->virt_start + frag->size) & ~(COL_BLOCK_SIZE - 1);
+	if (((frag->phys_start ^ frag->virt_start) & (COL_BLOCK_SIZE - 1)) == 0 &&
+	    block_start < block_end) {
+		col_map_stats.block_size += block_end - block_start;
+		return col_ops.map_f(cell, frag);
+	}
+
+	/* Pages of the root cell are later unmapped and remapped one by
+	 * one, which would break up a contiguous run */
+	if (cell != &root_cell &&
+	    ((frag->phys_start | frag->virt_start | frag->size) &
+	     (COL_CONT_SIZE - 1)) == 0) {
+		/* The hint is only valid on page descriptors here */
+		frag->flags |= JAILHOUSE_MEM_NO_HUGEPAGES;
+		col_map_stats.cont_size += frag->size;
+		return arm_map_memory_region_flags(cell, frag, PTE_CONTIGUOUS);
+	}
+
+	return col_ops.map_f(cell, frag);
+}
+
+/* State of col_runs_build(), runs is NULL while counting */
+struct col_runs_builder {
+	struct col_run *runs;
+	unsigned int num;
+	unsigned int region;
+};
+
+static void col_runs_add(struct col_runs_builder *builder,
+			 const struct jailhouse_memory *frag)
+{
+	struct col_run *run;
+
+	if (builder->runs) {
+		run = &builder->runs[builder->num];
+		run->gphys = frag->virt_start;
+		run->phys = frag->phys_start;
+		run->pages = PAGES(frag->size);
+		run->region = builder->region;
+	}
+	builder->num++;
+}
+
+static int colored_fragment_op(struct jailhouse_memory *frag,
+			       struct cell *cell, col_operation type,
+			       void *extra)
+{
+	unsigned long region_addr, region_size, size;
+	int err = 0;
+
+#if 0
+	col_print("V: 0x%08llx -> P: 0x%08llx (size = 0x%08llx)\n",
+		  frag->virt_start, frag->phys_start, frag->size);
+#endif
+
+	switch (type) {
+	case CREATE:
+		if (!(frag->flags & (JAILHOUSE_MEM_COMM_REGION |
+				     JAILHOUSE_MEM_ROOTSHARED))) {
+			err = col_ops.unmap_root_f(frag);
+			if (err)
+				return err;
+		}
+
+		if (JAILHOUSE_MEMORY_IS_SUBPAGE(frag))
+			err = col_ops.subpage_f(cell, frag);
+		else
+			err = colored_map_fragment(cell, frag);
+		break;
+
+	case HV_CREATE:
+		/* Map colored region that is linearly mapped from the
+		 * HV's point of view. It will be used to copy the
+		 * content of the physical memory of the root cell. */
+		err = paging_create(&this_cpu_data()->pg_structs,
+				    frag->phys_start, frag->size,
+				    frag->virt_start + ROOT_MAP_OFFSET,
+				    PAGE_DEFAULT_FLAGS, PAGING_NON_COHERENT);
+		break;
+
+	case SMMU_CREATE:
+		/* Throw an error if no SMMU mapping function was installed */
+		if (!col_ops.smmu_map_f)
+			return -ENOSYS;
+
+		err = col_ops.smmu_map_f(cell, frag);
+		break;
+
+	case DESTROY:
+		if (!JAILHOUSE_MEMORY_IS_SUBPAGE(frag)) {
+			err = col_ops.unmap_f(cell, frag);
+			if (err)
+				return err;
+		}
+
+		if (!(frag->flags & (JAILHOUSE_MEM_COMM_REGION |
+				     JAILHOUSE_MEM_ROOTSHARED)))
+			err = col_ops.remap_root_f(frag, WARN_ON_ERROR);
+		break;
+
+	case HV_DESTROY:
+		err = paging_destroy(&this_cpu_data()->pg_structs,
+				     frag->virt_start + ROOT_MAP_OFFSET,
+				     frag->size, PAGING_NON_COHERENT);
+		break;
+
+	case SMMU_DESTROY:
+		/* Throw an error if no SMMU mapping function was installed */
+		if (!col_ops.smmu_unmap_f)
+			return -ENOSYS;
+
+		/* TLBs are invalidated once by the caller */
+		err = col_ops.smmu_unmap_f(cell, frag);
+		break;
+
+	case START:
+		if (frag->flags & JAILHOUSE_MEM_LOADABLE) {
+			/* Correct fragment geometry to be located far
+			 * away from useful memory */
+			frag->virt_start += ROOT_MAP_OFFSET;
+
+			err = arch_unmap_memory_region(&root_cell, frag);
+		}
+		break;
+
+	case LOAD:
+		if (frag->flags & JAILHOUSE_MEM_LOADABLE) {
+			/* Correct fragment geometry to be located far
+			 * away from useful memory */
+			frag->virt_start += ROOT_MAP_OFFSET;
+
+			/* Create an ad-hoc mapping just to load this image */
+			err = arch_map_memory_region(&root_cell, frag);
+		}
+		break;
+
+	case REMAP:
+		/* Replace the mappings of a fragment of a live cell */
+		err = col_ops.unmap_f(cell, frag);
+		if (err)
+			return err;
+
+		err = colored_map_fragment(cell, frag);
+		if (!err && col_ops.smmu_map_f)
+			err = col_ops.smmu_map_f(cell, frag);
+		break;
+
+	case DCACHE:
+		/*
+		 * Maintenance by VA is broadcast to all PEs. By set/way, it
+		 * would only reach the caches of this root cell CPU, while
+		 * the lines of the cell, or those the root cell wrote while
+		 * loading it, may sit in the L1 of any other CPU.
+		 */
+		region_addr = frag->phys_start;
+		region_size = frag->size;
+
+		while (region_size > 0) {
+			size = MIN(region_size,
+				   NUM_TEMPORARY_PAGES * PAGE_SIZE);
+
+			/* cannot fail, mapping area is preallocated */
+			paging_create(&this_cpu_data()->pg_structs, region_addr,
+				      size, TEMPORARY_MAPPING_BASE,
+				      PAGE_DEFAULT_FLAGS,
+				      PAGING_NON_COHERENT | PAGING_NO_HUGE);
+
+			arm_dcaches_flush((void *)TEMPORARY_MAPPING_BASE, size,
+					  (enum dcache_flush)(extra));
+
+			region_addr += size;
+			region_size -= size;
+		}
+		break;
+
+	case RUNS:
+		col_runs_add((struct col_runs_builder *)extra, frag);
+		break;
+
+	default:
+		break;
+	}
+
+	return err;
+}
+
 static int __manage_colored_region(const struct jailhouse_memory_colored col_mem,
 				    struct cell *cell, col_operation type, void * extra)
 {
 	int MAX_COLORS;
-	int err = -EINVAL;
-	struct jailhouse_memory frag_mem_region;
+	int err;
+	struct jailhouse_memory frag_mem_region, next;
 	__u64 f_size = cache.fragment_unit_size;
 	__u64 f_offset = cache.fragment_unit_offset;
 	__u64 colors = col_mem.colors;
@@ -281,9 +922,13 @@ static int __manage_colored_region(const struct jailhouse_memory_colored col_mem
 	__u64 flags = col_mem.memory.flags;
 	MAX_COLORS = f_offset/f_size;
 	bool mask[MAX_COLORS];
-	unsigned long region_addr, region_size, size;
+	unsigned long start, end, stop;
 	int i, r, k;
 
+	err = col_bank_check(&col_mem);
+	if (err)
+		return err;
+
 	/* Get bit mask from color mask */
 	for (i = MAX_COLORS-1; i >= 0; --i, colors >>= 1)
 		mask[i] = (colors & 1);
@@ -292,12 +937,16 @@ static int __manage_colored_region(const struct jailhouse_memory_colored col_mem
 	int ranges[MAX_COLORS*2];
 	ranges_in_mask(mask,MAX_COLORS,ranges);
 
-	
+	/* Nothing to map without any color of this cache */
+	if (ranges[0] == -1)
+		return -EINVAL;
+
+	frag_mem_region.size = 0;
 	r = 0;
 	/* for (r = 0; r < (int)(col_mem.memory.size/f_offset); r++) */
 	while (virt_start < col_mem.memory.virt_start + col_mem.memory.size) {
 		for (k =0; k < MAX_COLORS*2; k+=2) {
-			
+
 			/* Calculate mem region */
 			if(ranges[k] == -1)
 				continue;
@@ -305,172 +954,174 @@ static int __manage_colored_region(const struct jailhouse_memory_colored col_mem
 			int i = ranges[k];
 			int j = ranges[k+1];
 
-			frag_mem_region.size = (j - i + 1) * f_size;
-			frag_mem_region.phys_start = phys_start + (i * f_size) + (r * f_offset);
-			frag_mem_region.virt_start = virt_start;
-			frag_mem_region.flags = flags;
-			virt_start += frag_mem_region.size;
+			start = phys_start + (i * f_size) + (r * f_offset);
+			end = start + (j - i + 1) * f_size;
 
-#if 0
-			col_print("V: 0x%08llx -> P: 0x%08llx (size = 0x%08llx)\n",
-				  frag_mem_region.virt_start, frag_mem_region.phys_start,
-				  frag_mem_region.size);
-#endif
-			
-			switch (type) {
-			case CREATE:
-				if (!(frag_mem_region.flags & (JAILHOUSE_MEM_COMM_REGION |
-							       JAILHOUSE_MEM_ROOTSHARED))) {
-					err = col_ops.unmap_root_f(&frag_mem_region);
-					if (err)
-						return err;
+			/* Split the color range along the DRAM banks of
+			 * the region, if partitioned */
+			for (; start < end; start = stop) {
+				if (!col_bank_allowed(&col_mem, start)) {
+					stop = start + f_size;
+					continue;
 				}
-
-				if (JAILHOUSE_MEMORY_IS_SUBPAGE(&frag_mem_region))
-					err = col_ops.subpage_f(cell, &frag_mem_region);
-				else
-					err = col_ops.map_f(cell, &frag_mem_region);
-
-				if(err)
-					return err;
-				break;
-
-			case HV_CREATE:
-
-				/* Map colored region that is linearly
-				 * mapped from the HV's point of
-				 * view. It will be used to copy the
-				 * content of the physical memory of
-				 * the root cell. */
-				err = paging_create(&this_cpu_data()->pg_structs,
-						    frag_mem_region.phys_start,
-						    frag_mem_region.size,
-						    frag_mem_region.virt_start + ROOT_MAP_OFFSET,
-						    PAGE_DEFAULT_FLAGS, PAGING_NON_COHERENT);
-				
-				if(err)
-					return err;
-				break;
-				
-			case SMMU_CREATE:
-
-				/* Throw an error if no SMMU mapping function was installed */
-				if (!col_ops.smmu_map_f) 
-					return -ENOSYS;
-				
-				err = col_ops.smmu_map_f(cell, &frag_mem_region);
-				
-				if(err)
-					return err;
-				break;
-				
-			case DESTROY:
-				if (!JAILHOUSE_MEMORY_IS_SUBPAGE(&frag_mem_region)){
-					err = col_ops.unmap_f(cell, &frag_mem_region);
-					if(err)
-						return err;
+				for (stop = start + f_size;
+				     stop < end && col_bank_allowed(&col_mem, stop);
+				     stop += f_size)
+					;
+
+				next.size = stop - start;
+				next.phys_start = start;
+				next.virt_start = virt_start;
+				next.flags = flags;
+				virt_start += next.size;
+				col_map_stats.fragments++;
+
+				/* Fragments are virtually contiguous. Merge
+				 * them as long as they are physically
+				 * contiguous too, i.e. when a color range
+				 * wraps around the way boundary, so that
+				 * larger granules can be used. */
+				if (frag_mem_region.size > 0 &&
+				    frag_mem_region.phys_start +
+				    frag_mem_region.size == next.phys_start) {
+					frag_mem_region.size += next.size;
+					continue;
 				}
 
-				if (!(frag_mem_region.flags & (JAILHOUSE_MEM_COMM_REGION |
-							       JAILHOUSE_MEM_ROOTSHARED))){
-					err = col_ops.remap_root_f(&frag_mem_region,
-									     WARN_ON_ERROR);
-					if(err)
-						return err;
-				}
-				break;
-
-			case HV_DESTROY:
-				
-				err = paging_destroy(&this_cpu_data()->pg_structs,
-						     frag_mem_region.virt_start + ROOT_MAP_OFFSET,
-						     frag_mem_region.size,
-						     PAGING_NON_COHERENT);
-				
-				if(err)
-					return err;
-
-				break;
-
-			case SMMU_DESTROY:
-				/* Throw an error if no SMMU mapping function was installed */
-				if (!col_ops.smmu_unmap_f)
-					return -ENOSYS;
-
-				/* TODO: implement this */
-				
-				break;
-				
-			case START:
-				if (frag_mem_region.flags & JAILHOUSE_MEM_LOADABLE) {
-					
-					/* Correct fragment geometry
-					 * to be located far away from
-					 * useful memory */
-					frag_mem_region.virt_start += ROOT_MAP_OFFSET;
-					
-					err = arch_unmap_memory_region(&root_cell, &frag_mem_region);					
-					if(err)
-						return err;
-				}
-				break;
-
-			case LOAD:
-				if (frag_mem_region.flags & JAILHOUSE_MEM_LOADABLE) {
-					
-					/* Correct fragment geometry
-					 * to be located far away from
-					 * useful memory */
-					frag_mem_region.virt_start += ROOT_MAP_OFFSET;
-
-					/* Create an ad-hoc mapping just to load this image */
-					err = arch_map_memory_region(&root_cell, &frag_mem_region);
-					
-					if(err)
+				if (frag_mem_region.size > 0) {
+					col_map_stats.mappings++;
+					err = colored_fragment_op(&frag_mem_region,
+								  cell, type,
+								  extra);
+					if (err)
 						return err;
 				}
-				break;
-
-			case DCACHE:
-				region_addr = frag_mem_region.phys_start;
-				region_size = frag_mem_region.size;
-
-				err = 0;
-				
-				while (region_size > 0) {
-					size = MIN(region_size,
-						   NUM_TEMPORARY_PAGES * PAGE_SIZE);
-
-					/* cannot fail, mapping area is preallocated */
-					paging_create(&this_cpu_data()->pg_structs, region_addr,
-						      size, TEMPORARY_MAPPING_BASE,
-						      PAGE_DEFAULT_FLAGS,
-						      PAGING_NON_COHERENT | PAGING_NO_HUGE);
-					
-					arm_dcaches_flush((void *)TEMPORARY_MAPPING_BASE, size,
-							  (enum dcache_flush)(extra));
-								       
-					region_addr += size;
-					region_size -= size;
-				}
-				break;
-
-			default:
-				break;
+				frag_mem_region = next;
 			}
 		}
 
 		++r;
+
+		/* Colors and banks may exclude each other */
+		if (frag_mem_region.size == 0 &&
+		    r * f_offset >= col_period(&col_mem))
+			return -EINVAL;
 	}
 
-	return err;
+	col_map_stats.mappings++;
+	return colored_fragment_op(&frag_mem_region, cell, type, extra);
+}
+
+static void col_runs_free(struct cell *cell)
+{
+	if (!cell->arch.col_runs)
+		return;
+
+	page_free(&mem_pool, cell->arch.col_runs,
+		  PAGES(cell->arch.col_num_runs * sizeof(struct col_run)));
+	cell->arch.col_runs = NULL;
+	cell->arch.col_num_runs = 0;
+}
+
+/* Colored region following @prev by guest address, @num for the first */
+static unsigned int
+col_region_next(const struct jailhouse_memory_colored *regions,
+		unsigned int num, unsigned int prev)
+{
+	unsigned int n, next = num;
+
+	for (n = 0; n < num; n++) {
+		if (prev < num && regions[n].memory.virt_start <=
+		    regions[prev].memory.virt_start)
+			continue;
+		if (next == num || regions[n].memory.virt_start <
+		    regions[next].memory.virt_start)
+			next = n;
+	}
+	return next;
+}
+
+/*
+ * Compute the runs of all colored regions of a cell, one counting pass
+ * and one filling pass. Regions are visited by ascending guest address so
+ * that the table ends up sorted.
+ */
+static int col_runs_build(struct cell *cell)
+{
+	const struct jailhouse_memory_colored *regions =
+		jailhouse_cell_col_mem_regions(cell->config);
+	unsigned int num_regions = cell->config->num_memory_regions_colored;
+	struct col_runs_builder builder = { .runs = NULL };
+	unsigned int pass, r, pages = 0;
+	int err;
+
+	col_runs_free(cell);
+
+	for (pass = 0; pass < 2; pass++) {
+		builder.num = 0;
+		memset(&col_map_stats, 0, sizeof(col_map_stats));
+
+		for (r = col_region_next(regions, num_regions, num_regions);
+		     r < num_regions;
+		     r = col_region_next(regions, num_regions, r)) {
+			builder.region = r;
+
+			err = __manage_colored_region(regions[r], cell, RUNS,
+						      &builder);
+			if (err) {
+				page_free(&mem_pool, builder.runs, pages);
+				return err;
+			}
+		}
+
+		if (builder.num == 0)
+			return 0;
+
+		if (pass == 0) {
+			pages = PAGES(builder.num * sizeof(struct col_run));
+			builder.runs = page_alloc(&mem_pool, pages);
+			if (!builder.runs)
+				return -ENOMEM;
+		}
+	}
+
+	cell->arch.col_runs = builder.runs;
+	cell->arch.col_num_runs = builder.num;
+
+	return 0;
+}
+
+unsigned long coloring_gphys2phys(struct cell *cell, unsigned long gphys)
+{
+	unsigned int first = 0, last = cell->arch.col_num_runs, n;
+	const struct col_run *run;
+
+	while (first < last) {
+		n = first + (last - first) / 2;
+		run = &cell->arch.col_runs[n];
+
+		if (gphys < run->gphys)
+			last = n;
+		else if (gphys - run->gphys >= (unsigned long)run->pages *
+			 PAGE_SIZE)
+			first = n + 1;
+		else
+			return run->phys + (gphys - run->gphys);
+	}
+
+	return INVALID_PHYS_ADDR;
 }
 
 int __coloring_cell_apply_to_col_mem(struct cell *cell, col_operation type, void * extra)
 {
 
-	int err, n;
+	const struct jailhouse_memory_colored *regions =
+		jailhouse_cell_col_mem_regions(cell->config);
 	const struct jailhouse_memory_colored *col_mem;
+	struct jailhouse_memory frag;
+	const struct col_run *run;
+	unsigned int i;
+	int err, n;
 
 	/* No coloring can be performed if no suitable cache level has
 	 * been detected */
@@ -478,65 +1129,561 @@ int __coloring_cell_apply_to_col_mem(struct cell *cell, col_operation type, void
 		printk("ERROR: Colored regions exist but no suitable cache level found.\n");
 		return -ENODEV;
 	}
-	
-	for_each_col_mem_region(col_mem, cell->config, n) {
-		col_print("Colored OP %d: "
-			  "PHYS 0x%08llx -> VIRT 0x%08llx "
-			  "(SIZE: 0x%08llx, COL: 0x%08llx, extra: %p)\n",
-			  type, col_mem->memory.phys_start,
-			  col_mem->memory.virt_start,
-			  col_mem->memory.size, col_mem->colors, extra);
-
-		err = __manage_colored_region(*col_mem, cell, type, extra);
-
-		col_print("Result: %d\n", err);
-		if(err)
+
+	if (type == CREATE) {
+		err = col_runs_build(cell);
+		if (err)
 			return err;
+	} else {
+		memset(&col_map_stats, 0, sizeof(col_map_stats));
 	}
-	
+
+	if (cell->arch.col_runs) {
+		col_print("Colored OP %d: %u runs (extra: %p)\n",
+			  type, cell->arch.col_num_runs, extra);
+
+		for (i = 0; i < cell->arch.col_num_runs; i++) {
+			run = &cell->arch.col_runs[i];
+			frag.phys_start = run->phys;
+			frag.virt_start = run->gphys;
+			frag.size = (unsigned long)run->pages * PAGE_SIZE;
+			frag.flags = regions[run->region].memory.flags;
+
+			err = colored_fragment_op(&frag, cell, type, extra);
+			if (err) {
+				col_print("Result: %d\n", err);
+				return err;
+			}
+		}
+	} else {
+		/* Cells whose table could not be built */
+		for_each_col_mem_region(col_mem, cell->config, n) {
+			col_print("Colored OP %d: "
+				  "PHYS 0x%08llx -> VIRT 0x%08llx "
+				  "(SIZE: 0x%08llx, COL: 0x%08llx, extra: %p)\n",
+				  type, col_mem->memory.phys_start,
+				  col_mem->memory.virt_start,
+				  col_mem->memory.size, col_mem->colors, extra);
+
+			err = __manage_colored_region(*col_mem, cell, type,
+						      extra);
+
+			col_print("Result: %d\n", err);
+			if(err)
+				return err;
+		}
+	}
+
+	if (type == CREATE && cell->config->num_memory_regions_colored > 0)
+		col_print("%lu fragments in %lu mappings (%lu saved), "
+			  "0x%lx bytes in blocks, 0x%lx bytes with "
+			  "contiguous hint\n",
+			  col_map_stats.fragments, col_map_stats.mappings,
+			  col_map_stats.fragments - col_map_stats.mappings,
+			  col_map_stats.block_size, col_map_stats.cont_size);
+
+	return 0;
+}
+
+/*
+ * Online recoloring of a running cell. Each page of the region moves from
+ * its old location to its new one. A page can move as soon as its new
+ * location is not used by an unmoved page. Moving it frees its old
+ * location for the page that is waiting for it, so pages move along
+ * chains. Pages left once all chains are done form cycles, which are
+ * broken up with a bounce page.
+ */
+#define MIGRATE_BATCH_PAGES	256
+
+static struct {
+	struct cell *cell;
+	const struct jailhouse_memory_colored *col_mem;
+	/* The region with its new colors */
+	struct jailhouse_memory_colored target;
+	struct col_layout from, to;
+	/* Pages already at their new location, by region offset */
+	unsigned long *moved;
+	unsigned int moved_pages;
+	void *bounce;
+	unsigned long num_pages;
+	unsigned long left;
+	unsigned long cursor;
+	bool started;
+	/* A step failed, the cell maps a mix of both layouts */
+	bool failed;
+	/* Statistics */
+	unsigned long copied, cycles, steps;
+	u64 start;
+} migrate;
+
+static bool migrate_moved(unsigned long offset)
+{
+	return test_bit(offset >> PAGE_SHIFT, migrate.moved);
+}
+
+/* Can the page at @offset move without overwriting an unmoved one? */
+static bool migrate_dest_free(unsigned long offset)
+{
+	unsigned long owner = col_layout_offset(&migrate.from,
+			col_layout_phys(&migrate.to, offset));
+
+	return owner == COL_INVALID_OFFSET || owner == offset ||
+		migrate_moved(owner);
+}
+
+/* Page waiting for the old location of the page at @offset */
+static unsigned long migrate_waiter(unsigned long offset)
+{
+	return col_layout_offset(&migrate.to,
+				 col_layout_phys(&migrate.from, offset));
+}
+
+static void migrate_copy(unsigned long dst, unsigned long src)
+{
+	const struct paging_structures *pg_structs =
+		&this_cpu_data()->pg_structs;
+
+	/* cannot fail, mapping area is preallocated */
+	paging_create(pg_structs, src, PAGE_SIZE, RECOLOR_SRC_WINDOW,
+		      PAGE_DEFAULT_FLAGS, PAGING_NON_COHERENT | PAGING_NO_HUGE);
+	paging_create(pg_structs, dst, PAGE_SIZE, RECOLOR_DST_WINDOW,
+		      PAGE_DEFAULT_FLAGS, PAGING_NON_COHERENT | PAGING_NO_HUGE);
+
+	recolor_copy_page((void *)RECOLOR_DST_WINDOW,
+			  (void *)RECOLOR_SRC_WINDOW);
+
+	/* Devices access cell memory through non-cacheable SMMU mappings */
+	arm_dcaches_flush((void *)RECOLOR_DST_WINDOW, PAGE_SIZE, DCACHE_CLEAN);
+}
+
+/* Point the cell to the new location of the page at @offset */
+static int migrate_map(unsigned long offset)
+{
+	struct jailhouse_memory page = {
+		.phys_start = col_layout_phys(&migrate.to, offset),
+		.virt_start = migrate.col_mem->memory.virt_start + offset,
+		.size = PAGE_SIZE,
+		.flags = migrate.col_mem->memory.flags |
+			JAILHOUSE_MEM_NO_HUGEPAGES,
+	};
+	int err;
+
+	set_bit(offset >> PAGE_SHIFT, migrate.moved);
+	migrate.left--;
+
+	if (page.phys_start == col_layout_phys(&migrate.from, offset))
+		return 0;
+
+	err = col_ops.map_f(migrate.cell, &page);
+	if (!err && col_ops.smmu_map_f)
+		err = col_ops.smmu_map_f(migrate.cell, &page);
+	return err;
+}
+
+static int migrate_page(unsigned long offset)
+{
+	unsigned long src = col_layout_phys(&migrate.from, offset);
+	unsigned long dst = col_layout_phys(&migrate.to, offset);
+
+	if (src != dst) {
+		migrate_copy(dst, src);
+		migrate.copied++;
+	}
+	return migrate_map(offset);
+}
+
+/* Move the cycle of pages the page at @offset is part of */
+static int migrate_cycle(unsigned long offset)
+{
+	unsigned long bounce = paging_hvirt2phys(migrate.bounce);
+	unsigned long first = offset;
+	unsigned long waiter;
+	int err;
+
+	migrate_copy(bounce, col_layout_phys(&migrate.from, first));
+	migrate.cycles++;
+
+	while ((waiter = migrate_waiter(offset)) != first) {
+		err = migrate_page(waiter);
+		if (err)
+			return err;
+		offset = waiter;
+	}
+
+	migrate_copy(col_layout_phys(&migrate.to, first), bounce);
+	migrate.copied++;
+	return migrate_map(first);
+}
+
+/* Hand the pages of @layout that @other does not use to or from root */
+static int migrate_root_pages(const struct col_layout *layout,
+			      const struct col_layout *other, bool to_root)
+{
+	struct jailhouse_memory run = {
+		.flags = migrate.col_mem->memory.flags,
+	};
+	unsigned long offset, phys;
+	int err;
+
+	for (offset = 0; offset < layout->size; offset += PAGE_SIZE) {
+		phys = col_layout_phys(layout, offset);
+		if (col_layout_offset(other, phys) != COL_INVALID_OFFSET)
+			continue;
+
+		if (run.size > 0 && run.phys_start + run.size == phys) {
+			run.size += PAGE_SIZE;
+			continue;
+		}
+
+		if (run.size > 0) {
+			err = to_root ? col_ops.remap_root_f(&run, WARN_ON_ERROR) :
+				col_ops.unmap_root_f(&run);
+			if (err)
+				return err;
+		}
+		run.phys_start = phys;
+		run.virt_start = phys;
+		run.size = PAGE_SIZE;
+	}
+
+	if (run.size == 0)
+		return 0;
+	return to_root ? col_ops.remap_root_f(&run, WARN_ON_ERROR) :
+		col_ops.unmap_root_f(&run);
+}
+
+static void migrate_release(void)
+{
+	page_free(&mem_pool, migrate.moved, migrate.moved_pages);
+	page_free(&mem_pool, migrate.bounce, 1);
+	migrate.cell = NULL;
+	migrate.failed = false;
+}
+
+/* Called when the cell of a failed recoloring is destroyed */
+static void migrate_abort(void)
+{
+	/* Destroying the cell gives the pages of the old layout back, those
+	 * only used by the new one are returned here */
+	if (migrate.started &&
+	    !(migrate.col_mem->memory.flags & JAILHOUSE_MEM_ROOTSHARED))
+		migrate_root_pages(&migrate.to, &migrate.from, true);
+
+	migrate_release();
+}
+
+int coloring_cell_recolor_prepare(struct cell *cell, unsigned int region,
+				  u64 colors)
+{
+	const struct jailhouse_memory_colored *col_mem;
+	unsigned long offset, phys;
+	int err;
+
+	if (cache.level == -1)
+		return -ENODEV;
+	if (migrate.cell)
+		return -EBUSY;
+	if (region >= cell->config->num_memory_regions_colored)
+		return trace_error(-EINVAL);
+
+	/* Devices may still access DMA regions while the cell is suspended */
+	col_mem = jailhouse_cell_col_mem_regions(cell->config) + region;
+	if (col_mem->memory.flags & (JAILHOUSE_MEM_COMM_REGION |
+				     JAILHOUSE_MEM_IO | JAILHOUSE_MEM_DMA))
+		return trace_error(-EINVAL);
+
+	migrate.target = *col_mem;
+	migrate.target.colors = colors;
+
+	err = col_layout_init(&migrate.from, col_mem, col_mem->colors);
+	if (!err)
+		err = col_layout_init(&migrate.to, &migrate.target, colors);
+	if (err)
+		return trace_error(err);
+
+	/* New pages have to be taken from the root cell */
+	for (offset = 0; offset < col_mem->memory.size; offset += PAGE_SIZE) {
+		phys = col_layout_phys(&migrate.to, offset);
+		if (col_layout_offset(&migrate.from, phys) ==
+		    COL_INVALID_OFFSET &&
+		    paging_virt2phys(&root_cell.arch.mm, phys,
+				     PAGE_PRESENT_FLAGS) != phys)
+			return trace_error(-EINVAL);
+	}
+
+	migrate.num_pages = col_mem->memory.size >> PAGE_SHIFT;
+	migrate.moved_pages = PAGES((migrate.num_pages + BITS_PER_LONG - 1) /
+				    BITS_PER_LONG * sizeof(unsigned long));
+	migrate.moved = page_alloc(&mem_pool, migrate.moved_pages);
+	if (!migrate.moved)
+		return -ENOMEM;
+	migrate.bounce = page_alloc(&mem_pool, 1);
+	if (!migrate.bounce) {
+		page_free(&mem_pool, migrate.moved, migrate.moved_pages);
+		return -ENOMEM;
+	}
+	memset(migrate.moved, 0, migrate.moved_pages * PAGE_SIZE);
+
+	migrate.cell = cell;
+	migrate.col_mem = col_mem;
+	migrate.left = migrate.num_pages;
+	migrate.cursor = 0;
+	migrate.started = false;
+	migrate.copied = 0;
+	migrate.cycles = 0;
+	migrate.steps = 0;
+	arm_read_sysreg(CNTPCT_EL0, migrate.start);
+
+	return 0;
+}
+
+static int migrate_begin(void)
+{
+	struct jailhouse_memory_colored paged = *migrate.col_mem;
+	int err;
+
+	if (!(paged.memory.flags & JAILHOUSE_MEM_ROOTSHARED)) {
+		err = migrate_root_pages(&migrate.to, &migrate.from, false);
+		if (err)
+			return err;
+	}
+
+	/* Single pages cannot be replaced inside blocks or contiguous
+	 * runs. Fall back to page mappings while pages move. */
+	paged.memory.flags |= JAILHOUSE_MEM_NO_HUGEPAGES;
+	return __manage_colored_region(paged, migrate.cell, REMAP, NULL);
+}
+
+static int migrate_finish(void)
+{
+	u64 end, freq;
+	int err;
+
+	err = __manage_colored_region(migrate.target, migrate.cell, REMAP,
+				      NULL);
+	if (err)
+		return err;
+
+	if (!(migrate.col_mem->memory.flags & JAILHOUSE_MEM_ROOTSHARED)) {
+		err = migrate_root_pages(&migrate.from, &migrate.to, true);
+		if (err)
+			return err;
+	}
+
+	/* The hypervisor owns this copy of the cell configuration */
+	((struct jailhouse_memory_colored *)migrate.col_mem)->colors =
+		migrate.target.colors;
+
+	/* Without a table, colored operations fall back to walking the
+	 * regions */
+	err = col_runs_build(migrate.cell);
+	if (err)
+		printk("WARNING: No colored runs for cell \"%s\": %d\n",
+		       migrate.cell->config->name, err);
+
+	arm_read_sysreg(CNTPCT_EL0, end);
+	arm_read_sysreg(CNTFRQ_EL0, freq);
+	col_print("Recolored cell \"%s\" to 0x%llx: %lu pages copied, "
+		  "%lu cycles, %lu steps, %llu us\n",
+		  migrate.cell->config->name, migrate.target.colors,
+		  migrate.copied, migrate.cycles, migrate.steps,
+		  (end - migrate.start) * 1000 / (freq / 1000));
+
+	return 0;
+}
+
+bool coloring_recolor_pending(void)
+{
+	return migrate.cell != NULL;
+}
+
+bool coloring_recolor_failed(struct cell *cell)
+{
+	return migrate.cell == cell && migrate.failed;
+}
+
+int coloring_cell_recolor_step(struct cell *cell)
+{
+	unsigned long budget = MIGRATE_BATCH_PAGES;
+	unsigned long size = migrate.num_pages << PAGE_SHIFT;
+	unsigned long scanned = 0;
+	unsigned long offset, left;
+	int err = 0;
+
+	if (cell != migrate.cell)
+		return -EINVAL;
+	if (migrate.failed)
+		return -EIO;
+
+	if (!migrate.started) {
+		migrate.started = true;
+		err = migrate_begin();
+	}
+	migrate.steps++;
+
+	while (!err && migrate.left > 0 && budget > 0) {
+		offset = migrate.cursor;
+
+		if (migrate_moved(offset)) {
+			scanned++;
+		} else if (migrate_dest_free(offset)) {
+			/* Follow the chain of pages waiting for this one */
+			do {
+				err = migrate_page(offset);
+				budget--;
+				offset = migrate_waiter(offset);
+			} while (!err && budget > 0 &&
+				 offset != COL_INVALID_OFFSET &&
+				 !migrate_moved(offset));
+			scanned = 0;
+			continue;
+		} else if (scanned >= migrate.num_pages) {
+			/* A full pass found no chain, only cycles are left.
+			 * They are moved at once. */
+			left = migrate.left;
+			err = migrate_cycle(offset);
+			budget -= MIN(budget, left - migrate.left);
+		} else {
+			scanned++;
+		}
+
+		migrate.cursor = (migrate.cursor + PAGE_SIZE) % size;
+	}
+
+	if (!err && migrate.left == 0)
+		err = migrate_finish();
+
+	if (col_ops.smmu_flush_f)
+		col_ops.smmu_flush_f();
+
+	if (err) {
+		printk("ERROR: recoloring of cell \"%s\" failed with %d, "
+		       "%lu pages left\n", cell->config->name, err,
+		       migrate.left);
+		/* Moved pages cannot simply be copied back, the old location
+		 * of one may already hold another. Keep the state so that
+		 * the cell can only be destroyed. */
+		migrate.failed = true;
+		return err;
+	}
+
+	if (migrate.left == 0) {
+		migrate_release();
+		return 0;
+	}
+
+	return 1;
+}
+
+static bool col_hv_page(unsigned long phys)
+{
+	return mem_pool.colors &
+		(1UL << ((phys >> PAGE_SHIFT) % mem_pool.num_colors));
+}
+
+/* Place the page pool in the hypervisor colors at the common granularity */
+static void col_pool_colors(void)
+{
+	u64 hv_colors = system_config->platform_info.arm.hypervisor_colors;
+	unsigned long max_colors = cache.way_size / PAGE_SIZE;
+	unsigned long color;
+
+	mem_pool.colors = 0;
+	mem_pool.num_colors = 0;
+
+	if (cache.level == -1 || hv_colors == 0)
+		return;
+
+	if (max_colors > BITS_PER_LONG) {
+		printk("WARNING: %lu cache colors exceed the pool bitmap, "
+		       "hypervisor memory left uncolored\n", max_colors);
+		return;
+	}
+
+	/* The most significant of the max_colors bits selects color 0 */
+	for (color = 0; color < max_colors; color++)
+		if (hv_colors & (1ULL << (max_colors - 1 - color)))
+			mem_pool.colors |= 1UL << color;
+	if (mem_pool.colors)
+		mem_pool.num_colors = max_colors;
+}
+
+void coloring_paging_init(void)
+{
+	/* Only the cluster of the master CPU is known at this point, the
+	 * others are added by coloring_cpu_init(). */
+	cache.level = -1;
+	if (coloring_cpu_init())
+		return;
+
+	col_pool_colors();
+}
+
+int coloring_hv_text(void)
+{
+	unsigned long virt = PAGE_ALIGN((unsigned long)__text_start);
+	unsigned long end = (unsigned long)__rodata_end & PAGE_MASK;
+	unsigned long moved = 0;
+	void *page;
+	int err;
+
+	if (mem_pool.num_colors == 0)
+		return 0;
+
+	for (; virt < end; virt += PAGE_SIZE) {
+		if (col_hv_page(paging_hvirt2phys((void *)virt)))
+			continue;
+
+		page = page_alloc(&mem_pool, 1);
+		if (!page)
+			return -ENOMEM;
+		if (!col_hv_page(paging_hvirt2phys(page))) {
+			/* Out of pages in the hypervisor colors */
+			page_free(&mem_pool, page, 1);
+			break;
+		}
+
+		memcpy(page, (void *)virt, PAGE_SIZE);
+		arm_dcaches_flush(page, PAGE_SIZE, DCACHE_CLEAN);
+
+		err = paging_create(&hv_paging_structs, paging_hvirt2phys(page),
+				    PAGE_SIZE, virt, PAGE_DEFAULT_FLAGS,
+				    PAGING_NON_COHERENT | PAGING_NO_HUGE);
+		if (err)
+			return err;
+		moved++;
+	}
+
+	asm volatile("ic ialluis; dsb ish; isb" : : : "memory");
+
+	col_print("Moved %lu pages of hypervisor code into colors 0x%lx\n",
+		  moved, mem_pool.colors);
+
 	return 0;
 }
 
 static void coloring_cell_exit(struct cell *cell)
 {
-	int n, err;
+	int n;
 	const struct jailhouse_memory_colored *col_mem;
 
+	if (coloring_recolor_failed(cell))
+		migrate_abort();
+
 	/* Free up this mapping first, to take it easy on pool
 	 * pages */
 	coloring_cell_destroy(cell);
+	col_runs_free(cell);
 
 	/* If this was the root-cell, then we need to un-do coloring
 	 * of the memory already loaded for Linux. Just to be safe,
 	 * un-do coloring for any colored memory area. */
 	if (cell == &root_cell) {
 		for_each_col_mem_region(col_mem, cell->config, n) {
-			/* Create a linear mapping of the colored
-			 * region for the hypervisor */
-			err = __manage_colored_region(*col_mem, cell, HV_CREATE, NULL);
-			
-			if(err) {
-				col_print("ERROR: HV_CREATE returned %d\n", err);
- 				return;
-			}
-
-			/* Ready to map a contiguous view of the
-			 * memory that needs to be copy-colored, but
-			 * do this in little steps because the colored
-			 * mapping likely used quite a bit of pool
-			 * pages. */
+			/* The other root-cell CPUs join in from
+			 * hypervisor_disable() */
 			col_print("\tPerfoming color rewinding of root-cell...\n");
-			colored_uncopy(col_mem);
-			col_print("\tDone!\n");
-			
-			/* Alroght. We can now release all the temporary mappings */
-			err = __manage_colored_region(*col_mem, cell, HV_DESTROY, NULL);
-
-			if(err) {
-				col_print("ERROR: HV_DESTROY returned %d\n", err);
- 				return;
-			}
-			
+			colored_recolor(col_mem, false);
 		}
 	}	
 	
@@ -561,29 +1708,10 @@ static int coloring_cell_init(struct cell *cell)
 			/* Expand colored memory regions */
 			/* NOTE: we better have a working
 			 * coloring-aware SMMU here. */
-			err = __manage_colored_region(*col_mem, cell, HV_CREATE, NULL);
-			
-			if(err) {
-				col_print("ERROR: HV_CREATE returned %d\n", err);
- 				return err;
-			}
-
-			/* Ready to map a contiguous view of the
-			 * memory that needs to be copy-colored, but
-			 * do this in little steps because the colored
-			 * mapping likely used quite a bit of pool
-			 * pages. */
+			/* The other root-cell CPUs join in from
+			 * entry() while waiting for activation. */
 			col_print("\tPerfoming dynamic recoloring of root-cell...\n");
-			colored_copy(col_mem);
-			col_print("\tDone!\n");
-			
-			/* Alright. We can now release all the temporary mappings */
-			err = __manage_colored_region(*col_mem, cell, HV_DESTROY, NULL);
-
-			if(err) {
-				col_print("ERROR: HV_DESTROY returned %d\n", err);
- 				return err;
-			}
+			colored_recolor(col_mem, true);
 		}
 	}	
 
@@ -592,23 +1720,32 @@ static int coloring_cell_init(struct cell *cell)
 	 * maintain the colored mapping. */
 	err = coloring_cell_create(cell);
 
-	if (err)
+	if (err) {
+		col_runs_free(cell);
 		return err;
+	}
 	
 	return 0;
 }
 	
 static int coloring_init(void)
 {
-	int ret;
-	
-	/* Perform cache identification */
-	ret = coloring_cache_detect();
-
-	/* If unable to perform coloring, just skip this unit */
-	if (ret)
+	unsigned long pool_colors = mem_pool.num_colors;
+
+	/* Other clusters may have reduced the number of colors since the
+	 * pool was placed. Pages taken so far may then share colors with
+	 * cells. */
+	col_pool_colors();
+	if (pool_colors != mem_pool.num_colors)
+		printk("WARNING: Hypervisor pool in %lu instead of %lu colors "
+		       "after detecting all clusters\n",
+		       mem_pool.num_colors, pool_colors);
+
+	/* If unable to perform coloring, just skip this unit. The caches
+	 * of all clusters were identified by coloring_cpu_init(). */
+	if (cache.level == -1)
 		return 0;
-	
+
 	return coloring_cell_init(&root_cell);
 }
 
@@ -1,16 +1,55 @@
 #ifndef MEMGUARD_DATA_H
 #define MEMGUARD_DATA_H
 
+#include <jailhouse/memguard-common.h>
+
+struct memguard_counter {
+	u32 event;
+	u32 budget;
+	/* Budget requested by the caller, scaled into budget by the
+	 * adaptive controller (MGF_ADAPTIVE) */
+	u32 nominal;
+	/* Events allowed in the current period, including reclaimed ones */
+	u32 granted;
+	/* Budget of the current period lent to the global pool */
+	u32 donated;
+	/* Depth of the token bucket (MGF_BUCKET), at least budget */
+	u32 burst;
+	/* Events consumed in the periods that already elapsed */
+	unsigned long evt_cnt;
+	unsigned long donated_total;
+	unsigned long reclaimed_total;
+};
+
 struct memguard {
 	unsigned long start_time;
 	unsigned long last_time;
-	unsigned long pmu_evt_cnt;
 	unsigned long budget_time;
-	unsigned long budget_memory;
 	unsigned long flags;
+	/* Index of the first PMU counter reserved for the hypervisor */
+	u32 first_counter;
+	/* Bitmask of the PMU counters armed in the current phase */
+	u32 counter_mask;
+	struct memguard_counter counters[MEMGUARD_MAX_EVENTS];
+	/* Adaptive controller: current scale and bounds (per-mille), and
+	 * sequence number of the last slack report applied */
+	u32 adapt_scale;
+	u32 adapt_min;
+	u32 adapt_max;
+	u32 slack_seq;
 	bool memory_overrun;
 	bool time_overrun;
+	/* Throttled at least once in the current period */
+	bool throttled;
 	volatile u8 block;
+	/* Start of the ongoing throttling and time throttled in the
+	 * current period, for the trace ring */
+	unsigned long block_start;
+	unsigned long blocked_time;
+	/* Throttling statistics since the last memguard call */
+	unsigned long throttle_count;
+	unsigned long blocked_total;
+	unsigned long blocked_max;
 };
 
 #endif
@@ -19,15 +19,18 @@
 #include <asm/percpu.h>
 #include <jailhouse/memguard-common.h>
 
-void memguard_init(u8 local_irq_target);
+void memguard_init(void);
 void memguard_suspend(void);
 void memguard_exit(void);
 bool memguard_handle_interrupt(u32 irqn);
 void memguard_block_if_needed(void);
 
-/* Memguard flags */
-#define MGF_PERIODIC      (1 << 0) /* Chooses between periodic or one-shot budget replenishment */
-#define MGF_MASK_INT      (1 << 1) /* Mask (disable) low priority interrupts until next memguard call */
+/* Check the per-CPU budgets declared in the configuration of a new cell */
+int memguard_cell_init(struct cell *cell);
+/* Arm the budget the cell configuration declares for the calling CPU */
+void memguard_cpu_reset(struct cell *cell);
+/* Check if a CPU of the cell runs a periodic budget */
+bool memguard_cell_periodic(struct cell *cell);
 
 #define MGRET_ERROR_POS		0
 #define MGRET_MEM_POS		1
@@ -56,6 +59,17 @@ void memguard_block_if_needed(void);
  * also include the total time and total number of cache misses since
  * the preceding call, which can be used for application profiling.
  *
+ * Up to MEMGUARD_MAX_EVENTS PMU counters can be regulated at the
+ * same time, each one with its own event type and budget (see
+ * struct memguard_params). Overflowing any of them counts as a
+ * memory budget overrun. The number of events consumed on each
+ * counter is written back to params->event_count.
+ *
+ * The packed return value saturates on long phases. Complete 64-bit
+ * statistics are written to params->stats as well: elapsed time in
+ * nanoseconds, number of throttling events, and total and longest
+ * time spent throttled.
+ *
  * The memguard functionality can be influenced by the following flags:
  *
  * - MGF_PERIODIC: When set, the memguard timer is set to expire
@@ -68,31 +82,78 @@ void memguard_block_if_needed(void);
  *   overrun in statistics. No blocking happens. This may change in
  *   the future.
  *
+ * - MGF_RECLAIM: Only meaningful with MGF_PERIODIC. At the beginning
+ *   of each period, the core predicts its usage from the preceding
+ *   period and donates the rest of its budget to a global lock-free
+ *   pool. A core that exhausts its budget first takes back what the
+ *   other cores left of its donation, then tries to reclaim from their
+ *   donations before blocking. Events are never granted twice, so the
+ *   sum of the budgets is not exceeded within a period.
+ *
+ * - MGF_SYNC: Only meaningful with MGF_PERIODIC. Periods start at
+ *   multiples of budget_time on the system counter instead of at the
+ *   time of the call, so all cores regulated with the same period
+ *   replenish at common boundaries. A core joining in the middle of a
+ *   period gets a budget pro-rated to the time left in that period.
+ *
+ * - MGF_BUCKET: Only meaningful with MGF_PERIODIC, exclusive with
+ *   MGF_RECLAIM. Each counter is regulated as a token bucket of depth
+ *   event_burst: the budget is added to the bucket at every period
+ *   boundary, and what a period leaves unused carries over to the
+ *   next ones until the bucket is full. Short bursts then proceed
+ *   without throttling while the average rate stays capped by the
+ *   budget. The bucket fill is reported in params->event_tokens.
+ *
+ * - MGF_ADAPTIVE: Only meaningful with MGF_PERIODIC. The budgets are
+ *   scaled by a feedback controller driven by the slack the protected
+ *   real-time cell reports (see memguard_report_slack()), within
+ *   adapt_min and adapt_max per-mille of the requested budgets.
+ *
  * - MGF_MASK_INT: When set, memguard disables interrupts that can be
  *   disabled and are not needed for proper memguard functionality.
  *   This is to ensure (almost) non-preemptive execution of PREM
  *   predictable intervals that is required to reduce number of
  *   unpredictable cache misses.
  *
- * @param budget_time Time budget in microseconds. When zero, time
- * monitoring is switched off.
- * @param budget_memory Memory budget (number of cache misses). When
- * zero, memory access monitoring is switched off. Must be non-zero
- * when MGF_PERIODIC is set.
- * @param flags Flags - see MGF_* constants above.
+ * @param params Budgets for the next phase:
+ *   - budget_time: Time budget in microseconds. When zero, time
+ *     monitoring is switched off.
+ *   - budget_memory: Memory budget (number of cache misses). When
+ *     zero, memory access monitoring is switched off. Must be non-zero
+ *     when MGF_PERIODIC is set. Ignored when num_events is non-zero.
+ *   - flags: Flags - see MGF_* constants above.
+ *   - num_events, event_type, event_budget: per-counter budgets.
+ *   - event_burst: per-counter bucket depth with MGF_BUCKET.
+ *   - adapt_min, adapt_max: budget scale bounds with MGF_ADAPTIVE.
  *
  * @return Statistics since the preceding memguard call and/or the error flag.
  * These are encoded in different bits as follows:
  *   - 0     - Error (to keep compatibility with Linux smp calls)
- *   - 1-32  - Total number cache misses
+ *   - 1-32  - Total number of events on the first counter
  *   - 33-56 - Total time in microseconds
  *   - 62    - Memory budget overrun
  *   - 63    - Time budget overrun
  * See also MGRET_* constants.
  */
-long memguard_call(unsigned long budget_time, unsigned long budget_memory,
-		   unsigned long flags);
+long memguard_call(struct memguard_params *params);
 
 long memguard_call_params(unsigned long params_ptr);
 
+/**
+ * Report the slack of the protected real-time cell.
+ *
+ * Invoked once per period by cells with JAILHOUSE_CELL_MEMGUARD_SLACK.
+ * Cores regulated with MGF_ADAPTIVE apply each report at their next
+ * period boundary: a slack below MG_ADAPT_SLACK_LOW halves their
+ * budget scale, one above MG_ADAPT_SLACK_HIGH raises it by a
+ * sixteenth of the allowed range, within adapt_min and adapt_max.
+ *
+ * @param slack Slack of the latest period in per-mille of that period,
+ *              as a signed value between MEMGUARD_SLACK_MIN and
+ *              MEMGUARD_SLACK_MAX.
+ *
+ * @return 0 on success, -EINVAL for an out-of-range slack.
+ */
+long memguard_report_slack(unsigned long slack);
+
 #endif
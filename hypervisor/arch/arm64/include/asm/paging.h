@@ -41,9 +41,16 @@
 #define L3_VADDR_MASK		BIT_MASK(20, 12)
 
 /*
- * Stage-1 and Stage-2 lower attributes.
+ * Upper attribute, stage 1 and 2.
  * The contiguous bit is a hint that allows the PE to store blocks of 16 pages
- * in the TLB. This may be a useful optimisation.
+ * in the TLB. It must be set on all entries of such an aligned block, and the
+ * block must map a contiguous output range with identical attributes.
+ */
+#define PTE_CONTIGUOUS		(0x1UL << 52)
+#define PTE_CONT_PAGES		16
+
+/*
+ * Stage-1 and Stage-2 lower attributes.
  */
 #define PTE_ACCESS_FLAG		(0x1 << 10)
 /*
@@ -167,7 +174,7 @@
  * Location of per-CPU temporary mapping region in hypervisor address space.
  */
 #define TEMPORARY_MAPPING_BASE	0xff0000000000UL
-#define NUM_TEMPORARY_PAGES	16
+#define NUM_TEMPORARY_PAGES	512
 
 #define REMAP_BASE		0xff8000000000UL
 #define NUM_REMAP_BITMAP_PAGES	4
@@ -175,6 +182,7 @@
 #ifndef __ASSEMBLY__
 
 struct cell;
+struct jailhouse_memory;
 struct paging_structures;
 
 typedef u64 *pt_entry_t;
@@ -215,7 +223,12 @@ unsigned int get_cpu_parange(void);
 				| VTCR_RES1)
 
 int arm_paging_cell_init(struct cell *cell);
+int arm_map_memory_region_flags(struct cell *cell,
+				const struct jailhouse_memory *mem,
+				unsigned long extra_flags);
 void arm_paging_cell_destroy(struct cell *cell);
+bool arm_cell_mem_writable(struct cell *cell, unsigned long gphys,
+			   unsigned long size);
 
 void arm_paging_vcpu_init(struct paging_structures *pg_structs);
 
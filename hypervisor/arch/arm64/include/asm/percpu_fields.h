@@ -15,5 +15,7 @@
 #define ARCH_PERCPU_FIELDS						\
 	ARM_PERCPU_FIELDS						\
 	struct memguard memguard;					\
+	/* Chunk of the root-cell recoloring in progress */		\
+	volatile unsigned long recolor_chunk;				\
 	unsigned long id_aa64mmfr0;					
 
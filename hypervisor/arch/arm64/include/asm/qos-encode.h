@@ -0,0 +1,167 @@
+/*
+ * ARM QoS Support for Jailhouse, register encoding
+ *
+ * Copyright (c) Boston University, 2020
+ *
+ * Authors:
+ *  Renato Mancuso <rmancuso@bu.edu>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef _JAILHOUSE_ASM_QOS_ENCODE_H
+#define _JAILHOUSE_ASM_QOS_ENCODE_H
+
+/* The encoding only depends on the backend passed to it, so that it can be
+ * built and tested on the host as well */
+
+#include <jailhouse/types.h>
+#include <jailhouse/qos-common.h>
+
+struct qos_device {
+	char name [QOS_DEV_NAMELEN];
+	__u8 flags;
+	__u32 base;
+};
+
+/* Register access to one interconnect. Offsets are relative to its base. */
+struct qos_backend {
+	const struct qos_device * devices;
+	unsigned int num_devices;
+	/* Make the registers accessible, called before the first access */
+	int (*init)(void);
+	__u32 (*read32)(__u32 offset);
+	void (*write32)(__u32 offset, __u32 value);
+};
+
+struct qos_param {
+	char name [QOS_PARAM_NAMELEN];
+	__u16 reg;
+	__u8 enable;
+	__u8 shift;
+	__u32 mask;
+};
+
+/* Board-independent QoS support */
+#define FLAGS_HAS_RWQOS    (1 << 0)
+#define FLAGS_HAS_REGUL    (1 << 1)
+#define FLAGS_HAS_DYNQOS   (1 << 2)
+
+/* Offsets of control registers from beginning of device-specific
+ * config space */
+
+/* The typical QoS interface has the following layout:
+ * 
+ * BASE: 0x??80
+ * read_qos    = BASE
+ * write_qos   = + 0x04
+ * fn_mod      = + 0x08
+----- REGULATION ------
+ * qos_cntl    = + 0x0C
+ * max_ot      = + 0x10
+ * max_comb_ot = + 0x14
+ * aw_p        = + 0x18
+ * aw_b        = + 0x1C
+ * aw_r        = + 0x20
+ * ar_p        = + 0x24
+ * ar_b        = + 0x28
+ * ar_r        = + 0x2C
+----- DYNAMIC QOS -----
+ * tgt_latency = + 0x30
+ * ki          = + 0x34
+ * qos_range   = + 0x38
+ */
+
+#define READ_QOS           0x00
+#define WRITE_QOS          0x04
+#define FN_MOD             0x08
+#define QOS_CNTL           0x0C
+#define MAX_OT             0x10
+#define MAX_COMB_OT        0x14
+#define AW_P               0x18
+#define AW_B               0x1C
+#define AW_R               0x20
+#define AR_P               0x24
+#define AR_B               0x28
+#define AR_R               0x2C
+#define TGT_LATENCY        0x30
+#define KI                 0x34
+#define QOS_RANGE          0x38
+
+/* QOS_CNTL REgister  */
+#define EN_AWAR_OT_SHIFT    (7)
+#define EN_AR_OT_SHIFT      (6)
+#define EN_AW_OT_SHIFT      (5)
+#define EN_AR_LATENCY_SHIFT (4)
+#define EN_AW_LATENCY_SHIFT (3)
+#define EN_AWAR_RATE_SHIFT  (2)
+#define EN_AR_RATE_SHIFT    (1)
+#define EN_AW_RATE_SHIFT    (0)
+#define EN_NO_ENABLE        (31)
+
+/* Number of settable QoS parameters */
+#define QOS_PARAMS          22
+
+/* Max. number of devices of a backend */
+#define QOS_MAX_DEVICES     32
+
+extern const struct qos_param qos_params[QOS_PARAMS];
+
+/* State of a compilation into an array of register writes */
+struct qos_compiler {
+	const struct qos_backend * backend;
+	struct qos_op * ops;
+	unsigned int max_ops;
+	unsigned int num;
+	/* Device of the last setting, used by settings without device name */
+	const struct qos_device * dev;
+	/* Bitmap of the devices whose QOS_CNTL register gets written */
+	unsigned long devices;
+	__u32 enable[QOS_MAX_DEVICES];
+};
+
+/* Start a compilation for the devices of backend into ops */
+void qos_compiler_init(struct qos_compiler * c,
+		       const struct qos_backend * backend,
+		       struct qos_op * ops, unsigned int max_ops);
+
+/* Find QoS-enabled device by name */
+const struct qos_device * qos_dev_find_by_name(const struct qos_backend * backend,
+					       const char * name);
+
+/* Find QoS parameter by name */
+const struct qos_param * qos_param_find_by_name(const char * name);
+
+/* Returns true if the QoS interface of the device implements the register
+ * at the given offset from its base */
+bool qos_dev_has_reg(const struct qos_device * dev, __u32 reg);
+
+/* Add the write of a parameter of the current device c->dev */
+int qos_compile_param(struct qos_compiler * c,
+		      const struct qos_param * param, __u32 value);
+
+/* Resolve a single setting. An empty device name refers to the device of
+ * the previous setting. */
+int qos_compile_setting(struct qos_compiler * c, const char * dev_name,
+			const char * param_name, __u32 value);
+
+/* Once we are done setting all the parameters, enable all the affected
+ * interfaces. This is a plain write of the control register. Returns the
+ * number of register writes. */
+int qos_compile_finish(struct qos_compiler * c);
+
+/* Resolve the names of a set of QoS parameters passed via the array
+ * settings into register writes. The length of the array is specified in
+ * the last parameter. Returns the number of register writes. */
+int qos_compile(struct qos_compiler * c, const struct qos_setting * settings,
+		unsigned long count);
+
+/* Writes may only target the QoS interface of a known device */
+bool qos_op_valid(const struct qos_backend * backend, const struct qos_op * op);
+
+/* Perform the register writes of a compiled configuration */
+void qos_apply_ops(const struct qos_backend * backend,
+		   const struct qos_op * ops, unsigned int count);
+
+#endif /* !_JAILHOUSE_ASM_QOS_ENCODE_H */
@@ -10,6 +10,11 @@
  * See the COPYING file in the top-level directory.
  */
 
+/*
+ * Each platform provides the table of its QoS-enabled devices and a
+ * struct qos_backend named qos_platform to access their registers.
+ */
+
 #if CONFIG_MACH_NXP_S32 == 1
 
 #define NIC_BASE           (0x40010000UL)
@@ -93,6 +98,19 @@ static const struct qos_device devices [QOS_DEVICES] = {
 	},
 }; 
 
+static int s32_qos_init(void)
+{
+	return qos_mmio_init(NIC_BASE, NIC_SIZE);
+}
+
+static const struct qos_backend qos_platform = {
+	.devices = devices,
+	.num_devices = QOS_DEVICES,
+	.init = s32_qos_init,
+	.read32 = qos_mmio_read32,
+	.write32 = qos_mmio_write32,
+};
+
 /* END -- CONFIG_MACH_NXP_S32 */
 
 #elif CONFIG_MACH_ZYNQMP_ZCU102 == 1
@@ -249,20 +267,31 @@ static const struct qos_device devices [QOS_DEVICES] = {
 }; 
 
 /* In the ZCU102, QoS registers require secure access. We must perform
- * an smc to a patched ATF to interact with them. Define read/write
- * functions accordingly */
-
-#define qos_read32(addr)			\
-    smc_arg1(ZCU102_QOS_READ_SMC, (unsigned long)addr)
-
-#define qos_write32(addr, val)			\
-    smc_arg2(ZCU102_QOS_WRITE_SMC, (unsigned long)addr, val)
-
-/* Since we are going to use SMC calls to access any of the QoS
- * registers, do no perform a real mapping but only provide a pointer
- * that reflects the linear 1:1 mapping done in the ATF. */
-#define qos_map_device(base, size)		\
-    ((void *)NIC_BASE)
+ * an smc to a patched ATF to interact with them. The ATF maps the
+ * interconnect 1:1, so no mapping is needed at EL2. */
+
+static int zcu102_qos_init(void)
+{
+	return 0;
+}
+
+static __u32 zcu102_qos_read32(__u32 offset)
+{
+	return smc_arg1(ZCU102_QOS_READ_SMC, NIC_BASE + offset);
+}
+
+static void zcu102_qos_write32(__u32 offset, __u32 value)
+{
+	smc_arg2(ZCU102_QOS_WRITE_SMC, NIC_BASE + offset, value);
+}
+
+static const struct qos_backend qos_platform = {
+	.devices = devices,
+	.num_devices = QOS_DEVICES,
+	.init = zcu102_qos_init,
+	.read32 = zcu102_qos_read32,
+	.write32 = zcu102_qos_write32,
+};
 
 /* END -- CONFIG_MACH_ZYNQMP_ZCU102 */
 
@@ -270,31 +299,9 @@ static const struct qos_device devices [QOS_DEVICES] = {
 
 #pragma message("No QoS support implemented for this platform")
 
-#define NIC_BASE           0
-#define NIC_SIZE           0
-#define QOS_DEVICES        0
-
-static const struct qos_device devices [QOS_DEVICES];
+/* Without init, every QoS request fails with -ENOSYS */
+static const struct qos_backend qos_platform = {
+	.num_devices = 0,
+};
 
 #endif
-
-
-/* If the a platform-specific way to interact with QoS registers is
- * specified, use standard mmio functions */
-#ifndef qos_read32
-#define qos_read32(addr)			\
-    mmio_read32(addr)
-#endif
-
-#ifndef qos_write32
-#define qos_write32(addr, val)			\
-    mmio_write32(addr, val)
-#endif
-
-/* Unless the QoS registers are not directly accessible from EL2, use
- * the stardard mapping to access the I/O registers */
-#ifndef qos_map_device
-#define qos_map_device(base, size)		\
-    qos_map_device(base, size);
-#endif
-
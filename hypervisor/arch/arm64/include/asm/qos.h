@@ -13,9 +13,37 @@
 #ifndef _JAILHOUSE_ASM_QOS_H
 #define _JAILHOUSE_ASM_QOS_H
 
+#include <jailhouse/types.h>
 #include <jailhouse/qos-common.h>
 
+struct cell;
+
 /* Main entry point for QoS management call */
 int qos_call(unsigned long count, unsigned long settings_ptr);
 
+/* Resolve settings into register writes returned to the caller, see
+ * struct qos_compile_params. Returns the number of writes. */
+int qos_compile_call(unsigned long params_ptr);
+
+/* Perform the register writes returned by qos_compile_call() */
+int qos_apply_call(unsigned long count, unsigned long ops_ptr);
+
+/* Return the decoded value of every parameter of every device as an array
+ * of struct qos_setting. Returns the number of settings. */
+int qos_query_call(unsigned long max, unsigned long settings_ptr);
+
+/* Save the QoS registers of every device as register writes that restore
+ * them via qos_apply_call(). Returns the number of writes. */
+int qos_snapshot_call(unsigned long max, unsigned long ops_ptr);
+
+/* Configure the QoS control loop, see struct qos_loop_params */
+int qos_loop_call(unsigned long params_ptr);
+
+/* Feed a slack report of the real-time cell into the QoS control loop.
+ * Reports that were already seen are ignored. */
+void qos_loop_update(u64 slack_report);
+
+/* Apply the QoS profile of a starting cell, combined with the others */
+int qos_cell_start(struct cell *cell);
+
 #endif /* _JAILHOUSE_ASM_QOS_H  */
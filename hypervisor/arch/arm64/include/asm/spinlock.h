@@ -67,6 +67,31 @@ static inline void spin_lock(spinlock_t *lock)
 	: "memory");
 }
 
+/*
+ * Take the lock only if it is free, for callers that must not spin.
+ * Returns true if the lock was taken.
+ */
+static inline bool spin_trylock(spinlock_t *lock)
+{
+	unsigned int tmp;
+	spinlock_t lockval;
+
+	asm volatile(
+"	prfm	pstl1strm, %2\n"
+"1:	ldaxr	%w0, %2\n"
+"	eor	%w1, %w0, %w0, ror #16\n"
+"	cbnz	%w1, 2f\n"
+"	add	%w0, %w0, %3\n"
+"	stxr	%w1, %w0, %2\n"
+"	cbnz	%w1, 1b\n"
+"2:"
+	: "=&r" (lockval), "=&r" (tmp), "+Q" (*lock)
+	: "I" (1 << TICKET_SHIFT)
+	: "memory");
+
+	return !tmp;
+}
+
 /*
  * See spin_lock: This implementation implies a memory barrier.
  */
@@ -13,11 +13,10 @@
  */
 
 #include <asm/memguard.h>
+#include <asm/qos.h>
 #include <asm/sysregs.h>
 #include <asm/irqchip.h>
 #include <jailhouse/printk.h>
-#include <asm/gic.h>
-#include <asm/gic_v2.h>
 #include <jailhouse/control.h>
 
 #include <asm/percpu.h>
@@ -27,111 +26,26 @@
 
 #define MG_DEBUG 0
 
-#if CONFIG_MACH_JETSON_TX2 == 1
-/* NVIDIA TX2 Specific Support */
+#define NS_PER_SEC		1000000000ULL
 
-/* Found out by using Linux perf tool and watching /proc/interrupts
- * Parker manual says:
- *   The total size of 384 corresponds to:
- *   32 first IDs are SGI and PPI
- *   288 next IDs are global SPI, one to one mapped to the 288 LIC interrupts
- *   64 next IDs are local SPI, generated inside CCPLEX and for CCPLEX use only
- */
-#define CCPLEX_IRQ_SIZE			384
-#define MEMGUARD_TIMER_IRQ		26
-
-/* Conversion from cpu_id to PMU IRQ number
- *
- * Number 296 is defined in device tree which corresponds to:
- * (32 SGI and PPI +) 288 global SPI + 4 local SPI
- * This number is base for A57 cluster, 320 is for Denvers
+/*
+ * The platform is described by the root cell configuration: the PPI of
+ * the EL2 physical timer, the PMU interrupt of each CPU and the number
+ * of implemented priority bits.
  */
-static const int mach_cpu_id2irqn[6] = {
-	32 + 296,
-	32 + 320,
-	32 + 321,
-	32 + 297,
-	32 + 298,
-	32 + 299,
-};
-
-/* On Parker, only 16 priority levels are implemented */
-#define IRQ_PRIORITY_MIN		0xF0
-#define IRQ_PRIORITY_MAX		0x00
-#define IRQ_PRIORITY_INC		0x10
-
-#define IRQ_PRIORITY_THR		0x10
-
+#define MG_PLATFORM		(system_config->platform_info.arm)
+#define MEMGUARD_TIMER_IRQ	(MG_PLATFORM.memguard_timer_irq)
 
-#elif CONFIG_MACH_NXP_S32 == 1
-/* NXP S32 Specific Support */
+/* Distance between two implemented priority levels */
+static u8 irq_priority_inc;
 
-/* For this SoC we have:
- - 32 SGIs and PPIs
- - 8 SPIs
- - 16 on-platform vectors
- - 152 off-platform vectors
- ------ Total = 208
-*/
-#define CCPLEX_IRQ_SIZE			208
-#define MEMGUARD_TIMER_IRQ		26 /* Non-secure physical timer */
-
-static const int mach_cpu_id2irqn[4] = {
-    195,
-    196,
-    197,
-    198
-};
-
-/* On s32, all 256 priority levels are implemented */
-#define IRQ_PRIORITY_MIN		0xFF
-#define IRQ_PRIORITY_MAX		0x00
-#define IRQ_PRIORITY_INC		0x01
-
-#define IRQ_PRIORITY_THR		0x10
-
-#elif CONFIG_MACH_ZYNQMP_ZCU102 == 1
-/* ZCU 102 Specific Support */
-
-/* For this SoC we have:
- - 32 SGIs and PPIs
- - 8 SPIs
- - 148 system interrupts
- ------ Total = 188
-*/
-#define CCPLEX_IRQ_SIZE			188
-#define MEMGUARD_TIMER_IRQ		26 /* Non-secure physical timer */
-
-static const int mach_cpu_id2irqn[4] = {
-    175,
-    176,
-    177,
-    178
-};
-
-/* On ZCU102, 16 priority levels are implemented in non-secure state */
-#define IRQ_PRIORITY_MIN		0xF0
+#define IRQ_PRIORITY_MIN		((u8)(0x100 - irq_priority_inc))
 #define IRQ_PRIORITY_MAX		0x00
-#define IRQ_PRIORITY_INC		0x10
-
-#define IRQ_PRIORITY_THR		0x10
-
-#else
-#error No MemGuard support implemented for this SoC.
-#endif 
-
+#define IRQ_PRIORITY_INC		irq_priority_inc
 
-/* Address of a bit for e.g. enabling of irq with id m is calculated as:
- * ADDR = BASE + (4 * n) where n = m / 32
- * Then the position of the bit in the register is calculated as:
- * POS = m MOD 32 */
-#define IRQ_BIT_OFFSET(x)		(4 * ((x)/32))
-#define IRQ_BIT_POSITION(x)		((x) % 32)
+/* Only the timer and PMU IRQs stay unmasked with MGF_MASK_INT */
+#define IRQ_PRIORITY_THR		(2 * irq_priority_inc)
 
-/* Similarly for bytes (e.g. irq priority) */
-#define IRQ_BYTE_OFFSET(x)		(4 * ((x)/4))
-#define IRQ_BYTE_POSITION(x)	(((x) % 4) * 8)
-#define IRQ_BYTE_MASK			0xFF
 
 #define CNTHP_CTL_EL2_ENABLE	(1<<0)
 #define CNTHP_CTL_EL2_IMASK	(1<<1)
@@ -213,55 +127,89 @@ static const int mach_cpu_id2irqn[4] = {
 #define QUADD_ARMV8_A57_HW_EVENT_L2D_CACHE_REFILL_LD	0x52
 #define QUADD_ARMV8_A57_HW_EVENT_L2D_CACHE_REFILL_ST	0x53
 
-extern void *gicc_base;
-extern void *gicd_base;
-
 
 #define DEFAULT_EVENTS_MAX 10
 #define DEBUG_MG
 
-#define PMU_INDEX 5
+/* MemGuard reserves the MG_NUM_COUNTERS topmost PMU counters */
+#define MG_NUM_COUNTERS		MEMGUARD_MAX_EVENTS
+#define MG_DEFAULT_EVENT	QUADD_ARMV8_HW_EVENT_L2_CACHE_REFILL
 
-#define PMUREG(name, num) name ## num ## _EL0
-#define PMEVCNTR(num) PMUREG(PMEVCNTR, num)
-#define PMEVTYPER(num) PMUREG(PMEVTYPER, num)
+/*
+ * With MGF_RECLAIM, a core keeps at least 1/MG_RECLAIM_SHARE of its
+ * budget per period, and reclaims from the pool in chunks of that size.
+ */
+#define MG_RECLAIM_SHARE	8
 
-static inline int gicv2_get_prio(int irqn)
-{
-	u32 prio = mmio_read32(gicd_base + GICD_IPRIORITYR + IRQ_BYTE_OFFSET(irqn));
-	return (prio >> IRQ_BYTE_POSITION(irqn)) & IRQ_BYTE_MASK;
-}
+#define MG_COUNTER(memguard, i)		((memguard)->first_counter + (i))
+#define MG_RESERVED_MASK(memguard)				\
+	(((1 << MG_NUM_COUNTERS) - 1) << (memguard)->first_counter)
 
-static inline void gicv2_set_prio(int irqn, int prio)
+/*
+ * Adaptive controller (MGF_ADAPTIVE): a reported slack below
+ * MG_ADAPT_SLACK_LOW per-mille halves the budget scale, one above
+ * MG_ADAPT_SLACK_HIGH raises it by 1/MG_ADAPT_STEPS of the allowed range.
+ */
+#define MG_ADAPT_SLACK_LOW	100
+#define MG_ADAPT_SLACK_HIGH	250
+#define MG_ADAPT_STEPS		16
+#define MG_ADAPT_NOMINAL	1000
+
+/* Latest slack report: sequence number in the upper 32 bits and the
+ * signed slack in the lower ones, so that both are read at once */
+static volatile u64 memguard_slack_report;
+
+/* Budget donated by each core, per counter slot. Any core may reclaim
+ * from the donations of the others, the donor takes back what is left of
+ * its own. */
+static volatile unsigned long
+memguard_pool[JAILHOUSE_MAX_PMU_IRQS][MG_NUM_COUNTERS];
+
+/* Per-period statistics, mapped read-only into the root cell */
+static struct memguard_trace_ring memguard_trace[MEMGUARD_TRACE_CPUS]
+	__attribute__((section(".memguard_trace"), aligned(PAGE_SIZE)));
+
+static inline unsigned int memguard_pmu_irq(unsigned int cpu_id)
 {
-	u32 p = mmio_read32(gicd_base + GICD_IPRIORITYR + IRQ_BYTE_OFFSET(irqn));
-	p &= ~(IRQ_BYTE_MASK << IRQ_BYTE_POSITION(irqn));
-	p |= (prio & IRQ_BYTE_MASK) << IRQ_BYTE_POSITION(irqn);
-	mmio_write32(gicd_base + GICD_IPRIORITYR + IRQ_BYTE_OFFSET(irqn), p);
+	if (cpu_id >= JAILHOUSE_MAX_PMU_IRQS)
+		return 0;
+	return MG_PLATFORM.memguard_pmu_irqs[cpu_id];
 }
 
-static inline int gicv2_get_targets(int irqn)
+/* Whether the configuration enables MemGuard on the given CPU */
+static inline bool memguard_supported(unsigned int cpu_id)
 {
-	u32 t = mmio_read32(gicd_base + GICD_ITARGETSR + IRQ_BYTE_OFFSET(irqn));
-	return (t >> IRQ_BYTE_POSITION(irqn)) & IRQ_BYTE_MASK;
+	return MEMGUARD_TIMER_IRQ != 0 && memguard_pmu_irq(cpu_id) != 0;
 }
 
-static inline void gicv2_set_targets(int irqn, int targets)
+static void memguard_init_priority_levels(void)
 {
-	u32 t = mmio_read32(gicd_base + GICD_ITARGETSR + IRQ_BYTE_OFFSET(irqn));
-	t &= ~(IRQ_BYTE_MASK << IRQ_BYTE_POSITION(irqn));
-	t |= (targets & IRQ_BYTE_MASK) << IRQ_BYTE_POSITION(irqn);
-	mmio_write32(gicd_base + GICD_ITARGETSR + IRQ_BYTE_OFFSET(irqn), t);
+	unsigned int bits = MG_PLATFORM.gic_priority_bits;
+	u8 prio;
+
+	if (bits == 0) {
+		/* Unimplemented low-order priority bits read as zero */
+		prio = irqchip_get_irq_priority(MEMGUARD_TIMER_IRQ);
+		irqchip_set_irq_priority(MEMGUARD_TIMER_IRQ, 0xff);
+		irq_priority_inc =
+			(u8)~irqchip_get_irq_priority(MEMGUARD_TIMER_IRQ) + 1;
+		irqchip_set_irq_priority(MEMGUARD_TIMER_IRQ, prio);
+	} else {
+		irq_priority_inc = 1 << (8 - MIN(bits, 8));
+	}
 }
 
 /* Globally lower (numerically increase) all current priorities and
  * set maximal priority to timer and PMU IRQs */
 static inline void memguard_init_priorities(void)
 {
-	int i;
+	unsigned int num_irqs = irqchip_num_irqs();
+	unsigned int i;
+
+	memguard_init_priority_levels();
 
-	for (i = 0; i < CCPLEX_IRQ_SIZE; i++) {
-		u32 prio = gicv2_get_prio(i);
+	for (i = 0; i < num_irqs; i++) {
+		u32 prio = irqchip_get_irq_priority(i);
 
 		/* Avoid chaning the priorities, which are low enough
 		 * and never set minimal (i.e. always masked)
@@ -269,14 +217,15 @@ static inline void memguard_init_priorities(void)
 		while (prio < IRQ_PRIORITY_THR &&
 		       prio < IRQ_PRIORITY_MIN - IRQ_PRIORITY_INC)
 			prio += IRQ_PRIORITY_INC;
-		gicv2_set_prio(i, prio);
+		irqchip_set_irq_priority(i, prio);
 	}
 
-	for (i = 0; i < ARRAY_SIZE(mach_cpu_id2irqn); i++) {
-		gicv2_set_prio(mach_cpu_id2irqn[i], IRQ_PRIORITY_MAX + IRQ_PRIORITY_INC);
-	}
+	for (i = 0; i < JAILHOUSE_MAX_PMU_IRQS; i++)
+		if (memguard_pmu_irq(i))
+			irqchip_set_irq_priority(memguard_pmu_irq(i),
+					IRQ_PRIORITY_MAX + IRQ_PRIORITY_INC);
 
-	gicv2_set_prio(MEMGUARD_TIMER_IRQ, IRQ_PRIORITY_MAX);
+	irqchip_set_irq_priority(MEMGUARD_TIMER_IRQ, IRQ_PRIORITY_MAX);
 }
 
 static inline void memguard_dump_timer_regs(void)
@@ -296,16 +245,11 @@ static inline void memguard_dump_timer_regs(void)
 
 static inline void memguard_print_priorities(void)
 {
-	int i, j;
-	u32 prio;
-	for (i = 0; i < CCPLEX_IRQ_SIZE / 4; i++) {
-		prio = mmio_read32(gicd_base + GICD_IPRIORITYR + (4 * i));
-		for (j = 0; j < 4; j++) {
-			mg_print("%3d %02x\n", i * 4 + j, (prio >> (8 * j)) & 0xFF);
-		}
-	}
-	prio = mmio_read32(gicc_base + GICC_PMR);
-	mg_print("mask: 0x%08x\n", prio);
+	unsigned int num_irqs = irqchip_num_irqs();
+	unsigned int i;
+
+	for (i = 0; i < num_irqs; i++)
+		mg_print("%3d %02x\n", i, irqchip_get_irq_priority(i));
 }
 
 static inline u64 memguard_timer_count(void)
@@ -315,77 +259,287 @@ static inline u64 memguard_timer_count(void)
 	return reg64;
 }
 
-static inline u32 memguard_pmu_count(void)
+/* Convert system counter ticks without overflowing on long intervals */
+static inline u64 memguard_ticks_to_ns(u64 ticks, u32 freq)
 {
-	u32 reg32;
-	arm_read_sysreg(PMEVCNTR(PMU_INDEX), reg32);
+	return ticks / freq * NS_PER_SEC + ticks % freq * NS_PER_SEC / freq;
+}
+
+/*
+ * The reserved counters are accessed indirectly through PMSELR_EL0. The
+ * selector belongs to the guest as well, so preserve its value.
+ */
+static inline u32 memguard_pmu_read_counter(unsigned int idx)
+{
+	u32 sel, reg32;
+
+	arm_read_sysreg(PMSELR_EL0, sel);
+	arm_write_sysreg(PMSELR_EL0, idx);
+	isb();
+	arm_read_sysreg(PMXEVCNTR_EL0, reg32);
+	arm_write_sysreg(PMSELR_EL0, sel);
+
 	return reg32;
 }
 
-static inline void memguard_pmu_irq_enable(unsigned int cpu_id, u8 targets)
+static inline void memguard_pmu_write_counter(unsigned int idx, u32 value,
+					      u32 event)
 {
-	int irqn = mach_cpu_id2irqn[cpu_id];
+	u32 sel;
+
+	arm_read_sysreg(PMSELR_EL0, sel);
+	arm_write_sysreg(PMSELR_EL0, idx);
+	isb();
+	arm_write_sysreg(PMXEVCNTR_EL0, value);
+	arm_write_sysreg(PMXEVTYPER_EL0, event & PMEVTYPER_EVTCOUNT_MASK);
+	arm_write_sysreg(PMSELR_EL0, sel);
+}
 
-	/* Enable interrupt for counter at index */
-	arm_write_sysreg(PMINTENSET_EL1, 1 << PMU_INDEX);
+/* Number of events counted by counter i since its budget was set */
+static inline u32 memguard_pmu_consumed(volatile struct memguard *memguard,
+					unsigned int i)
+{
+	if (!(memguard->counter_mask & (1 << MG_COUNTER(memguard, i))))
+		return 0;
 
-	/* Enable PMU interrupt for current core */
-	mmio_write32(gicd_base + GICD_ISENABLER + IRQ_BIT_OFFSET(irqn),
-		     1 << IRQ_BIT_POSITION(irqn));
+	/* The counter starts at UINT32_MAX - granted and may wrap once */
+	return memguard_pmu_read_counter(MG_COUNTER(memguard, i)) +
+		memguard->counters[i].granted + 1;
+}
+
+/* Lock-free donation of unused budget to the pool */
+static inline void memguard_pool_donate(volatile unsigned long *pool,
+					u32 amount)
+{
+	u32 ret;
+	u64 tmp;
+
+	do {
+		asm volatile (
+			"ldxr	%1, %2\n\t"
+			"add	%1, %1, %3\n\t"
+			"stxr	%w0, %1, %2\n\t"
+			"dmb    ish\n\t"
+			: "=&r" (ret), "=&r" (tmp),
+			  "+Q" (*pool)
+			: "r" ((u64)amount));
+	} while (ret);
+}
+
+/* Lock-free removal of up to max events from the pool, returns the
+ * amount actually obtained */
+static inline u32 memguard_pool_reclaim(volatile unsigned long *pool,
+					u32 max)
+{
+	u32 ret;
+	u64 avail, taken;
+
+	do {
+		asm volatile (
+			"ldxr	%1, %3\n\t"
+			"cmp	%1, %4\n\t"
+			"csel	%2, %1, %4, lo\n\t"
+			"sub	%1, %1, %2\n\t"
+			"stxr	%w0, %1, %3\n\t"
+			"dmb    ish\n\t"
+			: "=&r" (ret), "=&r" (avail), "=&r" (taken),
+			  "+Q" (*pool)
+			: "r" ((u64)max)
+			: "cc");
+	} while (ret);
+
+	return taken;
+}
+
+/* Reclaim up to max events of counter slot i from the other cores */
+static u32 memguard_pool_reclaim_others(unsigned int i, u32 max)
+{
+	unsigned int cpu = this_cpu_id();
+	unsigned int n;
+	u32 taken = 0;
+
+	for (n = 1; n < JAILHOUSE_MAX_PMU_IRQS && taken < max; n++)
+		taken += memguard_pool_reclaim(
+			&memguard_pool[(cpu + n) % JAILHOUSE_MAX_PMU_IRQS][i],
+			max - taken);
+
+	return taken;
+}
+
+/* Take back whatever is left of the donations of the current period */
+static void memguard_revoke_donations(volatile struct memguard *memguard)
+{
+	unsigned int i;
+
+	for (i = 0; i < MG_NUM_COUNTERS; i++) {
+		if (memguard->counters[i].donated)
+			memguard_pool_reclaim(
+				&memguard_pool[this_cpu_id()][i],
+				memguard->counters[i].donated);
+		memguard->counters[i].donated = 0;
+	}
+}
 
-	gicv2_set_targets(irqn, targets);
+static inline u32 memguard_reclaim_chunk(volatile struct memguard *memguard,
+					 unsigned int i)
+{
+	return MAX(memguard->counters[i].budget / MG_RECLAIM_SHARE, 1);
 }
 
-static inline void memguard_pmu_irq_disable(unsigned int cpu_id)
+static inline void memguard_pmu_irq_enable(unsigned int cpu_id, u32 counters)
 {
-	int irqn = mach_cpu_id2irqn[cpu_id];
+	unsigned int irqn = memguard_pmu_irq(cpu_id);
 
-	arm_write_sysreg(PMINTENCLR_EL1, 1 << PMU_INDEX);
+	/* Enable interrupt for the reserved counters */
+	arm_write_sysreg(PMINTENSET_EL1, counters);
 
-	mmio_write32(gicd_base + GICD_ICENABLER + IRQ_BIT_OFFSET(irqn),
-		     1 << IRQ_BIT_POSITION(irqn));
+	/* Enable PMU interrupt for current core */
+	irqchip_enable_irq(irqn, true);
+	irqchip_route_irq(irqn, cpu_id);
 }
 
-static inline void memguard_pmu_count_enable(void)
+static inline void memguard_pmu_irq_disable(unsigned int cpu_id, u32 counters)
 {
-	arm_write_sysreg(PMCNTENSET_EL0, 1 << PMU_INDEX);
+	arm_write_sysreg(PMINTENCLR_EL1, counters);
+
+	irqchip_enable_irq(memguard_pmu_irq(cpu_id), false);
 }
 
-static inline void memguard_pmu_count_disable(void)
+static inline void memguard_pmu_count_enable(u32 counters)
 {
-	arm_write_sysreg(PMCNTENCLR_EL0, 1 << PMU_INDEX);
+	arm_write_sysreg(PMCNTENSET_EL0, counters);
+}
+
+static inline void memguard_pmu_count_disable(u32 counters)
+{
+	arm_write_sysreg(PMCNTENCLR_EL0, counters);
+}
+
+/* (Re)load the budgets of all the counters armed in this phase */
+static inline void memguard_pmu_set_budget(volatile struct memguard *memguard)
+{
+	unsigned int i;
+
+	for (i = 0; i < MG_NUM_COUNTERS; i++) {
+		if (!(memguard->counter_mask & (1 << MG_COUNTER(memguard, i))))
+			continue;
+
+		memguard_pmu_write_counter(MG_COUNTER(memguard, i),
+				(u32)UINT32_MAX - memguard->counters[i].granted,
+				memguard->counters[i].event);
+	}
 }
 
-static inline void memguard_pmu_set_budget(u32 budget)
+/*
+ * Start a new period on counter i given its usage in the preceding
+ * one. With MGF_RECLAIM, the budget beyond the predicted usage is
+ * donated to the pool. With MGF_BUCKET, the unused part of the
+ * elapsed period is added to the new budget, up to the bucket depth.
+ */
+static void memguard_counter_replenish(volatile struct memguard *memguard,
+				       unsigned int i, u32 used)
 {
-	arm_write_sysreg(PMEVCNTR(PMU_INDEX), (u32)UINT32_MAX - budget);
-	arm_write_sysreg(PMEVTYPER(PMU_INDEX),
-			 //QUADD_ARMV8_HW_EVENT_BUS_ACCESS
-			 //QUADD_ARMV8_HW_EVENT_CLOCK_CYCLES
-			 QUADD_ARMV8_HW_EVENT_L2_CACHE_REFILL
-		);
+	volatile struct memguard_counter *counter = &memguard->counters[i];
+	u32 keep;
+
+	if (memguard->flags & MGF_BUCKET) {
+		/* Tokens left from the elapsed period plus the new budget */
+		keep = used < counter->granted ? counter->granted - used : 0;
+		counter->granted = MIN((u64)keep + counter->budget,
+				       MAX(counter->burst, counter->budget));
+		return;
+	}
+
+	counter->granted = counter->budget;
+
+	if (!(memguard->flags & MGF_RECLAIM) ||
+	    !(memguard->counter_mask & (1 << MG_COUNTER(memguard, i))))
+		return;
+
+	keep = MIN(counter->budget,
+		   MAX(used, memguard_reclaim_chunk(memguard, i)));
+	counter->donated = counter->budget - keep;
+	counter->granted = keep;
+	if (counter->donated) {
+		memguard_pool_donate(&memguard_pool[this_cpu_id()][i],
+				     counter->donated);
+		counter->donated_total += counter->donated;
+	}
+}
+
+/*
+ * Try to extend the current period of an overflowing counter. Returns
+ * true if the core can go on without being throttled.
+ */
+static bool memguard_counter_reclaim(volatile struct memguard *memguard,
+				     unsigned int i)
+{
+	volatile struct memguard_counter *counter = &memguard->counters[i];
+	unsigned int idx = MG_COUNTER(memguard, i);
+	u32 extra = 0;
+
+	if (!(memguard->flags & MGF_RECLAIM))
+		return false;
+
+	/* Only what the other cores left of the own donation comes back */
+	if (counter->donated) {
+		extra = memguard_pool_reclaim(&memguard_pool[this_cpu_id()][i],
+					      counter->donated);
+		counter->donated = 0;
+	}
+	if (!extra) {
+		extra = memguard_pool_reclaim_others(i,
+				memguard_reclaim_chunk(memguard, i));
+		counter->reclaimed_total += extra;
+	}
+
+	if (!extra)
+		return false;
+
+	/* Move the overflow point by extra events, keeping the count */
+	counter->granted += extra;
+	memguard_pmu_write_counter(idx, memguard_pmu_read_counter(idx) - extra,
+				   counter->event);
+
+	return true;
 }
 
 static void memguard_pmu_isr(volatile struct memguard *memguard)
 {
+	bool throttle = false;
+	unsigned int i;
+	u32 ovs;
 #if MG_DEBUG == 1	
-	u32 cntval = memguard_pmu_count();
 	u64 timval = memguard_timer_count();
 
 	static u32 print_cnt = 0;
 #endif
 	
-	/* Clear overflow flag */
-	arm_write_sysreg(PMOVSCLR_EL0, 1 << PMU_INDEX);
+	/* Clear overflow flags, any overflowing counter throttles the
+	 * core unless it can reclaim more budget */
+	arm_read_sysreg(PMOVSCLR_EL0, ovs);
+	ovs &= MG_RESERVED_MASK(memguard);
+	arm_write_sysreg(PMOVSCLR_EL0, ovs);
+
+	for (i = 0; i < MG_NUM_COUNTERS; i++)
+		if (ovs & (1 << MG_COUNTER(memguard, i)) &&
+		    !memguard_counter_reclaim(memguard, i))
+			throttle = true;
 
 #if MG_DEBUG == 1	
 	if (print_cnt < 100)
-		mg_print("[%d] _isr_pmu: p: %u t: %llu (CPU %d)\n",
-		       ++print_cnt, cntval, timval, this_cpu_id());
+		mg_print("[%d] _isr_pmu: ovs: 0x%x t: %llu (CPU %d)\n",
+		       ++print_cnt, ovs, timval, this_cpu_id());
 #endif
+	if (!throttle)
+		return;
+
 	memguard->memory_overrun = true;
-	if (memguard->flags & MGF_PERIODIC)
+	memguard->throttled = true;
+	if (memguard->flags & MGF_PERIODIC) {
 		memguard->block = 1; /* Block after EOI signalling */
+		memguard->throttle_count++;
+	}
 }
 
 void memguard_block_if_needed(void)
@@ -400,6 +554,8 @@ void memguard_block_if_needed(void)
 
 		arm_read_sysreg(ELR_EL2, elr);
 		arm_read_sysreg(SPSR_EL2, spsr);
+		/* Accounted by the timer ISR that ends the throttling */
+		memguard->block_start = memguard_timer_count();
 		asm volatile("msr daifclr, #3" : : : "memory"); /* enable IRQs and FIQs */
 		
 		/*
@@ -419,30 +575,40 @@ void memguard_block_if_needed(void)
 }
 
 
-static inline void memguard_pmu_init(unsigned int cpu_id, u8 irq_targets)
+static inline unsigned int memguard_pmu_num_counters(void)
 {
 	u32 reg32;
-	u64 reg;
 
 	arm_read_sysreg(PMCR_EL0, reg32);
+	return (reg32 & PMCR_EL0_N_MASK) >> PMCR_EL0_N_POS;
+}
+
+static inline void memguard_pmu_init(struct memguard *memguard,
+				     unsigned int cpu_id)
+{
+	unsigned int num_counters = memguard_pmu_num_counters();
+	u64 reg;
 
-	if (PMU_INDEX != ((reg32 & PMCR_EL0_N_MASK) >> PMCR_EL0_N_POS) - 1) {
-		panic_printk("Memguard PMU index mismatch\n");
+	/* Leave at least one counter to the guest */
+	if (num_counters <= MG_NUM_COUNTERS) {
+		panic_printk("Memguard needs %d PMU counters, only %d available\n",
+			     MG_NUM_COUNTERS + 1, num_counters);
 		panic_stop();
 	}
+	memguard->first_counter = num_counters - MG_NUM_COUNTERS;
 
-	/* Reserve a performance counter at index for hypervisor
+	/* Reserve the topmost performance counters for hypervisor
 	 * (decrease number of accessible counters from EL1 and EL0) */
 	arm_read_sysreg(MDCR_EL2, reg);
 	reg &= ~MDCR_EL2_HPMN_MASK;
-	reg |= MDCR_EL2_HPME + (PMU_INDEX - 1);
+	reg |= MDCR_EL2_HPME | memguard->first_counter;
 	arm_write_sysreg(MDCR_EL2, reg);
 
-	/* Allocate the counter for hypervisor */
-	memguard_pmu_count_disable();
-	arm_write_sysreg(PMOVSCLR_EL0, 1 << PMU_INDEX); // Clear overflow flag
+	/* Allocate the counters for hypervisor */
+	memguard_pmu_count_disable(MG_RESERVED_MASK(memguard));
+	arm_write_sysreg(PMOVSCLR_EL0, MG_RESERVED_MASK(memguard));
 
-	memguard_pmu_irq_enable(cpu_id, irq_targets);
+	memguard_pmu_irq_enable(cpu_id, MG_RESERVED_MASK(memguard));
 }
 
 static inline void memguard_timer_irq_enable(void)
@@ -453,7 +619,7 @@ static inline void memguard_timer_irq_enable(void)
 	reg &= ~CNTHP_CTL_EL2_IMASK;
 	arm_write_sysreg(CNTHP_CTL_EL2, reg);
 
-	mmio_write32(gicd_base + GICD_ISENABLER, (1 << MEMGUARD_TIMER_IRQ));
+	irqchip_enable_irq(MEMGUARD_TIMER_IRQ, true);
 }
 
 static inline void memguard_timer_irq_disable(void)
@@ -463,7 +629,7 @@ static inline void memguard_timer_irq_disable(void)
 	reg |= CNTHP_CTL_EL2_IMASK;
 	arm_write_sysreg(CNTHP_CTL_EL2, reg);
 
-	mmio_write32(gicd_base + GICD_ICENABLER, (1 << MEMGUARD_TIMER_IRQ));
+	irqchip_enable_irq(MEMGUARD_TIMER_IRQ, false);
 }
 
 static inline void memguard_timer_enable(void)
@@ -494,25 +660,149 @@ static inline void memguard_timer_init(void)
 	memguard_timer_irq_enable();
 }
 
-static void memguard_timer_isr(volatile struct memguard *memguard)
+/*
+ * In synchronized mode, periods start at multiples of budget_time on the
+ * system counter, which is common to all cores. If replenishment got
+ * delayed beyond the next boundary, realign to the current period.
+ */
+static void memguard_sync_catch_up(volatile struct memguard *memguard)
 {
+	u64 now = memguard_timer_count();
 
-	u32 cntval = memguard_pmu_count();
+	if (now >= memguard->last_time + memguard->budget_time)
+		memguard->last_time = now - now % memguard->budget_time;
+}
+
+/* Scale the budgets of a core joining in the middle of a synchronized
+ * period to the time left until the next boundary */
+static void memguard_sync_prorate(struct memguard *memguard, u64 now)
+{
+	u64 left = memguard->last_time + memguard->budget_time - now;
+	unsigned int i;
+
+	for (i = 0; i < MG_NUM_COUNTERS; i++)
+		memguard->counters[i].granted =
+			(u64)memguard->counters[i].budget * left /
+			memguard->budget_time;
+}
+
+/* Derive the budgets of all counters from the current scale */
+static void memguard_adapt_apply(volatile struct memguard *memguard)
+{
+	unsigned int i;
+	u64 budget;
+
+	for (i = 0; i < MG_NUM_COUNTERS; i++) {
+		budget = (u64)memguard->counters[i].nominal *
+			memguard->adapt_scale / MG_ADAPT_NOMINAL;
+		memguard->counters[i].budget = MIN(budget, UINT32_MAX);
+	}
+}
+
+/* Apply the latest slack report, if not done yet, to the budgets of the
+ * period that starts */
+static void memguard_adapt(volatile struct memguard *memguard)
+{
+	u64 report = memguard_slack_report;
+	s32 slack = (s32)report;
+	u32 step;
+
+	if ((u32)(report >> 32) == memguard->slack_seq)
+		return;
+	memguard->slack_seq = report >> 32;
+
+	if (slack < MG_ADAPT_SLACK_LOW) {
+		memguard->adapt_scale = MAX(memguard->adapt_scale / 2,
+					    memguard->adapt_min);
+	} else if (slack > MG_ADAPT_SLACK_HIGH) {
+		step = MAX((memguard->adapt_max - memguard->adapt_min) /
+			   MG_ADAPT_STEPS, 1);
+		memguard->adapt_scale = MIN(memguard->adapt_scale + step,
+					    memguard->adapt_max);
+	} else {
+		return;
+	}
+
+	memguard_adapt_apply(memguard);
+}
+
+/* Account for a throttling that the current timer interrupt ends */
+static void memguard_account_block(volatile struct memguard *memguard)
+{
+	u64 duration = memguard_timer_count() - memguard->block_start;
+
+	memguard->blocked_time += duration;
+	memguard->blocked_total += duration;
+	if (duration > memguard->blocked_max)
+		memguard->blocked_max = duration;
+}
+
+/* Append the statistics of the period that just ended to the trace */
+static void memguard_trace_period(volatile struct memguard *memguard,
+				  const u32 *used)
+{
+	struct memguard_trace_ring *ring;
+	struct memguard_trace_record *rec;
+	unsigned int i;
+
+	if (this_cpu_id() >= MEMGUARD_TRACE_CPUS)
+		return;
+
+	ring = &memguard_trace[this_cpu_id()];
+	rec = &ring->records[ring->head % MEMGUARD_TRACE_RECORDS];
+
+	rec->timestamp = memguard->last_time;
+	for (i = 0; i < MG_NUM_COUNTERS; i++)
+		rec->events[i] = used[i];
+	rec->blocked_time = memguard->blocked_time;
+	rec->flags = memguard->throttled ? MEMGUARD_TRACE_THROTTLED : 0;
+
+	/* Publish the record only once it is complete */
+	dmb(ish);
+	ring->head++;
+
+	memguard->blocked_time = 0;
+	memguard->throttled = false;
+}
+
+static void memguard_timer_isr(volatile struct memguard *memguard)
+{
+	u32 used[MG_NUM_COUNTERS];
+	unsigned int i;
 #if MG_DEBUG == 1
 	u64 timval = memguard_timer_count();
 
 	static u32 print_cnt[4] = {0, 0, 0, 0};
 	if (print_cnt[this_cpu_id()] < 100)
 		mg_print("[%d] _isr_tim p: %u t: %llu (CPU %d)\n",
-		       ++print_cnt[this_cpu_id()], cntval, timval, this_cpu_id());
+		       ++print_cnt[this_cpu_id()],
+		       memguard_pmu_consumed(memguard, 0), timval,
+		       this_cpu_id());
 #endif
 	memguard->time_overrun = true;
 
 	if (memguard->flags & MGF_PERIODIC) {
 		memguard->last_time += memguard->budget_time;
-		memguard->pmu_evt_cnt += memguard->budget_memory + 1 + cntval;
-		memguard_timer_set_cmpval(memguard->last_time);
-		memguard_pmu_set_budget(memguard->budget_memory);
+		if (memguard->flags & MGF_SYNC)
+			memguard_sync_catch_up(memguard);
+		/* Unused donations of the elapsed period expire */
+		memguard_revoke_donations(memguard);
+		if (memguard->flags & MGF_ADAPTIVE)
+			memguard_adapt(memguard);
+		/* Root cell CPUs also drive the interconnect QoS loop */
+		if (this_cell() == &root_cell)
+			qos_loop_update(memguard_slack_report);
+		for (i = 0; i < MG_NUM_COUNTERS; i++) {
+			used[i] = memguard_pmu_consumed(memguard, i);
+			memguard->counters[i].evt_cnt += used[i];
+			memguard_counter_replenish(memguard, i, used[i]);
+		}
+		if (memguard->block == 2)
+			memguard_account_block(memguard);
+		memguard_trace_period(memguard, used);
+		memguard_timer_set_cmpval(memguard->last_time +
+					  memguard->budget_time);
+		memguard_pmu_set_budget(memguard);
 		memguard->block = 0;
 	} else {
 		memguard_timer_disable();
@@ -523,12 +813,12 @@ static bool is_memguard_pmu_irq(u32 irqn)
 {
 	u32 reg;
 	
-	if (irqn != mach_cpu_id2irqn[this_cpu_id()])
+	if (irqn != memguard_pmu_irq(this_cpu_id()))
 		return false;
 
 	arm_read_sysreg(PMOVSCLR_EL0, reg);
 
-	return (reg & (1 << PMU_INDEX)) != 0;
+	return (reg & MG_RESERVED_MASK(&this_cpu_data()->memguard)) != 0;
 }
 
 bool memguard_handle_interrupt(u32 irqn)
@@ -537,8 +827,8 @@ bool memguard_handle_interrupt(u32 irqn)
 	static u32 print_cnt = 0;
 
 	if ((print_cnt < 100 || this_cpu_data()->memguard.block) &&
-	    ((this_cpu_id() == 2 && irqn != 30 && irqn != 26) ||
-	     (irqn >= mach_cpu_id2irqn[0] && (irqn <= mach_cpu_id2irqn[3]))))
+	    (irqn == MEMGUARD_TIMER_IRQ ||
+	     irqn == memguard_pmu_irq(this_cpu_id())))
 	{
 		mg_print("[%d] Received MG interrupt on CPU %d, nr = %d (block = %d)\n",
 		       ++print_cnt, this_cpu_id(), irqn, this_cpu_data()->memguard.block);
@@ -558,16 +848,26 @@ bool memguard_handle_interrupt(u32 irqn)
 	return false;
 }
 
-void memguard_init(u8 local_irq_target)
+void memguard_init(void)
 {
 	struct per_cpu *cpu_data = this_cpu_data();
 	struct memguard *memguard = &cpu_data->memguard;
+	u32 freq;
+
+	if (!memguard_supported(this_cpu_id()))
+		return;
 
 	mg_print("Initializing memguard on CPU %d\n", this_cpu_id());
 	
+	memguard_revoke_donations(memguard);
 	memset(memguard, 0, sizeof(struct memguard));
 
-	memguard_pmu_init(this_cpu_id(), local_irq_target);
+	if (this_cpu_id() < MEMGUARD_TRACE_CPUS) {
+		arm_read_sysreg(CNTFRQ_EL0, freq);
+		memguard_trace[this_cpu_id()].timer_freq = freq;
+	}
+
+	memguard_pmu_init(memguard, this_cpu_id());
 
 	memguard_timer_init();
 
@@ -583,73 +883,181 @@ void memguard_init(u8 local_irq_target)
 
 void memguard_suspend()
 {
-	memguard_pmu_count_disable();
+	struct memguard *memguard = &this_cpu_data()->memguard;
+
+	if (!memguard_supported(this_cpu_id()))
+		return;
+
+	memguard_pmu_count_disable(MG_RESERVED_MASK(memguard));
 	memguard_timer_disable();
+	memguard_revoke_donations(memguard);
 
 	memguard_timer_set_cmpval(UINT64_MAX);
 }
 
 void memguard_exit()
 {
-	mg_print("memguard_exit\n");
+	struct memguard *memguard = &this_cpu_data()->memguard;
+	u64 reg;
 
-	u32 reg32;
+	if (!memguard_supported(this_cpu_id()))
+		return;
 
-	memguard_pmu_count_disable();
+	mg_print("memguard_exit\n");
+
+	memguard_pmu_count_disable(MG_RESERVED_MASK(memguard));
 	memguard_timer_disable();
 
-	memguard_pmu_irq_disable(this_cpu_id());
+	memguard_pmu_irq_disable(this_cpu_id(), MG_RESERVED_MASK(memguard));
 	memguard_timer_irq_disable();
+	memguard_revoke_donations(memguard);
 
-	/* Make the memguard counter visible again to non-secure mode */
-	arm_read_sysreg(MDCR_EL2, reg32);
-	reg32 &= ~(MDCR_EL2_HPMN_MASK);
-	reg32 |= MDCR_EL2_HPME + PMU_INDEX - 1;
-	arm_write_sysreg(MDCR_EL2, reg32);
+	/* Make the memguard counters visible again to non-secure mode */
+	arm_read_sysreg(MDCR_EL2, reg);
+	reg &= ~(MDCR_EL2_HPMN_MASK | MDCR_EL2_HPME);
+	reg |= memguard_pmu_num_counters();
+	arm_write_sysreg(MDCR_EL2, reg);
 }
 
 static inline void memguard_mask_interrupts(void)
 {
-	mmio_write32(gicc_base + GICC_PMR, IRQ_PRIORITY_THR);
+	irqchip_set_priority_mask(IRQ_PRIORITY_THR);
 }
 
 static inline void memguard_unmask_interrupts(void)
 {
-	mmio_write32(gicc_base + GICC_PMR, IRQ_PRIORITY_MIN);
+	irqchip_set_priority_mask(IRQ_PRIORITY_MIN);
+}
+
+static int memguard_set_burst(struct memguard *memguard, unsigned int i,
+			      unsigned long burst)
+{
+	if (burst > UINT32_MAX)
+		return -EINVAL;
+
+	memguard->counters[i].burst = MAX(burst, memguard->counters[i].budget);
+	return 0;
+}
+
+static int memguard_adapt_init(struct memguard *memguard,
+			       const struct memguard_params *params)
+{
+	unsigned int i;
+
+	if (params->adapt_min == 0 || params->adapt_min > params->adapt_max ||
+	    params->adapt_max > UINT32_MAX)
+		return -EINVAL;
+
+	memguard->adapt_min = params->adapt_min;
+	memguard->adapt_max = params->adapt_max;
+	memguard->adapt_scale = MIN(MAX(MG_ADAPT_NOMINAL, params->adapt_min),
+				    params->adapt_max);
+	/* Only reports issued from now on are relevant */
+	memguard->slack_seq = memguard_slack_report >> 32;
+
+	memguard_adapt_apply(memguard);
+	for (i = 0; i < MG_NUM_COUNTERS; i++)
+		memguard->counters[i].granted = memguard->counters[i].budget;
+
+	return 0;
+}
+
+/* Load the per-counter budgets requested by the caller */
+static int memguard_set_counters(struct memguard *memguard,
+				 const struct memguard_params *params)
+{
+	unsigned int i;
+
+	memset(memguard->counters, 0, sizeof(memguard->counters));
+	memguard->counter_mask = 0;
+
+	if (params->num_events == 0) {
+		/* Legacy interface: L2 refills against budget_memory */
+		if (params->budget_memory > UINT32_MAX)
+			return -EINVAL;
+
+		memguard->counters[0].event = MG_DEFAULT_EVENT;
+		memguard->counters[0].budget = params->budget_memory;
+		memguard->counters[0].nominal = params->budget_memory;
+		memguard->counters[0].granted = params->budget_memory;
+		if (params->budget_memory > 0)
+			memguard->counter_mask = 1 << MG_COUNTER(memguard, 0);
+		return memguard_set_burst(memguard, 0, params->event_burst[0]);
+	}
+
+	if (params->num_events > MG_NUM_COUNTERS)
+		return -EINVAL;
+
+	for (i = 0; i < params->num_events; i++) {
+		if (params->event_type[i] > PMEVTYPER_EVTCOUNT_MASK ||
+		    params->event_budget[i] > UINT32_MAX)
+			return -EINVAL;
+
+		memguard->counters[i].event = params->event_type[i];
+		memguard->counters[i].budget = params->event_budget[i];
+		memguard->counters[i].nominal = params->event_budget[i];
+		memguard->counters[i].granted = params->event_budget[i];
+		if (params->event_budget[i] > 0)
+			memguard->counter_mask |= 1 << MG_COUNTER(memguard, i);
+		if (memguard_set_burst(memguard, i, params->event_burst[i]))
+			return -EINVAL;
+	}
+
+	return 0;
 }
 
 /**
  * Syscall called on PREM phases borders
  *
- * budget_time - time in us
- * budget_memory - the number of PMU events (i.e. cache misses)
- * flags - see MGF_*
+ * params->budget_time - time in us
+ * params->budget_memory - the number of PMU events (i.e. cache misses)
+ * params->flags - see MGF_*
+ * params->event_* - optional per-counter budgets
  *
  * Returns profiling data for the last phase.
  */
-long memguard_call(unsigned long budget_time, unsigned long budget_memory,
-		   unsigned long flags)
+long memguard_call(struct memguard_params *params)
 {
 	u64 retval = 0;
-	u32 freq;
+	u32 freq, used;
+	unsigned int i;
 	
 	struct per_cpu *cpu_data = this_cpu_data();
 	struct memguard *memguard = &cpu_data->memguard;
+
+	if (!memguard_supported(this_cpu_id()))
+		return MGRET_ERROR_MASK;
 	
 	/* Prevent race conditions with timer and PMU IRQ handlers */
-	memguard_pmu_count_disable();
+	memguard_pmu_count_disable(MG_RESERVED_MASK(memguard));
 	memguard_timer_disable();
 
-	mg_print("memguard_call %lu %lu %lx (CPU %d)\n",
-	       budget_time, budget_memory, flags, this_cpu_id());
+	mg_print("memguard_call %lu %lu %lx (%lu events) (CPU %d)\n",
+		 params->budget_time, params->budget_memory, params->flags,
+		 params->num_events, this_cpu_id());
 	
 	/* Store statistics since last call for profiling */
 	u64 timval = memguard_timer_count();
-	u32 cntval = memguard_pmu_count();
 
 	arm_read_sysreg(CNTFRQ_EL0, freq);
 
-	u64 pmu_evt_cnt = memguard->pmu_evt_cnt + memguard->budget_memory + 1 + cntval;
+	memguard_revoke_donations(memguard);
+	for (i = 0; i < MG_NUM_COUNTERS; i++) {
+		used = memguard_pmu_consumed(memguard, i);
+		memguard->counters[i].evt_cnt += used;
+		if (i < MAX(params->num_events, 1)) {
+			params->event_tokens[i] =
+				used < memguard->counters[i].granted ?
+				memguard->counters[i].granted - used : 0;
+			params->event_count[i] = memguard->counters[i].evt_cnt;
+			params->event_donated[i] =
+				memguard->counters[i].donated_total;
+			params->event_reclaimed[i] =
+				memguard->counters[i].reclaimed_total;
+		}
+	}
+
+	u64 pmu_evt_cnt = memguard->counters[0].evt_cnt;
 	u64 time_us = (timval - memguard->start_time) * 1000000 / freq;
 	retval = (memguard->time_overrun ? MGRET_OVER_TIM_MASK : 0ul) |
 		 (memguard->memory_overrun ? MGRET_OVER_MEM_MASK : 0ul) |
@@ -659,34 +1067,64 @@ long memguard_call(unsigned long budget_time, unsigned long budget_memory,
 		 (time_us <= MGRET_TIM_MASK >> MGRET_TIM_POS ?
 			  time_us << MGRET_TIM_POS :
 			  MGRET_TIM_MASK);
+
+	params->stats.elapsed_ns =
+		memguard_ticks_to_ns(timval - memguard->start_time, freq);
+	params->stats.throttle_count = memguard->throttle_count;
+	params->stats.blocked_ns =
+		memguard_ticks_to_ns(memguard->blocked_total, freq);
+	params->stats.max_blocked_ns =
+		memguard_ticks_to_ns(memguard->blocked_max, freq);
+	params->stats.overrun =
+		retval & (MGRET_OVER_TIM_MASK | MGRET_OVER_MEM_MASK);
+	params->stats.budget_scale = memguard->flags & MGF_ADAPTIVE ?
+		memguard->adapt_scale : MG_ADAPT_NOMINAL;
 	
 	/* Setup memguard according to this call parameters */
 	memguard->time_overrun = false;
 	memguard->memory_overrun = false;
+	memguard->throttled = false;
+	memguard->blocked_time = 0;
+	memguard->throttle_count = 0;
+	memguard->blocked_total = 0;
+	memguard->blocked_max = 0;
 	memguard->block = 0;
-	memguard->flags = (flags & MGF_PERIODIC) ? MGF_PERIODIC : 0;
-	if (flags & MGF_PERIODIC && budget_time == 0)
+	memguard->start_time = timval;
+	memguard->flags = (params->flags & MGF_PERIODIC) ?
+		params->flags & (MGF_PERIODIC | MGF_RECLAIM | MGF_SYNC |
+				 MGF_BUCKET | MGF_ADAPTIVE) : 0;
+	if ((memguard->flags & (MGF_RECLAIM | MGF_BUCKET)) ==
+	    (MGF_RECLAIM | MGF_BUCKET))
+		return retval | MGRET_ERROR_MASK;
+	if (memguard_set_counters(memguard, params))
+		return retval | MGRET_ERROR_MASK;
+	if (memguard->flags & MGF_ADAPTIVE &&
+	    memguard_adapt_init(memguard, params))
+		return retval | MGRET_ERROR_MASK;
+	if (params->flags & MGF_PERIODIC && params->budget_time == 0)
 		return retval | MGRET_ERROR_MASK;
 
-	if (flags & MGF_MASK_INT)
+	if (params->flags & MGF_MASK_INT)
 		memguard_mask_interrupts();
 	else
 		memguard_unmask_interrupts();
 
-	memguard->pmu_evt_cnt = 0;
-	memguard->budget_memory = budget_memory;
-	if (budget_memory > 0)
-		memguard_pmu_set_budget(budget_memory);
-
-	if (budget_time > 0) {
-		memguard->start_time = memguard->last_time = timval;
-		memguard->budget_time = ((u64)budget_time * freq + 999999) / 1000000;
+	if (params->budget_time > 0) {
+		memguard->last_time = timval;
+		memguard->budget_time = ((u64)params->budget_time * freq +
+					 999999) / 1000000;
+		if (memguard->flags & MGF_SYNC) {
+			memguard->last_time = timval - timval % memguard->budget_time;
+			memguard_sync_prorate(memguard, timval);
+		}
 		memguard_timer_set_cmpval(memguard->last_time + memguard->budget_time);
 	}
 
-	if (budget_memory > 0)
-		memguard_pmu_count_enable(); /* Keep this before memguard_timer_enable() */
-	if (budget_time > 0)
+	memguard_pmu_set_budget(memguard);
+
+	/* Keep this before memguard_timer_enable() */
+	memguard_pmu_count_enable(memguard->counter_mask);
+	if (params->budget_time > 0)
 		memguard_timer_enable();
 
 	return retval;
@@ -700,12 +1138,17 @@ long memguard_call_params(unsigned long params_ptr)
 	void *params_mapping;
 	
 	/* The settings currently reside in kernel memory. Use
-	 * temporary mapping to make the settings readable by the
-	 * hypervisor. No need to clean up the mapping because this is
-	 * only temporary by design. */
+	 * temporary mapping to make the settings accessible by the
+	 * hypervisor. The mapping is writable so that per-counter
+	 * statistics can be reported back. No need to clean up the
+	 * mapping because this is only temporary by design. */
+	if (!arm_cell_mem_writable(this_cell(), params_ptr,
+				   sizeof(struct memguard_params)))
+		return -EINVAL;
+
 	params_pages = PAGES(params_page_offs + sizeof(struct memguard_params));
 	params_mapping = paging_get_guest_pages(NULL, params_ptr, params_pages,
-					     PAGE_READONLY_FLAGS);
+					     PAGE_DEFAULT_FLAGS);
 
 	/* This should never happen. */
 	if (!params_mapping)
@@ -714,5 +1157,92 @@ long memguard_call_params(unsigned long params_ptr)
 	struct memguard_params * params = (struct memguard_params *)
 		(params_mapping + params_page_offs);
 
-	return memguard_call(params->budget_time, params->budget_memory, params->flags);
+	return memguard_call(params);
+}
+
+/* Look up the MemGuard descriptor of a CPU in a cell configuration */
+static const struct jailhouse_memguard *
+memguard_cell_desc(const struct jailhouse_cell_desc *config, unsigned int cpu)
+{
+	const struct jailhouse_memguard *mg = jailhouse_cell_memguard(config);
+	unsigned int n;
+
+	for (n = 0; n < config->num_memguard; n++, mg++)
+		if (mg->cpu == cpu)
+			return mg;
+
+	return NULL;
+}
+
+int memguard_cell_init(struct cell *cell)
+{
+	const struct jailhouse_memguard *mg =
+		jailhouse_cell_memguard(cell->config);
+	unsigned int n;
+
+	for (n = 0; n < cell->config->num_memguard; n++, mg++) {
+		if (!cell_owns_cpu(cell, mg->cpu) ||
+		    memguard_cell_desc(cell->config, mg->cpu) != mg)
+			return trace_error(-EINVAL);
+		if (!memguard_supported(mg->cpu))
+			return trace_error(-ENODEV);
+		if (mg->flags & MGF_PERIODIC && mg->budget_time == 0)
+			return trace_error(-EINVAL);
+		if (mg->event > PMEVTYPER_EVTCOUNT_MASK ||
+		    mg->budget_memory > UINT32_MAX)
+			return trace_error(-EINVAL);
+	}
+
+	return 0;
+}
+
+void memguard_cpu_reset(struct cell *cell)
+{
+	const struct jailhouse_memguard *mg =
+		memguard_cell_desc(cell->config, this_cpu_id());
+	struct memguard_params params;
+
+	if (!mg)
+		return;
+
+	memset(&params, 0, sizeof(params));
+	params.budget_time = mg->budget_time;
+	params.flags = mg->flags;
+	if (mg->event) {
+		params.num_events = 1;
+		params.event_type[0] = mg->event;
+		params.event_budget[0] = mg->budget_memory;
+	} else {
+		params.budget_memory = mg->budget_memory;
+	}
+
+	if (memguard_call(&params) & MGRET_ERROR_MASK)
+		printk("WARNING: invalid MemGuard budget for CPU %d\n",
+		       this_cpu_id());
+}
+
+bool memguard_cell_periodic(struct cell *cell)
+{
+	unsigned int cpu;
+
+	for_each_cpu(cpu, cell->cpu_set)
+		if (per_cpu(cpu)->memguard.flags & MGF_PERIODIC)
+			return true;
+
+	return false;
+}
+
+long memguard_report_slack(unsigned long slack)
+{
+	long value = (long)slack;
+	u64 report = memguard_slack_report;
+
+	if (value < MEMGUARD_SLACK_MIN || value > MEMGUARD_SLACK_MAX)
+		return -EINVAL;
+
+	/* Concurrent reports may share a sequence number, the last one
+	 * wins */
+	memguard_slack_report = ((report >> 32) + 1) << 32 | (u32)value;
+
+	return 0;
 }
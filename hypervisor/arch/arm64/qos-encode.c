@@ -0,0 +1,422 @@
+/*
+ * ARM QoS Support for Jailhouse, register encoding
+ *
+ * Copyright (c) Boston University, 2020
+ *
+ * Authors:
+ *  Renato Mancuso <rmancuso@bu.edu>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <jailhouse/entry.h>
+#include <jailhouse/string.h>
+#include <asm/qos-encode.h>
+
+/* Bit fields and masks in control registers  */
+#define READ_QOS_SHIFT      (0)
+#define READ_QOS_MASK       (0x0f)
+#define WRITE_QOS_SHIFT     (0)
+#define WRITE_QOS_MASK      (0x0f)
+
+#define AW_MAX_OTF_SHIFT    (0)
+#define AW_MAX_OTI_SHIFT    (8)
+#define AR_MAX_OTF_SHIFT    (16)
+#define AR_MAX_OTI_SHIFT    (24)
+#define AW_MAX_OTF_MASK     (0xff)
+#define AW_MAX_OTI_MASK     (0x3f)
+#define AR_MAX_OTF_MASK     (0xff)
+#define AR_MAX_OTI_MASK     (0x3f)
+
+#define AWAR_MAX_OTF_SHIFT  (0)
+#define AWAR_MAX_OTI_SHIFT  (8)
+#define AWAR_MAX_OTF_MASK   (0xff)
+#define AWAR_MAX_OTI_MASK   (0x7f)
+
+#define AW_P_SHIFT          (24)
+#define AW_B_SHIFT          (0)
+#define AW_R_SHIFT          (20)
+#define AW_P_MASK           (0xff)
+#define AW_B_MASK           (0xffff)
+#define AW_R_MASK           (0xfff)
+	
+#define AR_P_SHIFT          (24)
+#define AR_B_SHIFT          (0)
+#define AR_R_SHIFT          (20)
+#define AR_P_MASK           (0xff)
+#define AR_B_MASK           (0xffff)
+#define AR_R_MASK           (0xfff)
+
+#define AR_TGT_LAT_SHIFT    (16)
+#define AW_TGT_LAT_SHIFT    (0)
+#define AR_TGT_LAT_MASK     (0xfff)
+#define AW_TGT_LAT_MASK     (0xfff)
+
+#define AR_KI_SHIFT         (8)
+#define AW_KI_SHIFT         (0)
+#define AR_KI_MASK          (0x7)
+#define AW_KI_MASK          (0x7)
+
+#define AR_MAX_QOS_SHIFT    (24)
+#define AR_MIN_QOS_SHIFT    (16)
+#define AW_MAX_QOS_SHIFT    (8)
+#define AW_MIN_QOS_SHIFT    (0)
+#define AR_MAX_QOS_MASK     (0xf)
+#define AR_MIN_QOS_MASK     (0xf)
+#define AW_MAX_QOS_MASK     (0xf)
+#define AW_MIN_QOS_MASK     (0xf)
+
+const struct qos_param qos_params[QOS_PARAMS] = {
+	{
+		.name = "read_qos",
+		.reg = READ_QOS,
+		.enable = EN_NO_ENABLE,
+		.shift = READ_QOS_SHIFT,
+		.mask = READ_QOS_MASK,
+	},
+	{
+		.name = "write_qos",
+		.reg = WRITE_QOS,
+		.enable = EN_NO_ENABLE,
+		.shift = WRITE_QOS_SHIFT,
+		.mask = WRITE_QOS_MASK,
+	},
+	{
+		.name = "aw_max_otf",
+		.reg = MAX_OT,
+		.enable = EN_AW_OT_SHIFT,
+		.shift = AW_MAX_OTF_SHIFT,
+		.mask = AW_MAX_OTF_MASK,
+	},
+	{
+		.name = "aw_max_oti",
+		.reg = MAX_OT,
+		.enable = EN_AW_OT_SHIFT,
+		.shift = AW_MAX_OTI_SHIFT,
+		.mask = AW_MAX_OTI_MASK,
+	},
+	{
+		.name = "ar_max_otf",
+		.reg = MAX_OT,
+		.enable = EN_AR_OT_SHIFT,
+		.shift = AR_MAX_OTF_SHIFT,
+		.mask = AR_MAX_OTF_MASK,
+	},
+	{
+		.name = "ar_max_oti",
+		.reg = MAX_OT,
+		.enable = EN_AR_OT_SHIFT,
+		.shift = AR_MAX_OTI_SHIFT,
+		.mask = AR_MAX_OTI_MASK,
+	},	
+	{
+		.name = "awar_max_otf",
+		.reg = MAX_COMB_OT,
+		.enable = EN_AWAR_OT_SHIFT,
+		.shift = AWAR_MAX_OTF_SHIFT,
+		.mask = AWAR_MAX_OTF_MASK,
+	},
+	{
+		.name = "awar_max_oti",
+		.reg = MAX_COMB_OT,
+		.enable = EN_AWAR_OT_SHIFT,
+		.shift = AWAR_MAX_OTI_SHIFT,
+		.mask = AWAR_MAX_OTI_MASK,
+	},
+	{
+		.name = "aw_p",
+		.reg = AW_P,
+		.enable = EN_AW_RATE_SHIFT,
+		.shift = AW_P_SHIFT,
+		.mask = AW_P_MASK,
+	},
+	{
+		.name = "aw_b",
+		.reg = AW_B,
+		.enable = EN_AW_RATE_SHIFT,
+		.shift = AW_B_SHIFT,
+		.mask = AW_B_MASK,
+	},
+	{
+		.name = "aw_r",
+		.reg = AW_R,
+		.enable = EN_AW_RATE_SHIFT,
+		.shift = AW_R_SHIFT,
+		.mask = AW_R_MASK,
+	},
+	{
+		.name = "ar_p",
+		.reg = AR_P,
+		.enable = EN_AR_RATE_SHIFT,
+		.shift = AR_P_SHIFT,
+		.mask = AR_P_MASK,
+	},
+	{
+		.name = "ar_b",
+		.reg = AR_B,
+		.enable = EN_AR_RATE_SHIFT,
+		.shift = AR_B_SHIFT,
+		.mask = AR_B_MASK,
+	},
+	{
+		.name = "ar_r",
+		.reg = AR_R,
+		.enable = EN_AR_RATE_SHIFT,
+		.shift = AR_R_SHIFT,
+		.mask = AR_R_MASK,
+	},
+	{
+		.name = "ar_tgt_latency",
+		.reg = TGT_LATENCY,
+		.enable = EN_AR_LATENCY_SHIFT,
+		.shift = AR_TGT_LAT_SHIFT,
+		.mask = AR_TGT_LAT_MASK,
+	},
+	{
+		.name = "aw_tgt_latency",
+		.reg = TGT_LATENCY,
+		.enable = EN_AW_LATENCY_SHIFT,
+		.shift = AW_TGT_LAT_SHIFT,
+		.mask = AW_TGT_LAT_MASK,
+	},
+	{
+		.name = "ar_ki",
+		.reg = KI,
+		.enable = EN_AR_LATENCY_SHIFT,
+		.shift = AR_KI_SHIFT,
+		.mask = AR_KI_MASK,
+	},
+	{
+		.name = "aw_ki",
+		.reg = KI,
+		.enable = EN_AW_LATENCY_SHIFT,
+		.shift = AW_KI_SHIFT,
+		.mask = AW_KI_MASK,
+	},
+	{
+		.name = "ar_max_qos",
+		.reg = QOS_RANGE,
+		.enable = EN_AW_LATENCY_SHIFT,
+		.shift = AR_MAX_QOS_SHIFT,
+		.mask = AR_MAX_QOS_MASK,
+	},
+	{
+		.name = "ar_min_qos",
+		.reg = QOS_RANGE,
+		.enable = EN_AW_LATENCY_SHIFT,
+		.shift = AR_MIN_QOS_SHIFT,
+		.mask = AR_MIN_QOS_MASK,
+	},
+	{
+		.name = "aw_max_qos",
+		.reg = QOS_RANGE,
+		.enable = EN_AW_LATENCY_SHIFT,
+		.shift = AW_MAX_QOS_SHIFT,
+		.mask = AW_MAX_QOS_MASK,
+	},
+	{
+		.name = "aw_min_qos",
+		.reg = QOS_RANGE,
+		.enable = EN_AW_LATENCY_SHIFT,
+		.shift = AW_MIN_QOS_SHIFT,
+		.mask = AW_MIN_QOS_MASK,
+	},
+	
+};
+
+void qos_compiler_init(struct qos_compiler * c,
+		       const struct qos_backend * backend,
+		       struct qos_op * ops, unsigned int max_ops)
+{
+	memset(c, 0, sizeof(*c));
+	c->backend = backend;
+	c->ops = ops;
+	c->max_ops = max_ops;
+}
+
+const struct qos_device * qos_dev_find_by_name(const struct qos_backend * backend,
+					       const char * name)
+{
+	unsigned int i;
+	for (i = 0; i < backend->num_devices; ++i)
+		if(strncmp(name, backend->devices[i].name,
+			   QOS_DEV_NAMELEN) == 0)
+			return &backend->devices[i];
+
+	return NULL;
+}
+
+const struct qos_param * qos_param_find_by_name(const char * name)
+{
+	int i;
+	for (i = 0; i < QOS_PARAMS; ++i)
+		if(strncmp(name, qos_params[i].name, QOS_PARAM_NAMELEN) == 0)
+			return &qos_params[i];
+
+	return NULL;
+}
+
+bool qos_dev_has_reg(const struct qos_device * dev, __u32 reg)
+{
+	__u8 flags;
+
+	if (reg <= FN_MOD)
+		flags = FLAGS_HAS_RWQOS;
+	else if (reg == QOS_CNTL)
+		flags = FLAGS_HAS_REGUL | FLAGS_HAS_DYNQOS;
+	else if (reg < TGT_LATENCY)
+		flags = FLAGS_HAS_REGUL;
+	else if (reg <= QOS_RANGE)
+		flags = FLAGS_HAS_DYNQOS;
+	else
+		flags = 0;
+
+	return (dev->flags & flags) != 0;
+}
+
+/* Add a register write to the compiled configuration. Writes to the same
+ * register are merged into a single one, later values taking precedence. */
+static int qos_compile_op(struct qos_compiler * c, __u32 offset,
+			  __u32 mask, __u32 value)
+{
+	struct qos_op * ops = c->ops;
+	unsigned int i;
+
+	for (i = 0; i < c->num; ++i)
+		if (ops[i].offset == offset) {
+			ops[i].mask |= mask;
+			ops[i].value = (ops[i].value & ~mask) | value;
+			return 0;
+		}
+
+	if (c->num >= c->max_ops)
+		return -E2BIG;
+
+	ops[c->num].offset = offset;
+	ops[c->num].mask = mask;
+	ops[c->num].value = value;
+	c->num++;
+
+	return 0;
+}
+
+int qos_compile_param(struct qos_compiler * c,
+		      const struct qos_param * param, __u32 value)
+{
+	unsigned int dev;
+
+	/* Check that this device implements this QoS interface */
+	if (!qos_dev_has_reg(c->dev, param->reg))
+		return -ENOSYS;
+
+	dev = c->dev - c->backend->devices;
+	c->enable[dev] |= 1 << param->enable;
+	c->devices |= 1UL << dev;
+
+	return qos_compile_op(c, c->dev->base + param->reg,
+			      param->mask << param->shift,
+			      (value & param->mask) << param->shift);
+}
+
+int qos_compile_setting(struct qos_compiler * c, const char * dev_name,
+			const char * param_name, __u32 value)
+{
+	const struct qos_param * param;
+
+	if (dev_name[0])
+		c->dev = qos_dev_find_by_name(c->backend, dev_name);
+
+	/* At this point, the device should not be NULL */
+	if (!c->dev)
+		return -ENODEV;
+
+	param = qos_param_find_by_name(param_name);
+	if (!param)
+		return -EINVAL;
+
+	return qos_compile_param(c, param, value);
+}
+
+int qos_compile_finish(struct qos_compiler * c)
+{
+	const struct qos_device * devices = c->backend->devices;
+	unsigned int dev;
+	int err;
+
+	for (dev = 0; dev < c->backend->num_devices; ++dev) {
+		if (!(c->devices & (1UL << dev)) ||
+		    !qos_dev_has_reg(&devices[dev], QOS_CNTL))
+			continue;
+
+		/* Mask away the no-enable bit */
+		err = qos_compile_op(c, devices[dev].base + QOS_CNTL,
+				     ~0U,
+				     c->enable[dev] & ~(1 << EN_NO_ENABLE));
+		if (err)
+			return err;
+	}
+
+	return c->num;
+}
+
+int qos_compile(struct qos_compiler * c, const struct qos_setting * settings,
+		unsigned long count)
+{
+	unsigned long i;
+	int err;
+
+	/* Check if the user has requestes QoS control to be disabled */
+	if (count > 0 && strncmp("disable", settings[0].dev_name, 8) == 0) {
+		/* Clear the QOS_CNTL register for all the devices */
+		c->devices = (1UL << c->backend->num_devices) - 1;
+		return qos_compile_finish(c);
+	}
+
+	for (i = 0; i < count; ++i) {
+		err = qos_compile_setting(c, settings[i].dev_name,
+					  settings[i].param_name,
+					  settings[i].value);
+		if (err)
+			return err;
+	}
+
+	return qos_compile_finish(c);
+}
+
+bool qos_op_valid(const struct qos_backend * backend, const struct qos_op * op)
+{
+	const struct qos_device * dev;
+	unsigned int i;
+
+	if (op->offset & 0x3)
+		return false;
+
+	for (i = 0; i < backend->num_devices; ++i) {
+		dev = &backend->devices[i];
+		if (op->offset >= dev->base &&
+		    op->offset <= dev->base + QOS_RANGE)
+			return qos_dev_has_reg(dev, op->offset - dev->base);
+	}
+
+	return false;
+}
+
+void qos_apply_ops(const struct qos_backend * backend,
+		   const struct qos_op * ops, unsigned int count)
+{
+	unsigned int i;
+	__u32 regval;
+
+	for (i = 0; i < count; ++i) {
+		if (ops[i].mask == ~0U) {
+			backend->write32(ops[i].offset, ops[i].value);
+			continue;
+		}
+
+		regval = backend->read32(ops[i].offset);
+		regval &= ~ops[i].mask;
+		regval |= ops[i].value & ops[i].mask;
+		backend->write32(ops[i].offset, regval);
+	}
+}
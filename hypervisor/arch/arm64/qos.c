@@ -17,493 +17,638 @@
 #include <jailhouse/paging.h>
 #include <jailhouse/qos-common.h>
 #include <asm/paging.h>
+#include <jailhouse/control.h>
+#include <jailhouse/unit.h>
+#include <asm/spinlock.h>
 
+#include <asm/memguard.h>
 #include <asm/qos.h>
+#include <asm/qos-encode.h>
 
 #define qos_print(fmt, ...)			\
 	printk("[QoS] " fmt, ##__VA_ARGS__)
 
-struct qos_device {
-	char name [QOS_DEV_NAMELEN];
-	__u8 flags;
-	__u32 base;
-};
+/* Generic backend for interconnects that are memory-mapped at EL2 */
+static void * qos_mmio_base;
 
-struct qos_param {
-	char name [QOS_PARAM_NAMELEN];
-	__u16 reg;
-	__u8 enable;
-	__u8 shift;
-	__u32 mask;
-};
+static inline int qos_mmio_init(unsigned long base, unsigned long size)
+{
+	qos_mmio_base = paging_map_device(base, size);
 
-/* Apply all the setting provided in the array of settings passed as a
- * paramter */
-static int qos_apply_settings(struct qos_setting * settings, int count);
-
-/* Clear the QOS_CNTL register for all the devices */
-static int qos_disable_all(void);
-
-/* This function sets a given parameter to the desired value. It does
- * not enable the corresponding interface */
-static int qos_set_param (const struct qos_device * dev, const struct qos_param * param,
-		   unsigned long value);
-
-/* Once we are done setting all the parameters, enable all the affected interfaces */
-static void qos_set_enable(const struct qos_device * dev, __u32 value);
-
-/* This function returns 1 if the selected device supports setting the
- * considered parameter */
-static int qos_dev_is_capable(const struct qos_device * dev, const struct qos_param * param);
-
-
-/* Board-independent QoS support */
-#define FLAGS_HAS_RWQOS    (1 << 0)
-#define FLAGS_HAS_REGUL    (1 << 1)
-#define FLAGS_HAS_DYNQOS   (1 << 2)
-
-/* Offsets of control registers from beginning of device-specific
- * config space */
-
-/* The typical QoS interface has the following layout:
- * 
- * BASE: 0x??80
- * read_qos    = BASE
- * write_qos   = + 0x04
- * fn_mod      = + 0x08
------ REGULATION ------
- * qos_cntl    = + 0x0C
- * max_ot      = + 0x10
- * max_comb_ot = + 0x14
- * aw_p        = + 0x18
- * aw_b        = + 0x1C
- * aw_r        = + 0x20
- * ar_p        = + 0x24
- * ar_b        = + 0x28
- * ar_r        = + 0x2C
------ DYNAMIC QOS -----
- * tgt_latency = + 0x30
- * ki          = + 0x34
- * qos_range   = + 0x38
- */
+	return qos_mmio_base ? 0 : -ENOMEM;
+}
 
-#define READ_QOS           0x00
-#define WRITE_QOS          0x04
-#define FN_MOD             0x08
-#define QOS_CNTL           0x0C
-#define MAX_OT             0x10
-#define MAX_COMB_OT        0x14
-#define AW_P               0x18
-#define AW_B               0x1C
-#define AW_R               0x20
-#define AR_P               0x24
-#define AR_B               0x28
-#define AR_R               0x2C
-#define TGT_LATENCY        0x30
-#define KI                 0x34
-#define QOS_RANGE          0x38
-
-/* QOS_CNTL REgister  */
-#define EN_AWAR_OT_SHIFT    (7)
-#define EN_AR_OT_SHIFT      (6)
-#define EN_AW_OT_SHIFT      (5)
-#define EN_AR_LATENCY_SHIFT (4)
-#define EN_AW_LATENCY_SHIFT (3)
-#define EN_AWAR_RATE_SHIFT  (2)
-#define EN_AR_RATE_SHIFT    (1)
-#define EN_AW_RATE_SHIFT    (0)
-#define EN_NO_ENABLE        (31)
-
-/* Number of settable QoS parameters */
-#define QOS_PARAMS          22
-
-/* Bit fields and masks in control registers  */
-#define READ_QOS_SHIFT      (0)
-#define READ_QOS_MASK       (0x0f)
-#define WRITE_QOS_SHIFT     (0)
-#define WRITE_QOS_MASK      (0x0f)
-
-#define AW_MAX_OTF_SHIFT    (0)
-#define AW_MAX_OTI_SHIFT    (8)
-#define AR_MAX_OTF_SHIFT    (16)
-#define AR_MAX_OTI_SHIFT    (24)
-#define AW_MAX_OTF_MASK     (0xff)
-#define AW_MAX_OTI_MASK     (0x3f)
-#define AR_MAX_OTF_MASK     (0xff)
-#define AR_MAX_OTI_MASK     (0x3f)
-
-#define AWAR_MAX_OTF_SHIFT  (0)
-#define AWAR_MAX_OTI_SHIFT  (8)
-#define AWAR_MAX_OTF_MASK   (0xff)
-#define AWAR_MAX_OTI_MASK   (0x7f)
-
-#define AW_P_SHIFT          (24)
-#define AW_B_SHIFT          (0)
-#define AW_R_SHIFT          (20)
-#define AW_P_MASK           (0xff)
-#define AW_B_MASK           (0xffff)
-#define AW_R_MASK           (0xfff)
-	
-#define AR_P_SHIFT          (24)
-#define AR_B_SHIFT          (0)
-#define AR_R_SHIFT          (20)
-#define AR_P_MASK           (0xff)
-#define AR_B_MASK           (0xffff)
-#define AR_R_MASK           (0xfff)
-
-#define AR_TGT_LAT_SHIFT    (16)
-#define AW_TGT_LAT_SHIFT    (0)
-#define AR_TGT_LAT_MASK     (0xfff)
-#define AW_TGT_LAT_MASK     (0xfff)
-
-#define AR_KI_SHIFT         (8)
-#define AW_KI_SHIFT         (0)
-#define AR_KI_MASK          (0x7)
-#define AW_KI_MASK          (0x7)
-
-#define AR_MAX_QOS_SHIFT    (24)
-#define AR_MIN_QOS_SHIFT    (16)
-#define AW_MAX_QOS_SHIFT    (8)
-#define AW_MIN_QOS_SHIFT    (0)
-#define AR_MAX_QOS_MASK     (0xf)
-#define AR_MIN_QOS_MASK     (0xf)
-#define AW_MAX_QOS_MASK     (0xf)
-#define AW_MIN_QOS_MASK     (0xf)
-
-/* Return the address of the configuration register to be used to set
- * the desired paramter for the selected device */
-#define QOS_PAR(dev, param)						\
-	((void *)(nic_base + (__u64)dev->base + (__u64)param->reg))
-
-#define QOS_REG(dev, reg)					\
-	((void *)(nic_base + (__u64)dev->base + (__u64)reg))
-
-/* Mapped NIC device */
-static void * nic_base = NULL;
+static inline __u32 qos_mmio_read32(__u32 offset)
+{
+	return mmio_read32(qos_mmio_base + offset);
+}
+
+static inline void qos_mmio_write32(__u32 offset, __u32 value)
+{
+	mmio_write32(qos_mmio_base + offset, value);
+}
 
 #include <asm/qos-plat.h>
 
-static const struct qos_param params [QOS_PARAMS] = {
-	{
-		.name = "read_qos",
-		.reg = READ_QOS,
-		.enable = EN_NO_ENABLE,
-		.shift = READ_QOS_SHIFT,
-		.mask = READ_QOS_MASK,
-	},
-	{
-		.name = "write_qos",
-		.reg = WRITE_QOS,
-		.enable = EN_NO_ENABLE,
-		.shift = WRITE_QOS_SHIFT,
-		.mask = WRITE_QOS_MASK,
-	},
-	{
-		.name = "aw_max_otf",
-		.reg = MAX_OT,
-		.enable = EN_AW_OT_SHIFT,
-		.shift = AW_MAX_OTF_SHIFT,
-		.mask = AW_MAX_OTF_MASK,
-	},
-	{
-		.name = "aw_max_oti",
-		.reg = MAX_OT,
-		.enable = EN_AW_OT_SHIFT,
-		.shift = AW_MAX_OTI_SHIFT,
-		.mask = AW_MAX_OTI_MASK,
-	},
-	{
-		.name = "ar_max_otf",
-		.reg = MAX_OT,
-		.enable = EN_AR_OT_SHIFT,
-		.shift = AR_MAX_OTF_SHIFT,
-		.mask = AR_MAX_OTF_MASK,
-	},
-	{
-		.name = "ar_max_oti",
-		.reg = MAX_OT,
-		.enable = EN_AR_OT_SHIFT,
-		.shift = AR_MAX_OTI_SHIFT,
-		.mask = AR_MAX_OTI_MASK,
-	},	
-	{
-		.name = "awar_max_otf",
-		.reg = MAX_COMB_OT,
-		.enable = EN_AWAR_OT_SHIFT,
-		.shift = AWAR_MAX_OTF_SHIFT,
-		.mask = AWAR_MAX_OTF_MASK,
-	},
-	{
-		.name = "awar_max_oti",
-		.reg = MAX_COMB_OT,
-		.enable = EN_AWAR_OT_SHIFT,
-		.shift = AWAR_MAX_OTI_SHIFT,
-		.mask = AWAR_MAX_OTI_MASK,
-	},
-	{
-		.name = "aw_p",
-		.reg = AW_P,
-		.enable = EN_AW_RATE_SHIFT,
-		.shift = AW_P_SHIFT,
-		.mask = AW_P_MASK,
-	},
-	{
-		.name = "aw_b",
-		.reg = AW_B,
-		.enable = EN_AW_RATE_SHIFT,
-		.shift = AW_B_SHIFT,
-		.mask = AW_B_MASK,
-	},
-	{
-		.name = "aw_r",
-		.reg = AW_R,
-		.enable = EN_AW_RATE_SHIFT,
-		.shift = AW_R_SHIFT,
-		.mask = AW_R_MASK,
-	},
-	{
-		.name = "ar_p",
-		.reg = AR_P,
-		.enable = EN_AR_RATE_SHIFT,
-		.shift = AR_P_SHIFT,
-		.mask = AR_P_MASK,
-	},
-	{
-		.name = "ar_b",
-		.reg = AR_B,
-		.enable = EN_AR_RATE_SHIFT,
-		.shift = AR_B_SHIFT,
-		.mask = AR_B_MASK,
-	},
-	{
-		.name = "ar_r",
-		.reg = AR_R,
-		.enable = EN_AR_RATE_SHIFT,
-		.shift = AR_R_SHIFT,
-		.mask = AR_R_MASK,
-	},
-	{
-		.name = "ar_tgt_latency",
-		.reg = TGT_LATENCY,
-		.enable = EN_AR_LATENCY_SHIFT,
-		.shift = AR_TGT_LAT_SHIFT,
-		.mask = AR_TGT_LAT_MASK,
-	},
-	{
-		.name = "aw_tgt_latency",
-		.reg = TGT_LATENCY,
-		.enable = EN_AW_LATENCY_SHIFT,
-		.shift = AW_TGT_LAT_SHIFT,
-		.mask = AW_TGT_LAT_MASK,
-	},
-	{
-		.name = "ar_ki",
-		.reg = KI,
-		.enable = EN_AR_LATENCY_SHIFT,
-		.shift = AR_KI_SHIFT,
-		.mask = AR_KI_MASK,
-	},
-	{
-		.name = "aw_ki",
-		.reg = KI,
-		.enable = EN_AW_LATENCY_SHIFT,
-		.shift = AW_KI_SHIFT,
-		.mask = AW_KI_MASK,
-	},
-	{
-		.name = "ar_max_qos",
-		.reg = QOS_RANGE,
-		.enable = EN_AW_LATENCY_SHIFT,
-		.shift = AR_MAX_QOS_SHIFT,
-		.mask = AR_MAX_QOS_MASK,
-	},
-	{
-		.name = "ar_min_qos",
-		.reg = QOS_RANGE,
-		.enable = EN_AW_LATENCY_SHIFT,
-		.shift = AR_MIN_QOS_SHIFT,
-		.mask = AR_MIN_QOS_MASK,
-	},
-	{
-		.name = "aw_max_qos",
-		.reg = QOS_RANGE,
-		.enable = EN_AW_LATENCY_SHIFT,
-		.shift = AW_MAX_QOS_SHIFT,
-		.mask = AW_MAX_QOS_MASK,
-	},
-	{
-		.name = "aw_min_qos",
-		.reg = QOS_RANGE,
-		.enable = EN_AW_LATENCY_SHIFT,
-		.shift = AW_MIN_QOS_SHIFT,
-		.mask = AW_MIN_QOS_MASK,
-	},
-	
-};
+/* Backend in use. All register accesses go through it, the encoding in
+ * qos-encode.c runs against any register model. */
+static const struct qos_backend * qos_backend = &qos_platform;
+static bool qos_backend_ready;
 
-/* Find QoS-enabled device by name */
-static const struct qos_device * qos_dev_find_by_name(char * name)
-{
-	int i;
-	for (i = 0; i < QOS_DEVICES; ++i)
-		if(strncmp(name, devices[i].name, QOS_DEV_NAMELEN) == 0)
-			return &devices[i];
+/* Compiled configuration, only used under qos_lock */
+static struct qos_op qos_ops[QOS_MAX_OPS];
+static spinlock_t qos_lock;
 
-	return NULL;
+/* Start a compilation into qos_ops, called with qos_lock held */
+static void qos_compile_start(struct qos_compiler * c)
+{
+	qos_compiler_init(c, qos_backend, qos_ops, QOS_MAX_OPS);
 }
 
+/* Check if the registers are accessible, i.e. the platform has a backend
+ * and it was initialized successfully */
+static int qos_backend_check(void)
+{
+	return qos_backend_ready ? 0 : -ENOSYS;
+}
 
-/* Find QoS parameter by name */
-static const struct qos_param * qos_param_find_by_name(char * name)
+/* Main entry point for QoS management call */
+int qos_call(unsigned long count, unsigned long settings_ptr)
 {
-	int i;
-	for (i = 0; i < QOS_PARAMS; ++i)
-		if(strncmp(name, params[i].name, QOS_PARAM_NAMELEN) == 0)
-			return &params[i];
+	unsigned long sett_page_offs = settings_ptr & ~PAGE_MASK;
+	struct qos_compiler c;
+	unsigned int sett_pages;
+	void *sett_mapping;
+	int ret;
 
-	return NULL;
-}
+	ret = qos_backend_check();
+	if (ret)
+		return ret;
+
+	/* The settings currently reside in kernel memory. Use
+	 * temporary mapping to make the settings readable by the
+	 * hypervisor. No need to clean up the mapping because this is
+	 * only temporary by design. */
+	sett_pages = PAGES(sett_page_offs + sizeof(struct qos_setting) * count);
+	if (sett_pages > NUM_TEMPORARY_PAGES)
+		return -E2BIG;
+	sett_mapping = paging_get_guest_pages(NULL, settings_ptr, sett_pages,
+					     PAGE_READONLY_FLAGS);
+	if (!sett_mapping)
+		return -ENOMEM;
+
+	spin_lock(&qos_lock);
+	qos_compile_start(&c);
+	ret = qos_compile(&c, sett_mapping + sett_page_offs, count);
+	if (ret >= 0) {
+		qos_apply_ops(qos_backend, qos_ops, ret);
+		qos_print("Applied %lu settings in %d register writes\n",
+			  count, ret);
+		ret = 0;
+	}
+	spin_unlock(&qos_lock);
 
-/* Low-level functions to configure different aspects of the QoS
- * infrastructure */
+	return ret;
+}
 
-/* This function sets a given parameter to the desired value. It does
- * not enable the corresponding interface */
-static int qos_set_param (const struct qos_device * dev, const struct qos_param * param,
-	       unsigned long value)
+int qos_compile_call(unsigned long params_ptr)
 {
-	/* TODO check that device supports this parameter */
-	int ret = 0;
-
-	qos_print("QoS: Dev [%s], Param [%s] = 0x%08lx (reg off: +0x%08llx)\n",
-	       dev->name, param->name, value, (__u64)(QOS_PAR(dev, param) - nic_base));
-	
-	__u32 regval = qos_read32(QOS_PAR(dev, param));
-	regval &= ~(param->mask << param->shift);
-	regval |= ((value & param->mask) << param->shift);
-	qos_write32(QOS_PAR(dev, param), regval);
-	
+	unsigned long page_offs = params_ptr & ~PAGE_MASK;
+	struct qos_compile_params params;
+	struct qos_compiler c;
+	unsigned int pages;
+	void *mapping;
+	int ret;
+
+	mapping = paging_get_guest_pages(NULL, params_ptr,
+					 PAGES(page_offs + sizeof(params)),
+					 PAGE_READONLY_FLAGS);
+	if (!mapping)
+		return -ENOMEM;
+	params = *(struct qos_compile_params *)(mapping + page_offs);
+
+	/* The settings and the ops share the temporary mapping, so they
+	 * are accessed one after the other */
+	page_offs = params.settings_address & ~PAGE_MASK;
+	pages = PAGES(page_offs +
+		      sizeof(struct qos_setting) * params.num_settings);
+	if (pages > NUM_TEMPORARY_PAGES)
+		return -E2BIG;
+	mapping = paging_get_guest_pages(NULL, params.settings_address, pages,
+					 PAGE_READONLY_FLAGS);
+	if (!mapping)
+		return -ENOMEM;
+
+	spin_lock(&qos_lock);
+
+	qos_compile_start(&c);
+	ret = qos_compile(&c, mapping + page_offs, params.num_settings);
+	if (ret < 0)
+		goto out;
+	if (ret > params.max_ops) {
+		ret = -E2BIG;
+		goto out;
+	}
+
+	/* The ops are written back to the caller */
+	if (!arm_cell_mem_writable(this_cell(), params.ops_address,
+				   sizeof(struct qos_op) * ret)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	page_offs = params.ops_address & ~PAGE_MASK;
+	mapping = paging_get_guest_pages(NULL, params.ops_address,
+					 PAGES(page_offs +
+					       sizeof(struct qos_op) * ret),
+					 PAGE_DEFAULT_FLAGS);
+	if (!mapping) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	memcpy(mapping + page_offs, qos_ops, sizeof(struct qos_op) * ret);
+
+out:
+	spin_unlock(&qos_lock);
 	return ret;
 }
 
-/* Once we are done setting all the parameters, enable all the affected interfaces */
-static void qos_set_enable(const struct qos_device * dev, __u32 value)
+int qos_apply_call(unsigned long count, unsigned long ops_ptr)
 {
-	/* Mask away the no-enable bit */
-	value &= ~(1 << EN_NO_ENABLE);
-	
-	/* Set the enable bit in the corresponding device */
-	qos_write32(QOS_REG(dev, QOS_CNTL), value);
+	unsigned long page_offs = ops_ptr & ~PAGE_MASK;
+	unsigned long i;
+	void *mapping;
+	int ret;
+
+	if (count > QOS_MAX_OPS)
+		return -E2BIG;
+
+	ret = qos_backend_check();
+	if (ret)
+		return ret;
+
+	mapping = paging_get_guest_pages(NULL, ops_ptr,
+					 PAGES(page_offs +
+					       sizeof(struct qos_op) * count),
+					 PAGE_READONLY_FLAGS);
+	if (!mapping)
+		return -ENOMEM;
+
+	/* The root cell may still modify its copy, so only the one in
+	 * qos_ops is checked and applied */
+	spin_lock(&qos_lock);
+	memcpy(qos_ops, mapping + page_offs, sizeof(struct qos_op) * count);
+
+	for (i = 0; i < count; ++i)
+		if (!qos_op_valid(qos_backend, &qos_ops[i])) {
+			ret = -EINVAL;
+			goto out;
+		}
+
+	qos_apply_ops(qos_backend, qos_ops, count);
+
+out:
+	spin_unlock(&qos_lock);
+	return ret;
 }
 
-/* This function returns 1 if the selected device supports setting the
- * considered parameter */
-static int qos_dev_is_capable(const struct qos_device * dev, const struct qos_param * param)
+/* Map an output array of the caller for writing */
+static void * qos_map_result(unsigned long ptr, unsigned long size)
 {
-	/* TODO to be implemented */
-	return 1;
+	unsigned long page_offs = ptr & ~PAGE_MASK;
+	unsigned int pages = PAGES(page_offs + size);
+	void *mapping;
+
+	if (pages > NUM_TEMPORARY_PAGES)
+		return NULL;
+	if (!arm_cell_mem_writable(this_cell(), ptr, size))
+		return NULL;
+
+	mapping = paging_get_guest_pages(NULL, ptr, pages, PAGE_DEFAULT_FLAGS);
+	if (!mapping)
+		return NULL;
+
+	return mapping + page_offs;
 }
 
-/* Main function to apply a set of QoS paramters passed via the array
- * settings. The length of the array is specified in the second
- * parameter. */
-static int qos_apply_settings(struct qos_setting * settings, int count)
+int qos_query_call(unsigned long max, unsigned long settings_ptr)
 {
-	int ret = 0;
-	int i;
-
-	const struct qos_device * cur_dev = NULL;
-	__u32 enable_val = 0;
-	
-	for (i = 0; i < count; ++i) {
-		char * dev_name = settings[i].dev_name;
-
-		/* We are about to change device. Set the enable
-		 * register for the current device */
-		if (dev_name[0] && cur_dev) {
-			qos_set_enable(cur_dev, enable_val);
-			enable_val = 0;
+	unsigned int num_devices = qos_backend->num_devices;
+	const struct qos_device *dev;
+	struct qos_setting *settings;
+	unsigned int num = 0, i, j;
+	__u32 regval;
+	int ret;
+
+	if (num_devices * (QOS_PARAMS + 1) > max)
+		return -E2BIG;
+
+	ret = qos_backend_check();
+	if (ret)
+		return ret;
+
+	settings = qos_map_result(settings_ptr, sizeof(struct qos_setting) *
+				  num_devices * (QOS_PARAMS + 1));
+	if (!settings)
+		return -ENOMEM;
+
+	spin_lock(&qos_lock);
+	for (i = 0; i < num_devices; ++i) {
+		dev = &qos_backend->devices[i];
+
+		if (qos_dev_has_reg(dev, QOS_CNTL)) {
+			memcpy(settings[num].dev_name, dev->name,
+			       QOS_DEV_NAMELEN);
+			memcpy(settings[num].param_name, QOS_CNTL_NAME,
+			       sizeof(QOS_CNTL_NAME));
+			settings[num++].value =
+				qos_backend->read32(dev->base + QOS_CNTL);
+		}
+
+		for (j = 0; j < QOS_PARAMS; ++j) {
+			if (!qos_dev_has_reg(dev, qos_params[j].reg))
+				continue;
+
+			regval = qos_backend->read32(dev->base +
+						     qos_params[j].reg);
+			memcpy(settings[num].dev_name, dev->name,
+			       QOS_DEV_NAMELEN);
+			memcpy(settings[num].param_name, qos_params[j].name,
+			       QOS_PARAM_NAMELEN);
+			settings[num++].value = (regval >> qos_params[j].shift) &
+				qos_params[j].mask;
 		}
-				
-		if (dev_name[0]) 
-			cur_dev = qos_dev_find_by_name(dev_name);
-		
-		
-		/* At this point, the cur_dev should not be NULL */
-		if(!cur_dev)
-			return -ENODEV;
-		
-		const struct qos_param * param = qos_param_find_by_name(settings[i].param_name);
-		
-		if(!param)
-			return -EINVAL;
-
-		/* Check that this device implements this QoS interface */
-		if(!qos_dev_is_capable(cur_dev, param))
-			return -ENOSYS;
-		
-		enable_val |= 1 << param->enable;
-		qos_set_param(cur_dev, param, settings[i].value);		
 	}
+	spin_unlock(&qos_lock);
 
-	/* Apply settings for the last device */
-	qos_set_enable(cur_dev, enable_val);
-				
-	return ret;
+	return num;
+}
+
+/* Registers saved by a snapshot. QOS_CNTL comes last, so that regulation is
+ * only re-enabled once all parameters are restored. */
+static const __u16 qos_snapshot_regs[] = {
+	READ_QOS, WRITE_QOS, FN_MOD, MAX_OT, MAX_COMB_OT, AW_P, AW_B, AW_R,
+	AR_P, AR_B, AR_R, TGT_LATENCY, KI, QOS_RANGE, QOS_CNTL,
+};
+
+int qos_snapshot_call(unsigned long max, unsigned long ops_ptr)
+{
+	unsigned int num_devices = qos_backend->num_devices;
+	unsigned int num = 0, reg, i;
+	const struct qos_device *dev;
+	struct qos_op *ops;
+	int ret;
+
+	if (num_devices * ARRAY_SIZE(qos_snapshot_regs) > max)
+		return -E2BIG;
+
+	ret = qos_backend_check();
+	if (ret)
+		return ret;
+
+	ops = qos_map_result(ops_ptr, sizeof(struct qos_op) * num_devices *
+			     ARRAY_SIZE(qos_snapshot_regs));
+	if (!ops)
+		return -ENOMEM;
+
+	spin_lock(&qos_lock);
+	for (reg = 0; reg < ARRAY_SIZE(qos_snapshot_regs); ++reg)
+		for (i = 0; i < num_devices; ++i) {
+			dev = &qos_backend->devices[i];
+			if (!qos_dev_has_reg(dev, qos_snapshot_regs[reg]))
+				continue;
+
+			ops[num].offset = dev->base + qos_snapshot_regs[reg];
+			ops[num].mask = ~0U;
+			ops[num].value = qos_backend->read32(ops[num].offset);
+			num++;
+		}
+	spin_unlock(&qos_lock);
+
+	return num;
 }
 
-/* Clear the QOS_CNTL register for all the devices */
-static int qos_disable_all(void)
+/* Parameter driven by the control loop, resolved */
+struct qos_loop_entry {
+	const struct qos_device * dev;
+	const struct qos_param * param;
+	__u32 relaxed;
+	__u32 strict;
+};
+
+/* Control loop state, only used under qos_lock */
+static struct {
+	unsigned int num;
+	unsigned int steps;
+	/* 0 applies the relaxed values, steps the strict ones */
+	unsigned int level;
+	s32 slack_low;
+	s32 slack_high;
+	/* Sequence number of the last slack report processed */
+	u32 seq;
+	struct qos_loop_entry entries[QOS_LOOP_MAX_SETTINGS];
+} qos_loop;
+
+static __u32 qos_loop_value(const struct qos_loop_entry * entry)
 {
-	int i;
-	for (i = 0; i < QOS_DEVICES; ++i)
-		qos_set_enable(&devices[i], 0);
+	s64 range = (s64)entry->strict - entry->relaxed;
+
+	return entry->relaxed + range * qos_loop.level / qos_loop.steps;
+}
+
+/* Add the loop parameters at the current level to a composition */
+static int qos_compile_loop(struct qos_compiler * c)
+{
+	unsigned int n;
+	int err;
+
+	for (n = 0; n < qos_loop.num; n++) {
+		c->dev = qos_loop.entries[n].dev;
+		err = qos_compile_param(c, qos_loop.entries[n].param,
+					qos_loop_value(&qos_loop.entries[n]));
+		if (err)
+			return err;
+	}
 
 	return 0;
 }
 
+/* Devices regulated on behalf of the active cell profiles */
+static unsigned long qos_profile_devices;
 
-/* Main entry point for QoS management call */
-int qos_call(unsigned long count, unsigned long settings_ptr)
+static int qos_compile_cell(struct qos_compiler * c, const struct cell * cell)
 {
-	unsigned long sett_page_offs = settings_ptr & ~PAGE_MASK;
-	unsigned int sett_pages;
-	void *sett_mapping;
+	const struct jailhouse_qos * qos = jailhouse_cell_qos(cell->config);
+	unsigned int n;
+	int err;
+
+	/* A profile cannot continue the last device of another one */
+	c->dev = NULL;
+
+	for (n = 0; n < cell->config->num_qos; n++, qos++) {
+		err = qos_compile_setting(c, qos->dev_name, qos->param_name,
+					  qos->value);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+/* Combine the profiles of all active cells, in cell creation order, and
+ * apply them. The parameters of the control loop override them. Devices
+ * that are no longer covered by any profile get their regulation disabled.
+ * Called with qos_lock held. */
+static int qos_profiles_apply(void)
+{
+	unsigned long profile_devices;
+	struct qos_compiler c;
+	struct cell *cell;
 	int ret;
 
-	/* Check if the NIC needs to be mapped */
-	if(!nic_base) {
-		nic_base = qos_map_device(NIC_BASE, NIC_SIZE);
-		
-		if(!nic_base)
-			return -ENOSYS;
+	qos_compile_start(&c);
+
+	for_each_cell(cell)
+		if (cell->arch.qos_active) {
+			ret = qos_compile_cell(&c, cell);
+			if (ret)
+				return ret;
+		}
+
+	ret = qos_compile_loop(&c);
+	if (ret)
+		return ret;
+
+	profile_devices = c.devices;
+	c.devices |= qos_profile_devices;
+
+	ret = qos_compile_finish(&c);
+	if (ret <= 0)
+		return ret;
+
+	ret = qos_backend_check();
+	if (ret)
+		return ret;
+
+	qos_apply_ops(qos_backend, qos_ops, c.num);
+	qos_profile_devices = profile_devices;
+
+	return 0;
+}
+
+int qos_loop_call(unsigned long params_ptr)
+{
+	unsigned long page_offs = params_ptr & ~PAGE_MASK;
+	struct qos_loop_entry entries[QOS_LOOP_MAX_SETTINGS];
+	const struct qos_loop_setting *settings = NULL;
+	struct qos_loop_setting setting;
+	struct qos_loop_params params;
+	struct qos_compiler c;
+	unsigned int pages, n;
+	void *mapping;
+	int err;
+
+	mapping = paging_get_guest_pages(NULL, params_ptr,
+					 PAGES(page_offs + sizeof(params)),
+					 PAGE_READONLY_FLAGS);
+	if (!mapping)
+		return -ENOMEM;
+	params = *(struct qos_loop_params *)(mapping + page_offs);
+
+	if (params.num_settings > QOS_LOOP_MAX_SETTINGS)
+		return -E2BIG;
+	if (params.num_settings > 0 &&
+	    (params.steps == 0 || params.slack_low > params.slack_high))
+		return -EINVAL;
+	/* The loop is advanced by the MemGuard period of root cell CPUs */
+	if (params.num_settings > 0 && !memguard_cell_periodic(&root_cell))
+		return -ENODEV;
+
+	if (params.num_settings > 0) {
+		page_offs = params.settings_address & ~PAGE_MASK;
+		pages = PAGES(page_offs + sizeof(struct qos_loop_setting) *
+			      params.num_settings);
+		mapping = paging_get_guest_pages(NULL, params.settings_address,
+						 pages, PAGE_READONLY_FLAGS);
+		if (!mapping)
+			return -ENOMEM;
+		settings = mapping + page_offs;
 	}
 
-	/* The settings currently reside in kernel memory. Use
-	 * temporary mapping to make the settings readable by the
-	 * hypervisor. No need to clean up the mapping because this is
-	 * only temporary by design. */
-	sett_pages = PAGES(sett_page_offs + sizeof(struct qos_setting) * count);
-	sett_mapping = paging_get_guest_pages(NULL, settings_ptr, sett_pages,
-					     PAGE_READONLY_FLAGS);
+	spin_lock(&qos_lock);
 
-	if (!sett_mapping) {
-		ret = -ENOMEM;
-		goto exit_err;
+	/* Resolve the names with the rules of ordinary settings. Each
+	 * setting is read once, the root cell may modify it meanwhile. */
+	qos_compile_start(&c);
+	for (n = 0; n < params.num_settings; n++) {
+		setting = settings[n];
+
+		err = qos_compile_setting(&c, setting.dev_name,
+					  setting.param_name, setting.relaxed);
+		if (err)
+			goto out;
+
+		entries[n].dev = c.dev;
+		entries[n].param = qos_param_find_by_name(setting.param_name);
+		entries[n].relaxed = setting.relaxed;
+		entries[n].strict = setting.strict;
+	}
+
+	memcpy(qos_loop.entries, entries, sizeof(entries[0]) * n);
+	qos_loop.num = params.num_settings;
+	qos_loop.steps = params.steps;
+	qos_loop.level = 0;
+	qos_loop.slack_low = params.slack_low;
+	qos_loop.slack_high = params.slack_high;
+
+	err = qos_profiles_apply();
+	if (err)
+		qos_loop.num = 0;
+
+out:
+	spin_unlock(&qos_lock);
+	return err;
+}
+
+/* Move one level towards the strict values, doubling the distance from the
+ * relaxed ones, when the slack is short. Move back one level when it is
+ * ample. Only the parameter fields are written, the enable bits were set
+ * when the loop was configured. Called from the MemGuard period interrupt,
+ * so a report is left for the next period if qos_lock is busy. */
+void qos_loop_update(u64 slack_report)
+{
+	u32 seq = slack_report >> 32;
+	s32 slack = (s32)slack_report;
+	const struct qos_loop_entry *entry;
+	unsigned int level, n;
+	__u32 offset, regval;
+
+	if (qos_loop.num == 0 || seq == qos_loop.seq)
+		return;
+
+	if (!spin_trylock(&qos_lock))
+		return;
+
+	if (qos_loop.num == 0 || seq == qos_loop.seq)
+		goto out;
+	qos_loop.seq = seq;
+
+	level = qos_loop.level;
+	if (slack < qos_loop.slack_low)
+		level = MIN(MAX(level * 2, 1), qos_loop.steps);
+	else if (slack > qos_loop.slack_high && level > 0)
+		level--;
+	if (level == qos_loop.level)
+		goto out;
+	qos_loop.level = level;
+
+	for (n = 0; n < qos_loop.num; n++) {
+		entry = &qos_loop.entries[n];
+		offset = entry->dev->base + entry->param->reg;
+
+		regval = qos_backend->read32(offset);
+		regval &= ~(entry->param->mask << entry->param->shift);
+		regval |= (qos_loop_value(entry) & entry->param->mask) <<
+			entry->param->shift;
+		qos_backend->write32(offset, regval);
 	}
 
-	struct qos_setting * settings = (struct qos_setting *)(sett_mapping + sett_page_offs);
+out:
+	spin_unlock(&qos_lock);
+}
+
+int qos_cell_start(struct cell *cell)
+{
+	bool was_active = cell->arch.qos_active;
+	int err;
+
+	if (cell->config->num_qos == 0)
+		return 0;
+
+	spin_lock(&qos_lock);
+	cell->arch.qos_active = true;
+	err = qos_profiles_apply();
+	if (err)
+		cell->arch.qos_active = was_active;
+	spin_unlock(&qos_lock);
+
+	return err;
+}
+
+static int qos_cell_init(struct cell *cell)
+{
+	struct qos_compiler c;
+	int ret;
+
+	cell->arch.qos_active = false;
+
+	if (cell->config->num_qos == 0)
+		return 0;
+
+	/* Reject profiles that would not resolve on cell start */
+	spin_lock(&qos_lock);
+	qos_compile_start(&c);
+	ret = qos_compile_cell(&c, cell);
+	if (!ret)
+		ret = qos_compile_finish(&c);
+	spin_unlock(&qos_lock);
+
+	return ret < 0 ? trace_error(ret) : 0;
+}
+
+static void qos_cell_exit(struct cell *cell)
+{
+	int err;
+
+	if (!cell->arch.qos_active)
+		return;
+
+	spin_lock(&qos_lock);
+	cell->arch.qos_active = false;
+	err = qos_profiles_apply();
+	spin_unlock(&qos_lock);
+
+	if (err)
+		qos_print("Failed to withdraw profile of cell \"%s\" (%d)\n",
+			  cell->config->name, err);
+}
+
+static int qos_init(void)
+{
+	int err;
 
-	/* Check if the user has requestes QoS control to be disabled */
-	if(count > 0 && strncmp("disable", settings[0].dev_name, 8) == 0) {
-		ret = qos_disable_all();
-	} else {
-		/* Otherwise, just apply the parameters */
-		ret = qos_apply_settings(settings, count);
+	if (qos_backend->num_devices > QOS_MAX_DEVICES)
+		return trace_error(-E2BIG);
+
+	if (qos_backend->init) {
+		err = qos_backend->init();
+		if (err)
+			return err;
+		qos_backend_ready = true;
 	}
-	
-	
-exit_err:
-	return ret;
 
+	/* The root cell profile is active as long as the hypervisor is */
+	err = qos_cell_init(&root_cell);
+	if (err)
+		return err;
+
+	return qos_cell_start(&root_cell);
 }
+
+static void qos_shutdown(void)
+{
+	int err;
+
+	/* Withdraw the loop together with the root cell profile */
+	spin_lock(&qos_lock);
+	qos_loop.num = 0;
+	root_cell.arch.qos_active = false;
+	err = qos_profiles_apply();
+	spin_unlock(&qos_lock);
+
+	if (err)
+		qos_print("Failed to restore the QoS defaults (%d)\n", err);
+}
+
+DEFINE_UNIT_MMIO_COUNT_REGIONS_STUB(qos);
+DEFINE_UNIT(qos, "Interconnect QoS");
@@ -11,10 +11,12 @@
  */
 
 #include <jailhouse/cell.h>
+#include <jailhouse/control.h>
 #include <jailhouse/entry.h>
 #include <jailhouse/paging.h>
 #include <jailhouse/printk.h>
 #include <jailhouse/processor.h>
+#include <asm/coloring.h>
 #include <asm/control.h>
 #include <asm/entry.h>
 #include <asm/irqchip.h>
@@ -40,6 +42,10 @@ int arch_init_early(void)
 	if (err)
 		return err;
 
+	err = coloring_hv_text();
+	if (err)
+		return err;
+
 	return arm_init_early();
 }
 
@@ -65,6 +71,10 @@ int arch_cpu_init(struct per_cpu *cpu_data)
 	if (err)
 		return err;
 
+	err = coloring_cpu_init();
+	if (err)
+		return err;
+
 	/* Conditionally switch to hardened vectors */
 	if (this_cpu_data()->smccc_has_workaround_1)
 		arm_write_sysreg(vbar_el2, &hyp_vectors_hardened);
@@ -572,6 +572,30 @@ static int arm_smmu_map_memory_region(struct cell *cell,
 	return err;
 }
 
+static int arm_smmu_unmap_memory_region(struct cell *cell,
+				 const struct jailhouse_memory *mem)
+{
+	return paging_destroy(&cell->arch.iomm, mem->virt_start, mem->size,
+			      PAGING_COHERENT);
+}
+
+/* Invalidate the stage-2 TLBs of all SMMUv2 instances */
+static void arm_smmu_flush_tlbs(void)
+{
+	struct jailhouse_iommu *iommu;
+	int i;
+
+	for (i = 0; i < JAILHOUSE_MAX_IOMMU_UNITS; i++) {
+		iommu = &system_config->platform_info.iommu_units[i];
+		if (iommu->type != JAILHOUSE_IOMMU_SMMUV2)
+			continue;
+
+		arm_smmu_gr0_write(&smmu[i], ARM_SMMU_GR0_TLBIALLNSNH,
+				   WRITE_DUMMY_VAL);
+		arm_smmu_tlb_sync_global(&smmu[i]);
+	}
+}
+
 static int arm_smmu_device_reset(struct arm_smmu_device *smmu)
 {
 	int i;
@@ -962,11 +986,82 @@ static int arm_smmu_setup_stream_matching(struct arm_smmu_device *smmu, u32 cbnd
 }
 
 
+/*
+ * Build the translation tables of a cell. They are shared by the context
+ * banks of all SMMUv2 instances, so each region is only mapped once.
+ */
+static int arm_smmu_cell_tables_init(struct cell *cell)
+{
+	struct paging_structures *io_pg_structs = &cell->arch.iomm;
+	const struct jailhouse_memory *mem;
+	int ret, n;
+
+	/* Allocate root_page for smmu mappings */
+	io_pg_structs->hv_paging = false;
+	io_pg_structs->root_paging = hv_paging_structs.root_paging;
+	io_pg_structs->root_table = page_alloc(&mem_pool, 1);
+
+	if (!io_pg_structs->root_table)
+	{
+		smmu_print("ERROR: unable to allocate root SMMU table\n");
+		return -EINVAL;
+	}
+
+	for_each_mem_region(mem, cell->config, n) {
+		smmu_print("Mapping region %d\n", n);
+		ret = arm_smmu_map_memory_region(cell, mem);
+		if (ret) {
+			smmu_print("ERROR: region mapping failed with code %d.\n", ret);
+			return -EINVAL;
+		}
+	}
+
+	/* There is at least one SMMUv2 in the system. Assume
+	 * that this is THE main SMMU and populate coloring
+	 * functions with the smmu-dependent memory mapping
+	 * functions. */
+	if (!col_ops.smmu_map_f)
+		col_ops.smmu_map_f = arm_smmu_map_memory_region;
+	if (!col_ops.smmu_unmap_f)
+		col_ops.smmu_unmap_f = arm_smmu_unmap_memory_region;
+	if (!col_ops.smmu_flush_f)
+		col_ops.smmu_flush_f = arm_smmu_flush_tlbs;
+
+	/* Invoke creation of colored regions in the SMMU mapping */
+	ret = coloring_cell_smmu_create(cell);
+	if (ret) {
+		smmu_print("ERROR: colored region mapping failed with code %d.\n", ret);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Tear down the translation tables of a cell. No context bank may use
+ * them anymore and the TLBs must have been invalidated.
+ */
+static void arm_smmu_cell_tables_destroy(struct cell *cell)
+{
+	const struct jailhouse_memory *mem;
+	int n;
+
+	if (!cell->arch.iomm.root_table)
+		return;
+
+	coloring_cell_smmu_destroy(cell);
+
+	for_each_mem_region(mem, cell->config, n)
+		arm_smmu_unmap_memory_region(cell, mem);
+
+	page_free(&mem_pool, cell->arch.iomm.root_table, 1);
+	cell->arch.iomm.root_table = NULL;
+}
+
 static int arm_smmuv2_cell_init(struct cell *cell)
 {
 	struct jailhouse_iommu *iommu;
-	int ret, i, n, cbndx;
-	const struct jailhouse_memory *mem;
+	int ret, i, cbndx;
 
 	if (!iommu_count_units())
 		return 0;
@@ -976,45 +1071,16 @@ static int arm_smmuv2_cell_init(struct cell *cell)
 		if (iommu->type != JAILHOUSE_IOMMU_SMMUV2)
 			continue;
 
-		/* Allocate root_page for smmu mappings */
-		struct paging_structures * io_pg_structs = &cell->arch.iomm;
-		io_pg_structs->hv_paging = false;
-		io_pg_structs->root_paging = hv_paging_structs.root_paging;
-		io_pg_structs->root_table = page_alloc(&mem_pool, 1);
-
-		if (!io_pg_structs->root_table)
-		{
-			smmu_print("ERROR: unable to allocate root SMMU table\n");
-			return -EINVAL;
-		}
-		
-		for_each_mem_region(mem, cell->config, n) {
-			smmu_print("Mapping region %d\n", n);
-			ret = arm_smmu_map_memory_region(cell, mem);
+		if (!cell->arch.iomm.root_table) {
+			ret = arm_smmu_cell_tables_init(cell);
 			if (ret) {
-				smmu_print("ERROR: region mapping failed with code %d.\n", ret);
-				return -EINVAL;
+				arm_smmu_cell_tables_destroy(cell);
+				return ret;
 			}
 		}
-
-		/* There is at least one SMMUv2 in the system. Assume
-		 * that this is THE main SMMU and populate coloring
-		 * functions with the smmu-dependent memory mapping
-		 * function. */
-		if (!col_ops.smmu_map_f)
-			col_ops.smmu_map_f = arm_smmu_map_memory_region;
-		
-		/* TODO populate unmap function too */
-
-		/* Invoke creation of colored regions in the SMMU mapping */
-		ret = coloring_cell_smmu_create(cell);
-		if (ret) {
-			smmu_print("ERROR: colored region mapping failed with code %d.\n", ret);
-			return -EINVAL;			
-		}
 				
 		/* Find an unused stream matching context number */
-		for (cbndx = 0; cbndx < smmu->num_context_banks; ++cbndx) {
+		for (cbndx = 0; cbndx < smmu[i].num_context_banks; ++cbndx) {
 			if (smmu[i].cell_to_cb[cbndx] == -1)
 				break;
 		}
@@ -1044,18 +1110,18 @@ static int arm_smmuv2_cell_init(struct cell *cell)
 #if SMMUV2_DEBUG == 1
 		arm_smmu_dump_config(&smmu[i]);
 #endif
-		
-		/* Invalidate the TLB, just in case */
-		arm_smmu_gr0_write(smmu, ARM_SMMU_GR0_TLBIALLH, WRITE_DUMMY_VAL);
-		arm_smmu_gr0_write(smmu, ARM_SMMU_GR0_TLBIALLNSNH, WRITE_DUMMY_VAL);
-		arm_smmu_tlb_sync_global(smmu);
+	}
+
+	if (!cell->arch.iomm.root_table)
+		return 0;
 
-		/* Invalidate data caches */
-		smmu_print("Invalidatiing CPU caches... \n");
-		arm_l1l2_caches_flush();
-		smmu_print("DONE!\n");
+	/* Invalidate the TLBs of all instances once, just in case */
+	arm_smmu_flush_tlbs();
 
-	}
+	/* Invalidate data caches */
+	smmu_print("Invalidatiing CPU caches... \n");
+	arm_l1l2_caches_flush();
+	smmu_print("DONE!\n");
 
 	return 0;
 }
@@ -1088,14 +1154,20 @@ static void arm_smmuv2_cell_exit(struct cell *cell)
 
 		for (j = 0; j < smmu[i].num_context_banks; ++j) {
 			if (smmu[i].cell_to_cb[j] == cell->config->id) {
-				arm_smmu_cb_write(smmu, j, ARM_SMMU_CB_SCTLR, 0);
-				arm_smmu_cb_write(smmu, j, ARM_SMMU_CB_FSR, ARM_SMMU_FSR_FAULT);
+				arm_smmu_cb_write(&smmu[i], j, ARM_SMMU_CB_SCTLR, 0);
+				arm_smmu_cb_write(&smmu[i], j, ARM_SMMU_CB_FSR, ARM_SMMU_FSR_FAULT);
 				smmu[i].cell_to_cb[j] = -1;
 			}
 		}
-
-		/* TODO: invalidate TLBs */
 	}
+
+	if (!cell->arch.iomm.root_table)
+		return;
+
+	/* Nothing walks the tables anymore, drop what the TLBs still
+	 * hold of them before they are freed */
+	arm_smmu_flush_tlbs();
+	arm_smmu_cell_tables_destroy(cell);
 }
 
 static void arm_smmuv2_shutdown(void)
@@ -0,0 +1,214 @@
+/*
+ * ARM QoS Support for Jailhouse, host test of the register encoding
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+
+#include <jailhouse/entry.h>
+#include <jailhouse/string.h>
+#include <jailhouse/utils.h>
+#include <asm/qos-encode.h>
+
+#define REG_SPACE	0x400
+
+/* Register model of the fake interconnect */
+static __u32 regs[REG_SPACE / 4];
+
+static __u32 test_read32(__u32 offset)
+{
+	return regs[offset / 4];
+}
+
+static void test_write32(__u32 offset, __u32 value)
+{
+	regs[offset / 4] = value;
+}
+
+static const struct qos_device test_devices[] = {
+	{
+		.name = "full",
+		.flags = FLAGS_HAS_RWQOS | FLAGS_HAS_REGUL | FLAGS_HAS_DYNQOS,
+		.base = 0x080,
+	},
+	{
+		.name = "rwonly",
+		.flags = FLAGS_HAS_RWQOS,
+		.base = 0x180,
+	},
+	{
+		.name = "regul",
+		.flags = FLAGS_HAS_REGUL,
+		.base = 0x280,
+	},
+};
+
+static const struct qos_backend test_backend = {
+	.devices = test_devices,
+	.num_devices = ARRAY_SIZE(test_devices),
+	.read32 = test_read32,
+	.write32 = test_write32,
+};
+
+static struct qos_op ops[QOS_MAX_OPS];
+static unsigned int failures;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			printf("%s:%d: check failed: %s\n", __FILE__,	\
+			       __LINE__, #cond);			\
+			failures++;					\
+		}							\
+	} while (0)
+
+static int compile(const struct qos_setting * settings, unsigned long count)
+{
+	struct qos_compiler c;
+
+	qos_compiler_init(&c, &test_backend, ops, QOS_MAX_OPS);
+	return qos_compile(&c, settings, count);
+}
+
+static const struct qos_op * find_op(int num, __u32 offset)
+{
+	int i;
+
+	for (i = 0; i < num; i++)
+		if (ops[i].offset == offset)
+			return &ops[i];
+
+	return NULL;
+}
+
+static void test_compile(void)
+{
+	const struct qos_setting settings[] = {
+		{ "full", "aw_p", 0x12 },
+		{ "", "aw_r", 0x345 },
+		{ "", "ar_max_otf", 0x20 },
+		{ "", "ar_max_oti", 0x08 },
+		{ "rwonly", "read_qos", 0x7 },
+	};
+	const struct qos_op * op;
+	int num;
+
+	num = compile(settings, ARRAY_SIZE(settings));
+	/* AW_R, AW_P, MAX_OT and READ_QOS, plus QOS_CNTL of "full" */
+	CHECK(num == 5);
+
+	op = find_op(num, 0x080 + AW_P);
+	CHECK(op && op->mask == 0xff000000 && op->value == 0x12000000);
+
+	op = find_op(num, 0x080 + QOS_CNTL);
+	CHECK(op && op->mask == ~0U &&
+	      op->value == (1 << EN_AW_RATE_SHIFT | 1 << EN_AR_OT_SHIFT));
+
+	/* Devices without regulation get no QOS_CNTL write */
+	CHECK(find_op(num, 0x180 + QOS_CNTL) == NULL);
+	op = find_op(num, 0x180 + READ_QOS);
+	CHECK(op && op->mask == 0xf && op->value == 0x7);
+}
+
+static void test_merge(void)
+{
+	const struct qos_setting settings[] = {
+		{ "full", "aw_max_otf", 0x10 },
+		{ "full", "ar_max_oti", 0x3f },
+		{ "full", "aw_max_otf", 0x11 },
+	};
+	const struct qos_op * op;
+	int num;
+
+	num = compile(settings, ARRAY_SIZE(settings));
+	/* A single write of MAX_OT, the later value winning */
+	CHECK(num == 2);
+	op = find_op(num, 0x080 + MAX_OT);
+	CHECK(op && op->mask == 0x3f0000ff && op->value == 0x3f000011);
+}
+
+static void test_reject(void)
+{
+	const struct qos_setting no_regul[] = { { "rwonly", "aw_b", 1 } };
+	const struct qos_setting no_dynqos[] = { { "regul", "aw_ki", 1 } };
+	const struct qos_setting no_dev[] = { { "", "aw_b", 1 } };
+	const struct qos_setting bad_dev[] = { { "none", "aw_b", 1 } };
+	const struct qos_setting bad_param[] = { { "full", "none", 1 } };
+
+	CHECK(compile(no_regul, 1) == -ENOSYS);
+	CHECK(compile(no_dynqos, 1) == -ENOSYS);
+	CHECK(compile(no_dev, 1) == -ENODEV);
+	CHECK(compile(bad_dev, 1) == -ENODEV);
+	CHECK(compile(bad_param, 1) == -EINVAL);
+}
+
+static void test_disable(void)
+{
+	const struct qos_setting settings[] = { { "disable", "", 0 } };
+	int num;
+
+	/* Only devices with a QOS_CNTL register are cleared */
+	num = compile(settings, 1);
+	CHECK(num == 2);
+	CHECK(find_op(num, 0x080 + QOS_CNTL)->value == 0);
+	CHECK(find_op(num, 0x280 + QOS_CNTL)->value == 0);
+}
+
+static void test_op_valid(void)
+{
+	const struct qos_op valid[] = {
+		{ 0x080 + AW_P, 0, 0 },
+		{ 0x080 + QOS_RANGE, 0, 0 },
+		{ 0x180 + WRITE_QOS, 0, 0 },
+		{ 0x280 + QOS_CNTL, 0, 0 },
+	};
+	const struct qos_op invalid[] = {
+		{ 0x080 + AW_P + 2, 0, 0 },
+		{ 0x080 + QOS_RANGE + 4, 0, 0 },
+		{ 0x180 + AW_P, 0, 0 },
+		{ 0x280 + KI, 0, 0 },
+		{ 0x000, 0, 0 },
+	};
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(valid); i++)
+		CHECK(qos_op_valid(&test_backend, &valid[i]));
+	for (i = 0; i < ARRAY_SIZE(invalid); i++)
+		CHECK(!qos_op_valid(&test_backend, &invalid[i]));
+}
+
+static void test_apply(void)
+{
+	const struct qos_setting settings[] = { { "full", "aw_r", 0x345 } };
+	int num;
+
+	memset(regs, 0, sizeof(regs));
+	regs[(0x080 + AW_R) / 4] = 0x000fffff;
+	regs[(0x080 + QOS_CNTL) / 4] = 0xffffffff;
+
+	num = compile(settings, 1);
+	qos_apply_ops(&test_backend, ops, num);
+
+	/* Fields are replaced, other bits are kept, QOS_CNTL is written */
+	CHECK(regs[(0x080 + AW_R) / 4] == 0x345fffff);
+	CHECK(regs[(0x080 + QOS_CNTL) / 4] == 1 << EN_AW_RATE_SHIFT);
+}
+
+int main(void)
+{
+	test_compile();
+	test_merge();
+	test_reject();
+	test_disable();
+	test_op_valid();
+	test_apply();
+
+	if (failures) {
+		printf("%u checks failed\n", failures);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
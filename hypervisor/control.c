@@ -426,6 +426,11 @@ static int cell_create(struct per_cpu *cpu_data, unsigned long config_address)
 		goto err_resume;
 	}
 
+	if (coloring_recolor_pending()) {
+		err = -EBUSY;
+		goto err_resume;
+	}
+
 	cfg_pages = PAGES(cfg_page_offs + sizeof(struct jailhouse_cell_desc));
 	cfg_mapping = paging_get_guest_pages(NULL, config_address, cfg_pages,
 					     PAGE_READONLY_FLAGS);
@@ -607,6 +612,14 @@ static int cell_management_prologue(enum management_task task,
 		return -EINVAL;
 	}
 
+	/* cells cannot be managed while a recoloring is in progress, a cell
+	 * whose recoloring failed can only be destroyed */
+	if (coloring_recolor_pending() &&
+	    !(task == CELL_DESTROY && coloring_recolor_failed(*cell_ptr))) {
+		cell_resume(&root_cell);
+		return -EBUSY;
+	}
+
 	if ((task == CELL_DESTROY && !cell_reconfig_ok(*cell_ptr)) ||
 	    !cell_shutdown_ok(*cell_ptr)) {
 		cell_resume(&root_cell);
@@ -647,6 +660,10 @@ static int cell_start(struct per_cpu *cpu_data, unsigned long id)
 
 		cell->loadable = false;
 	}
+
+	err = qos_cell_start(cell);
+	if (err)
+		goto out_resume;
 	
 	/*
 	 * Present a consistent Communication Region state to the cell. Zero the
@@ -764,6 +781,70 @@ static int cell_destroy(struct per_cpu *cpu_data, unsigned long id)
 	return 0;
 }
 
+static int cell_recolor(struct per_cpu *cpu_data, unsigned long id,
+			unsigned long params_addr)
+{
+	unsigned long params_offs = params_addr & ~PAGE_MASK;
+	const struct jailhouse_recolor_params *params;
+	unsigned int region, flags;
+	struct cell *cell;
+	u64 colors;
+	void *mapping;
+	int err;
+
+	/* We do not support management commands over non-root cells. */
+	if (cpu_data->public.cell != &root_cell)
+		return -EPERM;
+
+	mapping = paging_get_guest_pages(NULL, params_addr,
+					 PAGES(params_offs + sizeof(*params)),
+					 PAGE_READONLY_FLAGS);
+	if (!mapping)
+		return -ENOMEM;
+
+	/* The temporary mapping is reused while moving pages */
+	params = mapping + params_offs;
+	region = params->region;
+	flags = params->flags;
+	colors = params->colors;
+
+	cell_suspend(&root_cell);
+
+	for_each_cell(cell)
+		if (cell->config->id == id)
+			break;
+
+	if (!cell)
+		err = -ENOENT;
+	else if (cell == &root_cell)
+		err = -EINVAL;
+	else if (cell->loadable)
+		err = -EBUSY;
+	else if (!(flags & JAILHOUSE_RECOLOR_CONTINUE))
+		err = coloring_cell_recolor_prepare(cell, region, colors);
+	else
+		err = 0;
+	if (err)
+		goto out_resume;
+
+	/*
+	 * Move one batch of pages per call, the root cell reissues the
+	 * hypercall with JAILHOUSE_RECOLOR_CONTINUE while 1 is returned.
+	 */
+	cell_suspend(cell);
+	err = coloring_cell_recolor_step(cell);
+	arch_flush_cell_vcpu_caches(cell);
+	cell_resume(cell);
+
+	/* New pages of the cell were taken from the root cell */
+	arch_flush_cell_vcpu_caches(&root_cell);
+
+out_resume:
+	cell_resume(&root_cell);
+
+	return err;
+}
+
 static int cell_get_state(struct per_cpu *cpu_data, unsigned long id)
 {
 	struct cell *cell;
@@ -811,6 +892,7 @@ void shutdown(void)
 static int hypervisor_disable(struct per_cpu *cpu_data)
 {
 	static volatile unsigned int waiting_cpus;
+	static volatile bool common_shutdown_done;
 	static bool do_common_shutdown;
 	unsigned int this_cpu = cpu_data->public.cpu_id;
 	unsigned int cpu;
@@ -880,10 +962,27 @@ static int hypervisor_disable(struct per_cpu *cpu_data)
 	if (do_common_shutdown) {
 		/*
 		 * The first CPU to get here changes common settings to native.
+		 * The others help with the root-cell recoloring meanwhile.
 		 */
+		do_common_shutdown = false;
+		spin_unlock(&shutdown_lock);
+
 		printk("Shutting down hypervisor\n");
 		shutdown();
-		do_common_shutdown = false;
+
+		memory_barrier();
+		common_shutdown_done = true;
+
+		spin_lock(&shutdown_lock);
+	} else {
+		spin_unlock(&shutdown_lock);
+
+		while (!common_shutdown_done) {
+			coloring_recolor_assist();
+			cpu_relax();
+		}
+
+		spin_lock(&shutdown_lock);
 	}
 	printk(" Releasing CPU %d\n", this_cpu);
 
@@ -987,8 +1086,35 @@ long hypercall(unsigned long code, unsigned long arg1, unsigned long arg2)
 		return 0;
 	case JAILHOUSE_HC_MEMGUARD:
 		return memguard_call_params(arg1);
+	case JAILHOUSE_HC_MEMGUARD_SLACK:
+		if (!(cpu_data->public.cell->config->flags &
+		      JAILHOUSE_CELL_MEMGUARD_SLACK))
+			return trace_error(-EPERM);
+		return memguard_report_slack(arg1);
 	case JAILHOUSE_HC_QOS:
 		return qos_call(arg1, arg2);
+	case JAILHOUSE_HC_QOS_COMPILE:
+		if (cpu_data->public.cell != &root_cell)
+			return trace_error(-EPERM);
+		return qos_compile_call(arg1);
+	case JAILHOUSE_HC_QOS_APPLY:
+		if (cpu_data->public.cell != &root_cell)
+			return trace_error(-EPERM);
+		return qos_apply_call(arg1, arg2);
+	case JAILHOUSE_HC_QOS_QUERY:
+		if (cpu_data->public.cell != &root_cell)
+			return trace_error(-EPERM);
+		return qos_query_call(arg1, arg2);
+	case JAILHOUSE_HC_QOS_SNAPSHOT:
+		if (cpu_data->public.cell != &root_cell)
+			return trace_error(-EPERM);
+		return qos_snapshot_call(arg1, arg2);
+	case JAILHOUSE_HC_QOS_LOOP:
+		if (cpu_data->public.cell != &root_cell)
+			return trace_error(-EPERM);
+		return qos_loop_call(arg1);
+	case JAILHOUSE_HC_CELL_RECOLOR:
+		return cell_recolor(cpu_data, arg1, arg2);
 	case JAILHOUSE_HC_TRANS_DEBUG:
 		test_translation(arg1);
 		return 0;
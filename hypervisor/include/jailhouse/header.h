@@ -70,6 +70,12 @@ struct jailhouse_header {
 	/** Offset of the console page inside the hypervisor memory
 	 * @note Filled at build time. */
 	unsigned long console_page;
+	/** Offset of the MemGuard trace rings inside the hypervisor memory
+	 * @note Filled at build time. */
+	unsigned long memguard_trace;
+	/** Size of the MemGuard trace rings, zero if not supported
+	 * @note Filled at build time. */
+	unsigned long memguard_trace_size;
 	/** Pointer to the first struct gcov_info
 	 * @note Filled at build time */
 	void *gcov_info_head;
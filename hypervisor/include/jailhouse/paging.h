@@ -65,6 +65,13 @@ struct page_pool {
 	unsigned long *used_bitmap;
 	/** Set @c PAGE_SCRUB_ON_FREE to zero-out pages on release. */
 	unsigned long flags;
+	/** Number of cache colors of the pool pages, 0 if uncolored. */
+	unsigned long num_colors;
+	/** Colors allocations are placed in. Bit n stands for the pages
+	 * whose physical page number modulo @c num_colors is n. */
+	unsigned long colors;
+	/** Allocations that had to be placed outside of @c colors. */
+	unsigned long uncolored_allocs;
 };
 
 /**
@@ -91,18 +91,28 @@ static unsigned long find_next_free_page(struct page_pool *pool,
 	return INVALID_PAGE_NR;
 }
 
+static bool page_in_colors(const struct page_pool *pool,
+			   unsigned long page_nr)
+{
+	unsigned long pfn =
+		(paging_hvirt2phys(pool->base_address) >> PAGE_SHIFT) + page_nr;
+
+	return pool->colors & (1UL << (pfn % pool->num_colors));
+}
+
 /**
  * Allocate consecutive pages from the specified pool.
  * @param pool		Page pool to allocate from.
  * @param num		Number of pages.
  * @param align_mask	Choose start so that start_page_no & align_mask == 0.
+ * @param colored	Only use pages in the colors of the pool.
  *
  * @return Pointer to first page or NULL if allocation failed.
  *
  * @see page_free
  */
 static void *page_alloc_internal(struct page_pool *pool, unsigned int num,
-				 unsigned long align_mask)
+				 unsigned long align_mask, bool colored)
 {
 	unsigned long aligned_start, pool_start, next, start, last;
 	unsigned int allocated;
@@ -126,6 +136,11 @@ restart:
 	if ((start - aligned_start) & align_mask)
 		goto restart;
 
+	if (colored && !page_in_colors(pool, start)) {
+		next++;
+		goto restart;
+	}
+
 	for (allocated = 1, last = start; allocated < num;
 	     allocated++, last = next) {
 		next = find_next_free_page(pool, last + 1);
@@ -133,6 +148,10 @@ restart:
 			return NULL;
 		if (next != last + 1)
 			goto restart;	/* not consecutive */
+		if (colored && !page_in_colors(pool, next)) {
+			next++;
+			goto restart;
+		}
 	}
 
 	for (allocated = 0; allocated < num; allocated++)
@@ -143,6 +162,25 @@ restart:
 	return pool->base_address + start * PAGE_SIZE;
 }
 
+/*
+ * Place allocations of colored pools in their colors as long as possible,
+ * falling back to any pages rather than failing.
+ */
+static void *page_alloc_colored(struct page_pool *pool, unsigned int num,
+				unsigned long align_mask)
+{
+	void *pages;
+
+	if (pool->num_colors > 0) {
+		pages = page_alloc_internal(pool, num, align_mask, true);
+		if (pages)
+			return pages;
+		pool->uncolored_allocs++;
+	}
+
+	return page_alloc_internal(pool, num, align_mask, false);
+}
+
 /**
  * Allocate consecutive pages from the specified pool.
  * @param pool	Page pool to allocate from.
@@ -154,7 +192,7 @@ restart:
  */
 void *page_alloc(struct page_pool *pool, unsigned int num)
 {
-	return page_alloc_internal(pool, num, 0);
+	return page_alloc_colored(pool, num, 0);
 }
 
 /**
@@ -168,7 +206,7 @@ void *page_alloc(struct page_pool *pool, unsigned int num)
  */
 void *page_alloc_aligned(struct page_pool *pool, unsigned int num)
 {
-	return page_alloc_internal(pool, num, num - 1);
+	return page_alloc_colored(pool, num, num - 1);
 }
 
 /**
@@ -714,4 +752,7 @@ void paging_dump_stats(const char *when)
 	printk("Page pool usage %s: mem %ld/%ld, remap %ld/%ld\n", when,
 	       mem_pool.used_pages, mem_pool.pages,
 	       remap_pool.used_pages, remap_pool.pages);
+	if (mem_pool.num_colors > 0)
+		printk("Colored mem pool: %ld allocations outside of the "
+		       "hypervisor colors\n", mem_pool.uncolored_allocs);
 }
@@ -21,8 +21,11 @@
 #include <jailhouse/unit.h>
 #include <generated/version.h>
 #include <asm/spinlock.h>
+#include <asm/coloring.h>
 
 extern u8 __text_start[], __page_pool[];
+extern u8 __memguard_trace_start[], __memguard_trace_end[];
+extern u8 __memguard_trace_size[];
 
 static const __attribute__((aligned(PAGE_SIZE))) u8 empty_page[PAGE_SIZE];
 
@@ -73,7 +76,8 @@ static void init_early(unsigned int cpu_id)
 	 * Linux' page table before shutdown without triggering violations.
 	 *
 	 * Allow read access to the console page, if the hypervisor has the
-	 * debug console flag JAILHOUSE_SYS_VIRTUAL_DEBUG_CONSOLE set.
+	 * debug console flag JAILHOUSE_SYS_VIRTUAL_DEBUG_CONSOLE set, and to
+	 * the MemGuard trace rings.
 	 */
 	hyp_phys_start = system_config->hypervisor_memory.phys_start;
 	hyp_phys_end = hyp_phys_start + system_config->hypervisor_memory.size;
@@ -85,6 +89,11 @@ static void init_early(unsigned int cpu_id)
 		if (virtual_console &&
 		    hv_page.virt_start == paging_hvirt2phys(&console))
 			hv_page.phys_start = paging_hvirt2phys(&console);
+		else if (hv_page.virt_start >=
+			 paging_hvirt2phys(__memguard_trace_start) &&
+			 hv_page.virt_start <
+			 paging_hvirt2phys(__memguard_trace_end))
+			hv_page.phys_start = hv_page.virt_start;
 		else
 			hv_page.phys_start = paging_hvirt2phys(empty_page);
 		error = arch_map_memory_region(&root_cell, &hv_page);
@@ -250,8 +259,11 @@ int entry(unsigned int cpu_id, struct per_cpu *cpu_data)
 			activate = true;
 		}
 	} else {
-		while (!error && !activate)
+		/* Lend a hand with the root-cell recoloring meanwhile */
+		while (!error && !activate) {
+			coloring_recolor_assist();
 			cpu_relax();
+		}
 	}
 
 	if (error) {
@@ -276,4 +288,6 @@ hypervisor_header = {
 	.percpu_size = sizeof(struct per_cpu),
 	.entry = arch_entry - JAILHOUSE_BASE,
 	.console_page = (unsigned long)&console - JAILHOUSE_BASE,
+	.memguard_trace = (unsigned long)__memguard_trace_start - JAILHOUSE_BASE,
+	.memguard_trace_size = (unsigned long)__memguard_trace_size,
 };
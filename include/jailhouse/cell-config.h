@@ -50,12 +50,14 @@
  * Incremented on any layout or semantic change of system or cell config.
  * Also update formats and HEADER_REVISION in pyjailhouse/config_parser.py.
  */
-#define JAILHOUSE_CONFIG_REVISION	13
+#define JAILHOUSE_CONFIG_REVISION	19
 
 #define JAILHOUSE_CELL_NAME_MAXLEN	31
 
 #define JAILHOUSE_CELL_PASSIVE_COMMREG	0x00000001
 #define JAILHOUSE_CELL_TEST_DEVICE	0x00000002
+/* The cell may report its slack to the adaptive MemGuard controller */
+#define JAILHOUSE_CELL_MEMGUARD_SLACK	0x00000004
 
 /*
  * The flag JAILHOUSE_CELL_VIRTUAL_CONSOLE_PERMITTED allows inmates to invoke
@@ -101,6 +103,8 @@ struct jailhouse_cell_desc {
 
 	__u64 cpu_reset_address;
     	__u32 num_memory_regions_colored;
+	__u32 num_memguard;
+	__u32 num_qos;
 	__u64 msg_reply_timeout;
 
 	struct jailhouse_console console;
@@ -133,9 +137,55 @@ struct jailhouse_memory {
 	__u64 flags;
 } __attribute__((packed));
 
+/**
+ * Colored memory region. Its pages are taken, in address order, from the
+ * LLC colors in @c colors and, if @c bank_mask is non-zero, from the DRAM
+ * banks in @c banks, skipping all other pages of the physical range.
+ */
 struct jailhouse_memory_colored {
 	struct jailhouse_memory memory;
 	__u64 colors;
+	/** Physical address bits forming the DRAM bank number, LSB first,
+	 * or 0 to ignore banks. Only bits 12 to 21 are allowed. */
+	__u64 bank_mask;
+	/** Bitmap of the DRAM bank numbers the region may use. */
+	__u64 banks;
+} __attribute__((packed));
+
+#define JAILHOUSE_MAX_BANK_BITS		6
+
+/**
+ * MemGuard budget of a cell CPU. It is armed whenever the CPU is reset,
+ * i.e. on cell start and on PSCI CPU_ON.
+ */
+struct jailhouse_memguard {
+	/** CPU ID, as used in the cell's CPU set. */
+	__u32 cpu;
+	/** MGF_* flags, see memguard-common.h. */
+	__u32 flags;
+	/** Regulation period in microseconds. */
+	__u32 budget_time;
+	/** PMU event to regulate, 0 selects L2 refills. */
+	__u32 event;
+	/** Number of events allowed per period. */
+	__u64 budget_memory;
+} __attribute__((packed));
+
+#define JAILHOUSE_QOS_DEV_NAMELEN	15
+#define JAILHOUSE_QOS_PARAM_NAMELEN	16
+
+/**
+ * Interconnect QoS setting of a cell, see the qos command of the jailhouse
+ * tool for the names. The profile is applied on cell start and withdrawn on
+ * cell destruction. Profiles of all running cells are combined, cells
+ * created later take precedence over the root cell and earlier cells.
+ */
+struct jailhouse_qos {
+	/** Device name, empty to continue with the previous one. */
+	char dev_name[JAILHOUSE_QOS_DEV_NAMELEN];
+	char param_name[JAILHOUSE_QOS_PARAM_NAMELEN];
+	__u8 padding;
+	__u32 value;
 } __attribute__((packed));
 
 #define JAILHOUSE_SHMEM_NET_REGIONS(start, dev_id)			\
@@ -292,6 +342,9 @@ struct jailhouse_pio {
 
 #define JAILHOUSE_SYSTEM_SIGNATURE	"JHSYST"
 
+/* Number of CPUs that can have a PMU interrupt for MemGuard */
+#define JAILHOUSE_MAX_PMU_IRQS		8
+
 /*
  * The flag JAILHOUSE_SYS_VIRTUAL_DEBUG_CONSOLE allows the root cell to read
  * from the virtual console.
@@ -336,6 +389,25 @@ struct jailhouse_system {
 				u64 gich_base;
 				u64 gicv_base;
 				u64 gicr_base;
+				/** MemGuard: EL2 physical timer PPI, 0 if
+				 * bandwidth regulation is not supported. */
+				u8 memguard_timer_irq;
+				/** Implemented GIC priority bits, 0 to probe. */
+				u8 gic_priority_bits;
+				/** MemGuard: PMU overflow interrupt of each
+				 * CPU, 0 for CPUs without regulation. */
+				u16 memguard_pmu_irqs[JAILHOUSE_MAX_PMU_IRQS];
+				/** Cache colors of the hypervisor code and
+				 * page pool, same layout as
+				 * jailhouse_memory_colored::colors: with N
+				 * colors, bit N-1-n selects color n. 0 leaves
+				 * the hypervisor memory uncolored. */
+				u64 hypervisor_colors;
+				/** Cache level used for coloring, 0 for the
+				 * last unified level. The number of colors
+				 * is that of the cluster with the smallest
+				 * cache way at this level. */
+				u8 coloring_cache_level;
 			} __attribute__((packed)) arm;
 		} __attribute__((packed));
 	} __attribute__((packed)) platform_info;
@@ -354,7 +426,9 @@ jailhouse_cell_config_size(struct jailhouse_cell_desc *cell)
 		cell->num_pio_regions * sizeof(struct jailhouse_pio) +
 		cell->num_pci_devices * sizeof(struct jailhouse_pci_device) +
 		cell->num_pci_caps * sizeof(struct jailhouse_pci_capability) +
-		cell->num_stream_ids * sizeof(__u32);
+		cell->num_stream_ids * sizeof(__u32) +
+		cell->num_memguard * sizeof(struct jailhouse_memguard) +
+		cell->num_qos * sizeof(struct jailhouse_qos);
 }
 
 static inline __u32
@@ -433,4 +507,20 @@ jailhouse_cell_stream_ids(const struct jailhouse_cell_desc *cell)
 		cell->num_pci_caps * sizeof(struct jailhouse_pci_capability));
 }
 
+static inline const struct jailhouse_memguard *
+jailhouse_cell_memguard(const struct jailhouse_cell_desc *cell)
+{
+	return (const struct jailhouse_memguard *)
+		((void *)jailhouse_cell_stream_ids(cell) +
+		 cell->num_stream_ids * sizeof(__u32));
+}
+
+static inline const struct jailhouse_qos *
+jailhouse_cell_qos(const struct jailhouse_cell_desc *cell)
+{
+	return (const struct jailhouse_qos *)
+		((void *)jailhouse_cell_memguard(cell) +
+		 cell->num_memguard * sizeof(struct jailhouse_memguard));
+}
+
 #endif /* !_JAILHOUSE_CELL_CONFIG_H */
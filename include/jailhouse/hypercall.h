@@ -54,6 +54,26 @@
 #define JAILHOUSE_HC_MEMGUARD			10
 #define JAILHOUSE_HC_QOS			11
 #define JAILHOUSE_HC_TRANS_DEBUG		12
+#define JAILHOUSE_HC_MEMGUARD_SLACK		13
+#define JAILHOUSE_HC_CELL_RECOLOR		14
+#define JAILHOUSE_HC_QOS_COMPILE		15
+#define JAILHOUSE_HC_QOS_APPLY			16
+#define JAILHOUSE_HC_QOS_QUERY			17
+#define JAILHOUSE_HC_QOS_SNAPSHOT		18
+#define JAILHOUSE_HC_QOS_LOOP			19
+
+/* Parameters of JAILHOUSE_HC_CELL_RECOLOR */
+struct jailhouse_recolor_params {
+	/** Index of the colored memory region in the cell config. */
+	__u32 region;
+	/** JAILHOUSE_RECOLOR_* flags. */
+	__u32 flags;
+	/** New color mask of the region. */
+	__u64 colors;
+};
+
+/* Continue the pending recoloring of the cell instead of starting one */
+#define JAILHOUSE_RECOLOR_CONTINUE		0x0001
 
 /* Hypervisor information type */
 #define JAILHOUSE_INFO_MEM_POOL_SIZE		0
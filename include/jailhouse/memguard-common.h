@@ -13,10 +13,111 @@
 #ifndef _JAILHOUSE_MEMGUARD_COMMON_H
 #define _JAILHOUSE_MEMGUARD_COMMON_H
 
+/* Memguard flags */
+#define MGF_PERIODIC      (1 << 0) /* Chooses between periodic or one-shot budget replenishment */
+#define MGF_MASK_INT      (1 << 1) /* Mask (disable) low priority interrupts until next memguard call */
+#define MGF_RECLAIM       (1 << 2) /* Donate unused budget to, and reclaim from, a global pool */
+#define MGF_SYNC          (1 << 3) /* Align periods to a system-wide epoch */
+#define MGF_BUCKET        (1 << 4) /* Carry unused budget over, up to event_burst */
+#define MGF_ADAPTIVE      (1 << 5) /* Scale budgets with the slack of the RT cell */
+
+/* Range of the slack reported with JAILHOUSE_HC_MEMGUARD_SLACK, in
+ * per-mille of the reporting cell's period (negative: deadline miss) */
+#define MEMGUARD_SLACK_MIN	-1000
+#define MEMGUARD_SLACK_MAX	1000
+
+/* Number of PMU counters reserved by MemGuard on each core */
+#define MEMGUARD_MAX_EVENTS	3
+
+/* ARMv8 common PMU events that are useful for bandwidth regulation */
+#define MEMGUARD_EVT_L2_REFILL		0x17
+#define MEMGUARD_EVT_L2_WB		0x18
+#define MEMGUARD_EVT_BUS_ACCESS		0x19
+
+/* Profiling data of the phase that a memguard call ends, never saturated */
+struct memguard_stats {
+	/* Time since the preceding call */
+	unsigned long elapsed_ns;
+	/* Number of times the core got throttled */
+	unsigned long throttle_count;
+	/* Total and longest time spent throttled */
+	unsigned long blocked_ns;
+	unsigned long max_blocked_ns;
+	/* Same overrun flags as the MGRET_OVER_* bits of the return value */
+	unsigned long overrun;
+	/* Budget scale reached by the adaptive controller, per-mille */
+	unsigned long budget_scale;
+};
+
 struct memguard_params {
 	unsigned long budget_time;
 	unsigned long budget_memory;
 	unsigned long flags;
+	/*
+	 * Per-counter regulation. When num_events is zero, a single
+	 * counter tracks L2 refills against budget_memory. Otherwise,
+	 * counter i counts event_type[i] against event_budget[i] and a
+	 * zero budget leaves the counter unused.
+	 */
+	unsigned long num_events;
+	unsigned long event_type[MEMGUARD_MAX_EVENTS];
+	unsigned long event_budget[MEMGUARD_MAX_EVENTS];
+	/*
+	 * With MGF_BUCKET, depth of the token bucket of counter i (also
+	 * used by the single counter when num_events is zero). Unused
+	 * budget accumulates across periods up to this many events. A
+	 * depth below the budget disables accumulation.
+	 */
+	unsigned long event_burst[MEMGUARD_MAX_EVENTS];
+	/*
+	 * With MGF_ADAPTIVE, bounds of the scale applied to all budgets,
+	 * in per-mille of the budgets given above. The scale starts at
+	 * 1000 (clamped to the bounds).
+	 */
+	unsigned long adapt_min;
+	unsigned long adapt_max;
+	/*
+	 * Filled by the hypervisor for every counter in use, statistics
+	 * since the last call: events counted, budget donated to the
+	 * global pool and budget reclaimed from it (see MGF_RECLAIM), and
+	 * the tokens left in the bucket (see MGF_BUCKET).
+	 */
+	unsigned long event_count[MEMGUARD_MAX_EVENTS];
+	unsigned long event_donated[MEMGUARD_MAX_EVENTS];
+	unsigned long event_reclaimed[MEMGUARD_MAX_EVENTS];
+	unsigned long event_tokens[MEMGUARD_MAX_EVENTS];
+	/* Filled by the hypervisor, event_count holds the event totals */
+	struct memguard_stats stats;
+};
+
+/* Number of CPUs and of periods per CPU kept by the trace rings */
+#define MEMGUARD_TRACE_CPUS	8
+#define MEMGUARD_TRACE_RECORDS	64
+
+#define MEMGUARD_TRACE_THROTTLED	(1 << 0)
+
+/* Statistics of one regulation period, times in system counter ticks */
+struct memguard_trace_record {
+	/* End of the period */
+	__u64 timestamp;
+	__u64 events[MEMGUARD_MAX_EVENTS];
+	/* Time spent throttled in memguard_block_if_needed() */
+	__u64 blocked_time;
+	__u32 flags;
+	__u32 padding;
+};
+
+/*
+ * Per-CPU ring of period records, written by the hypervisor and mapped
+ * read-only into the root cell. head counts the records written so far,
+ * the latest one being at (head - 1) % MEMGUARD_TRACE_RECORDS. A record
+ * is only valid if head did not advance by MEMGUARD_TRACE_RECORDS or
+ * more while it was read.
+ */
+struct memguard_trace_ring {
+	volatile __u32 head;
+	__u32 timer_freq;
+	struct memguard_trace_record records[MEMGUARD_TRACE_RECORDS];
 };
 
 #endif /* _JAILHOUSE_MEMGUARD_COMMON_H */
@@ -22,4 +22,58 @@ struct qos_setting {
 	__u32 value;
 };
 
+/* Max. number of register writes of a compiled QoS configuration or of
+ * a snapshot */
+#define QOS_MAX_OPS        512
+
+/* Max. number of settings returned by a QoS query, one per device and
+ * parameter plus the QOS_CNTL register of each device */
+#define QOS_MAX_QUERY      512
+
+/* Parameter name reporting the raw QOS_CNTL register in a query */
+#define QOS_CNTL_NAME      "qos_cntl"
+
+/* Register write of a compiled QoS configuration. The bits in mask are
+ * replaced by those in value, a full mask writes the register without
+ * reading it first. */
+struct qos_op {
+	__u32 offset;	/* From the base of the interconnect */
+	__u32 mask;
+	__u32 value;
+};
+
+/* Parameters of JAILHOUSE_HC_QOS_COMPILE. Addresses are physical. */
+struct qos_compile_params {
+	__u32 num_settings;
+	/* Capacity of the ops array */
+	__u32 max_ops;
+	__u64 settings_address;
+	__u64 ops_address;
+};
+
+/* Max. number of parameters driven by the QoS control loop */
+#define QOS_LOOP_MAX_SETTINGS 16
+
+/* Parameter driven by the QoS control loop. It moves from the relaxed to
+ * the strict value in equal steps while the slack of the real-time cell
+ * is short, and back while the slack is ample. */
+struct qos_loop_setting {
+	char dev_name [QOS_DEV_NAMELEN];
+	char param_name [QOS_PARAM_NAMELEN];
+	__u32 relaxed;
+	__u32 strict;
+};
+
+/* Parameters of JAILHOUSE_HC_QOS_LOOP. No settings stop the loop. */
+struct qos_loop_params {
+	__u32 num_settings;
+	/* Number of steps between relaxed and strict values */
+	__u32 steps;
+	/* Slack thresholds, see JAILHOUSE_HC_MEMGUARD_SLACK */
+	__s32 slack_low;
+	__s32 slack_high;
+	/* Physical address of a struct qos_loop_setting array */
+	__u64 settings_address;
+};
+
 #endif /* _JAILHOUSE_QOS_COMMON_H */
@@ -20,7 +20,7 @@ import struct
 from .extendedenum import ExtendedEnum
 
 # Keep the whole file in sync with include/jailhouse/cell-config.h.
-_CONFIG_REVISION = 13
+_CONFIG_REVISION = 19
 
 
 def flag_str(enum_class, value, separator=' | '):
@@ -105,7 +105,7 @@ class MemRegion:
             self.virt_address_in_region(region.virt_start)
 
 class MemRegionColored:
-    _REGION_FORMAT = 'QQQQQ'
+    _REGION_FORMAT = 'QQQQQQQ'
     SIZE = struct.calcsize(_REGION_FORMAT)
 
     def __init__(self, region_struct):
@@ -113,7 +113,9 @@ class MemRegionColored:
          self.virt_start,
          self.size,
          self.flags,
-         self.colors) = \
+         self.colors,
+         self.bank_mask,
+         self.banks) = \
             struct.unpack_from(MemRegionColored._REGION_FORMAT, region_struct)
 
     def __str__(self):
@@ -121,7 +123,9 @@ class MemRegionColored:
                ("  virt_start: 0x%016x\n" % self.virt_start) + \
                ("  size:       0x%016x\n" % self.size) + \
                ("  flags:      " + flag_str(JAILHOUSE_MEM, self.flags)) + "\n" + \
-               ("  colors:     0x%016x\n" % self.colors)
+               ("  colors:     0x%016x\n" % self.colors) + \
+               ("  bank_mask:  0x%016x\n" % self.bank_mask) + \
+               ("  banks:      0x%016x\n" % self.banks)
 
     def is_ram(self):
         return ((self.flags & (JAILHOUSE_MEM.READ |
@@ -159,6 +163,23 @@ class MemRegionColored:
         return region.virt_address_in_region(self.virt_start) or \
             self.virt_address_in_region(region.virt_start)
 
+    def bank_partition_valid(self):
+        if self.bank_mask == 0:
+            return True
+        bits = bin(self.bank_mask).count('1')
+        return (self.bank_mask & ~0x3ff000) == 0 and bits <= 6 and \
+            (self.banks & ((1 << bits) - 1)) != 0
+
+    def partition_overlaps(self, region):
+        if not self.phys_overlaps(region):
+            return False
+        if (self.colors & region.colors) == 0:
+            return False
+        # Banks only separate regions that number them the same way
+        if self.bank_mask != 0 and self.bank_mask == region.bank_mask:
+            return (self.banks & region.banks) != 0
+        return True
+
 
 class CacheRegion:
     _REGION_FORMAT = 'IIBxH'
@@ -191,7 +212,7 @@ class PIORegion:
 
 
 class CellConfig:
-    _HEADER_FORMAT = '=6sH32s4xIIIIIIIIIIQI8x32x'
+    _HEADER_FORMAT = '=6sH32s4xIIIIIIIIIIQIII8x32x'
 
     def __init__(self, data, root_cell=False):
         self.data = data
@@ -211,7 +232,9 @@ class CellConfig:
              self.num_stream_ids,
              self.vpci_irq_base,
              self.cpu_reset_address,
-             self.num_memory_regions_colored) = \
+             self.num_memory_regions_colored,
+             self.num_memguard,
+             self.num_qos) = \
                 struct.unpack_from(CellConfig._HEADER_FORMAT, self.data)
             if not root_cell:
                 if str(signature.decode()) != 'JHCELL':
@@ -257,7 +280,7 @@ class CellConfig:
 class SystemConfig:
     _HEADER_FORMAT = '=6sH4x'
     # ...followed by MemRegion as hypervisor memory
-    _CONSOLE_AND_PLATFORM_FORMAT = '32x12x224x44x'
+    _CONSOLE_AND_PLATFORM_FORMAT = '=32x12x224x62xQx'
 
     def __init__(self, data):
         self.data = data
@@ -276,6 +299,9 @@ class SystemConfig:
             self.hypervisor_memory = MemRegion(self.data[offs:])
 
             offs += struct.calcsize(MemRegion._REGION_FORMAT)
+            (self.hypervisor_colors,) = \
+                struct.unpack_from(SystemConfig._CONSOLE_AND_PLATFORM_FORMAT,
+                                   self.data, offs)
             offs += struct.calcsize(SystemConfig._CONSOLE_AND_PLATFORM_FORMAT)
         except struct.error:
             raise RuntimeError('Not a root cell configuration')
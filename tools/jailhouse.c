@@ -76,7 +76,21 @@ static void __attribute__((noreturn)) help(char *prog, int exit_status)
 	       "   cell start { ID | [--name] NAME }\n"
 	       "   cell shutdown { ID | [--name] NAME }\n"
 	       "   cell destroy { ID | [--name] NAME }\n"
-	       "   cell memguard { ID | [--name] NAME } period_ms budget_trans\n",
+	       "   cell memguard { ID | [--name] NAME } period_ms "
+				"budget_trans[/burst]\n"
+	       "                 [EVENT=BUDGET[/BURST] ...] "
+				"[adapt=MIN:MAX]\n"
+	       "   cell recolor { ID | [--name] NAME } REGION COLORS\n"
+	       "   qos { disable | DEVICE:PARAM=VALUE[,PARAM=VALUE...] ... }\n"
+	       "   qos compile FILE DEVICE:PARAM=VALUE[,PARAM=VALUE...] ...\n"
+	       "   qos apply FILE\n"
+	       "   qos query\n"
+	       "   qos snapshot FILE\n"
+	       "   qos restore FILE\n"
+	       "   qos loop { disable | STEPS SLACK_LOW SLACK_HIGH "
+	       "RELAXED_SETTINGS... -- STRICT_SETTINGS... }\n"
+	       "             (advanced by the MemGuard period of a root cell "
+	       "CPU)\n",
 	       basename(prog));
 	for (ext = extensions; ext->cmd; ext++)
 		printf("   %s %s %s\n", ext->cmd, ext->subcmd, ext->help);
@@ -139,6 +153,26 @@ static void *read_string(const char *string, size_t *size)
 	return buffer;
 }
 
+static int open_image(const char *name, size_t *size)
+{
+	struct stat stat;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "opening %s: %s\n", name, strerror(errno));
+		exit(1);
+	}
+
+	if (fstat(fd, &stat) < 0) {
+		perror("fstat");
+		exit(1);
+	}
+
+	*size = stat.st_size;
+	return fd;
+}
+
 static void *read_file(const char *name, size_t *size)
 {
 	struct stat stat;
@@ -431,10 +465,13 @@ static int cell_shutdown_load(int argc, char *argv[],
 			image->source_address =
 				(unsigned long)read_string(argv[arg_num++],
 							   &size);
+			image->flags = 0;
+			image->fd = -1;
 		} else {
-			image->source_address =
-				(unsigned long)read_file(argv[arg_num++],
-							 &size);
+			/* Let the driver read the file itself */
+			image->source_address = 0;
+			image->fd = open_image(argv[arg_num++], &size);
+			image->flags = JAILHOUSE_IMAGE_FROM_FD;
 		}
 		image->size = size;
 		image->target_address = 0;
@@ -458,7 +495,10 @@ static int cell_shutdown_load(int argc, char *argv[],
 
 	close(fd);
 	for (n = 0, image = cell_load->image; n < images; n++, image++)
-		free((void *)(unsigned long)image->source_address);
+		if (image->flags & JAILHOUSE_IMAGE_FROM_FD)
+			close(image->fd);
+		else
+			free((void *)(unsigned long)image->source_address);
 	free(cell_load);
 
 	return err;
@@ -488,61 +528,235 @@ static int cell_simple_cmd(int argc, char *argv[], unsigned int command)
 	return err;
 }
 
+static const struct {
+	const char *name;
+	unsigned long event;
+} memguard_events[] = {
+	{ "l2_refill", MEMGUARD_EVT_L2_REFILL },
+	{ "l2_wb", MEMGUARD_EVT_L2_WB },
+	{ "bus_access", MEMGUARD_EVT_BUS_ACCESS },
+	{ NULL }
+};
+
+/* Parse BUDGET[/BURST], a burst turns the budget into a token bucket */
+static int parse_memguard_budget(const char *arg, unsigned long *budget,
+				 unsigned long *burst)
+{
+	char *end;
+
+	*budget = strtoul(arg, &end, 0);
+	if (*end == '/')
+		*burst = strtoul(end + 1, &end, 0);
+
+	return *end == '\0' ? 0 : -EINVAL;
+}
+
+/* Parse an EVENT=BUDGET[/BURST] argument, EVENT being a name or a raw
+ * PMU event number */
+static int parse_memguard_event(char *arg, unsigned long *event,
+				unsigned long *budget, unsigned long *burst)
+{
+	char *sep = strchr(arg, '=');
+	unsigned int n;
+	char *end;
+
+	if (!sep)
+		return -EINVAL;
+	*sep = '\0';
+
+	for (n = 0; memguard_events[n].name; n++)
+		if (strcmp(arg, memguard_events[n].name) == 0)
+			break;
+
+	if (memguard_events[n].name) {
+		*event = memguard_events[n].event;
+	} else {
+		*event = strtoul(arg, &end, 0);
+		if (end == arg || *end != '\0')
+			return -EINVAL;
+	}
+
+	return parse_memguard_budget(sep + 1, budget, burst);
+}
+
+/* Parse adapt=MIN:MAX, the budget scale range in per-mille */
+static int parse_memguard_adapt(const char *arg,
+				struct memguard_params *params)
+{
+	char *end;
+
+	if (strncmp(arg, "adapt=", 6) != 0)
+		return -ENOENT;
+
+	params->adapt_min = strtoul(arg + 6, &end, 0);
+	if (*end != ':')
+		return -EINVAL;
+	params->adapt_max = strtoul(end + 1, &end, 0);
+
+	return *end == '\0' ? 0 : -EINVAL;
+}
+
+/* Statistics of the phase that the call ended, per CPU of the cell */
+static void memguard_print_results(const struct jailhouse_memguard_result *res,
+				   unsigned int count)
+{
+	const struct memguard_params *params;
+	unsigned int n, i, events;
+
+	for (n = 0; n < count; n++, res++) {
+		params = &res->params;
+		printf("CPU %u: %lu ns, throttled %lu times for %lu ns "
+		       "(max %lu ns)%s, budget scale %lu\n", res->cpu,
+		       params->stats.elapsed_ns, params->stats.throttle_count,
+		       params->stats.blocked_ns, params->stats.max_blocked_ns,
+		       params->stats.overrun ? ", overrun" : "",
+		       params->stats.budget_scale);
+
+		events = params->num_events ? : 1;
+		for (i = 0; i < events && i < MEMGUARD_MAX_EVENTS; i++)
+			printf("   event %u: count %lu, donated %lu, "
+			       "reclaimed %lu, tokens %lu\n", i,
+			       params->event_count[i], params->event_donated[i],
+			       params->event_reclaimed[i],
+			       params->event_tokens[i]);
+	}
+}
+
 static int cell_memguard_cmd(int argc, char *argv[], unsigned int command)
 {
+	struct jailhouse_memguard_result *results;
 	struct jailhouse_cell_id cell_id;
 	struct jailhouse_memguard_args * mg_args;
-	int id_args, err, fd;
+	int id_args, err, fd, arg;
+	bool adaptive = false;
+	unsigned long n;
 
 	id_args = parse_cell_id(&cell_id, argc - 3, &argv[3]);
-	if (id_args == 0 || 5 + id_args != argc)
+	if (id_args == 0 || 5 + id_args > argc ||
+	    6 + id_args + MEMGUARD_MAX_EVENTS < argc)
 		help(argv[0], 1);
 
-	mg_args = (struct jailhouse_memguard_args *)malloc(sizeof(struct jailhouse_memguard_args));
+	mg_args = (struct jailhouse_memguard_args *)calloc(1, sizeof(struct jailhouse_memguard_args));
 	if (!mg_args) {
 		fprintf(stderr, "insufficient memory\n");
 		exit(1);
 	}
 	mg_args->cell_id = cell_id;
-	mg_args->params.budget_time = strtoul(argv[4], NULL, 0);
-	mg_args->params.budget_memory = strtoul(argv[5], NULL, 0);
+	mg_args->params.budget_time = strtoul(argv[3 + id_args], NULL, 0);
+	if (parse_memguard_budget(argv[4 + id_args],
+				  &mg_args->params.budget_memory,
+				  &mg_args->params.event_burst[0]))
+		help(argv[0], 1);
 
-	if (mg_args->params.budget_time == 0 && mg_args->params.budget_memory == 0)
+	for (arg = 5 + id_args; arg < argc; arg++) {
+		err = parse_memguard_adapt(argv[arg], &mg_args->params);
+		if (err == 0) {
+			adaptive = true;
+			continue;
+		} else if (err != -ENOENT ||
+			   mg_args->params.num_events == MEMGUARD_MAX_EVENTS) {
+			help(argv[0], 1);
+		}
+
+		n = mg_args->params.num_events++;
+		/* budget_trans[/burst] only applies without events */
+		mg_args->params.event_burst[n] = 0;
+		if (parse_memguard_event(argv[arg],
+					 &mg_args->params.event_type[n],
+					 &mg_args->params.event_budget[n],
+					 &mg_args->params.event_burst[n]))
+			help(argv[0], 1);
+	}
+
+	if (mg_args->params.budget_time == 0 && mg_args->params.budget_memory == 0
+	    && mg_args->params.num_events == 0)
 	    mg_args->params.flags = 0;
 	else
 	    mg_args->params.flags = 1; //MGF_PERIODIC;
+
+	for (n = 0; n < MEMGUARD_MAX_EVENTS; n++)
+		if (mg_args->params.flags && mg_args->params.event_burst[n])
+			mg_args->params.flags |= MGF_BUCKET;
+	if (mg_args->params.flags && adaptive)
+		mg_args->params.flags |= MGF_ADAPTIVE;
 	
+	mg_args->max_results = sysconf(_SC_NPROCESSORS_CONF);
+	results = calloc(mg_args->max_results, sizeof(*results));
+	if (!results) {
+		fprintf(stderr, "insufficient memory\n");
+		exit(1);
+	}
+	mg_args->results = (unsigned long)results;
+
 	fd = open_dev();
 
+	/* On success, the number of CPUs of the cell is returned */
 	err = ioctl(fd, command, mg_args);
-	if (err)
+	if (err < 0)
 		perror("JAILHOUSE_CELL_MEMGUARD");
+	else
+		memguard_print_results(results,
+				       err < mg_args->max_results ?
+				       err : mg_args->max_results);
+
+	close(fd);
+	free(results);
+	free(mg_args);
+
+	return err < 0 ? err : 0;
+}
+
+static int cell_recolor_cmd(int argc, char *argv[])
+{
+	struct jailhouse_cell_recolor recolor;
+	int id_args, err, fd;
+	char *endp;
+
+	memset(&recolor, 0, sizeof(recolor));
+
+	id_args = parse_cell_id(&recolor.cell_id, argc - 3, &argv[3]);
+	if (id_args == 0 || 5 + id_args != argc)
+		help(argv[0], 1);
+
+	errno = 0;
+	recolor.region = strtoul(argv[3 + id_args], &endp, 0);
+	if (errno != 0 || *endp != 0)
+		help(argv[0], 1);
+	recolor.colors = strtoull(argv[4 + id_args], &endp, 0);
+	if (errno != 0 || *endp != 0 || recolor.colors == 0)
+		help(argv[0], 1);
+
+	fd = open_dev();
+
+	err = ioctl(fd, JAILHOUSE_CELL_RECOLOR, &recolor);
+	if (err)
+		perror("JAILHOUSE_CELL_RECOLOR");
 
 	close(fd);
 
 	return err;
 }
 
-static int qos_cmd(int argc, char *argv[], unsigned int command)
+static struct jailhouse_qos_args *qos_parse_settings(int argc, char *argv[],
+						     int first)
 {
-	/* The format of a command to set qos parameters is the
-	 * following:
+	/* The format of a list of qos parameters is the following:
 	 *
-	 * jailhouse qos dev1:param1=value,param2=value dev2:param1=value,param2=value ...
+	 * dev1:param1=value,param2=value dev2:param1=value,param2=value ...
 	 *
 	 * device names and parameter names are defined in qos.c
 	 */
 
 	struct jailhouse_qos_args * qos_args;       
 	unsigned int count = 0;
-	int i, fd, err;
+	int i;
 
-	if (argc <= 2)
-		return -EINVAL;
+	if (argc <= first)
+		return NULL;
 	
 	/* First off, let's understand how many parameters need to be
 	 * passed */
-	for (i = 2; i < argc; ++i) {
+	for (i = first; i < argc; ++i) {
 		char * cmdarg = argv[i]-1;
 		do {
 			++count;
@@ -555,28 +769,32 @@ static int qos_cmd(int argc, char *argv[], unsigned int command)
 	/* Allocate all the memory we need */
 	qos_args = (struct jailhouse_qos_args *)malloc(sizeof(struct jailhouse_qos_args)
 						       + count * sizeof(struct qos_setting));
+	if (!qos_args) {
+		fprintf(stderr, "insufficient memory\n");
+		exit(1);
+	}
 
 	qos_args->num_settings = count;
 
 	struct qos_setting * cur_set = &qos_args->settings[0];
 	
 	/* Is this a disable command? */
-	if (strncmp("disable", argv[2], 8) == 0) {
+	if (strncmp("disable", argv[first], 8) == 0) {
 		strcpy(cur_set->dev_name, "disable");
 		cur_set->param_name[0] = '\0';
 		cur_set->value = 0;
 		qos_args->num_settings = 1;
-		goto apply_settings;
+		return qos_args;
 	}
 	
 	/* Build list of parameters */
-	for (i = 2; i < argc; ++i) {
+	for (i = first; i < argc; ++i) {
 		char * start = argv[i];
 		char * end;
 		
 		/* Indicate that this is the first parameter for this
 		 * device*/
-		int first = 1;
+		int first_param = 1;
 		
 		end = strchr(start, ':');
 		if (!end) 
@@ -612,8 +830,8 @@ static int qos_cmd(int argc, char *argv[], unsigned int command)
 			
 			/* Set the device name to empty if this is not
 			 * the first paramter for this device */
-			if(first) {
-				first = 0;
+			if(first_param) {
+				first_param = 0;
 			} else {
 				cur_set->dev_name[0] = '\0';
 			}
@@ -628,7 +846,265 @@ static int qos_cmd(int argc, char *argv[], unsigned int command)
 		} while(1);		
 	}
 
-apply_settings:
+	return qos_args;
+
+exit_err:
+	free(qos_args);
+exit_noalloc:
+	fprintf(stderr, "QoS: Invalid list of parameters.\n");
+	return NULL;
+}
+
+static int qos_write_ops(const char *name, const struct qos_op *ops,
+			 unsigned int count)
+{
+	int out;
+
+	out = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		fprintf(stderr, "opening %s: %s\n", name, strerror(errno));
+		return -errno;
+	}
+	if (write(out, ops, sizeof(struct qos_op) * count) < 0) {
+		fprintf(stderr, "writing %s: %s\n", name, strerror(errno));
+		close(out);
+		return -errno;
+	}
+	close(out);
+
+	return 0;
+}
+
+/* Resolve settings once into register writes and store them in a file */
+static int qos_compile_cmd(int argc, char *argv[])
+{
+	struct jailhouse_qos_args *qos_args;
+	struct jailhouse_qos_compile compile;
+	struct qos_op ops[QOS_MAX_OPS];
+	int err, fd;
+
+	if (argc < 5)
+		help(argv[0], 1);
+
+	qos_args = qos_parse_settings(argc, argv, 4);
+	if (!qos_args)
+		return -EINVAL;
+
+	compile.num_settings = qos_args->num_settings;
+	compile.max_ops = QOS_MAX_OPS;
+	compile.settings = (unsigned long)qos_args->settings;
+	compile.ops = (unsigned long)ops;
+
+	fd = open_dev();
+	err = ioctl(fd, JAILHOUSE_QOS_COMPILE, &compile);
+	if (err < 0)
+		perror("JAILHOUSE_QOS_COMPILE");
+	close(fd);
+	free(qos_args);
+
+	if (err < 0)
+		return err;
+
+	return qos_write_ops(argv[3], ops, err);
+}
+
+/* Perform the register writes stored by qos_compile_cmd or
+ * qos_snapshot_cmd */
+static int qos_apply_cmd(int argc, char *argv[])
+{
+	struct jailhouse_qos_apply apply;
+	size_t size;
+	int err, fd;
+
+	if (argc != 4)
+		help(argv[0], 1);
+
+	apply.ops = (unsigned long)read_file(argv[3], &size);
+	if (size == 0 || size % sizeof(struct qos_op) != 0) {
+		fprintf(stderr, "QoS: %s is not a list of register writes.\n",
+			argv[3]);
+		free((void *)(unsigned long)apply.ops);
+		return -EINVAL;
+	}
+	apply.num_ops = size / sizeof(struct qos_op);
+	apply.padding = 0;
+
+	fd = open_dev();
+	err = ioctl(fd, JAILHOUSE_QOS_APPLY, &apply);
+	if (err)
+		perror("JAILHOUSE_QOS_APPLY");
+	close(fd);
+	free((void *)(unsigned long)apply.ops);
+
+	return err;
+}
+
+/* Print the decoded value of every QoS parameter of every device */
+static int qos_query_cmd(int argc, char *argv[])
+{
+	struct qos_setting settings[QOS_MAX_QUERY];
+	struct jailhouse_qos_readback readback;
+	int err, fd, n;
+
+	if (argc != 3)
+		help(argv[0], 1);
+
+	readback.max_entries = QOS_MAX_QUERY;
+	readback.padding = 0;
+	readback.buffer = (unsigned long)settings;
+
+	fd = open_dev();
+	err = ioctl(fd, JAILHOUSE_QOS_QUERY, &readback);
+	if (err < 0)
+		perror("JAILHOUSE_QOS_QUERY");
+	close(fd);
+
+	if (err < 0)
+		return err;
+
+	printf("%-15s %-16s %s\n", "Device", "Parameter", "Value");
+	for (n = 0; n < err; n++)
+		printf("%-15.*s %-16.*s 0x%x\n",
+		       QOS_DEV_NAMELEN, settings[n].dev_name,
+		       QOS_PARAM_NAMELEN, settings[n].param_name,
+		       settings[n].value);
+
+	return 0;
+}
+
+/* Save the QoS registers in a file that qos_apply_cmd can restore */
+static int qos_snapshot_cmd(int argc, char *argv[])
+{
+	struct jailhouse_qos_readback readback;
+	struct qos_op ops[QOS_MAX_OPS];
+	int err, fd;
+
+	if (argc != 4)
+		help(argv[0], 1);
+
+	readback.max_entries = QOS_MAX_OPS;
+	readback.padding = 0;
+	readback.buffer = (unsigned long)ops;
+
+	fd = open_dev();
+	err = ioctl(fd, JAILHOUSE_QOS_SNAPSHOT, &readback);
+	if (err < 0)
+		perror("JAILHOUSE_QOS_SNAPSHOT");
+	close(fd);
+
+	if (err < 0)
+		return err;
+
+	return qos_write_ops(argv[3], ops, err);
+}
+
+/* Configure the hypervisor QoS control loop. The relaxed and strict
+ * settings must name the same parameters in the same order. */
+static int qos_loop_cmd(int argc, char *argv[])
+{
+	struct qos_loop_setting settings[QOS_LOOP_MAX_SETTINGS];
+	struct jailhouse_qos_args *relaxed = NULL, *strict = NULL;
+	struct jailhouse_qos_loop loop;
+	unsigned int n;
+	int sep, err, fd;
+	char *endp;
+
+	memset(&loop, 0, sizeof(loop));
+	loop.settings = (unsigned long)settings;
+
+	if (argc == 4 && strcmp(argv[3], "disable") == 0)
+		goto configure;
+
+	for (sep = 6; sep < argc; sep++)
+		if (strcmp(argv[sep], "--") == 0)
+			break;
+	if (sep == 6 || sep >= argc - 1)
+		help(argv[0], 1);
+
+	errno = 0;
+	loop.steps = strtoul(argv[3], &endp, 0);
+	if (errno != 0 || *endp != 0 || loop.steps == 0)
+		help(argv[0], 1);
+	loop.slack_low = strtol(argv[4], &endp, 0);
+	if (errno != 0 || *endp != 0)
+		help(argv[0], 1);
+	loop.slack_high = strtol(argv[5], &endp, 0);
+	if (errno != 0 || *endp != 0)
+		help(argv[0], 1);
+
+	relaxed = qos_parse_settings(sep, argv, 6);
+	strict = qos_parse_settings(argc, argv, sep + 1);
+	if (!relaxed || !strict) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (relaxed->num_settings != strict->num_settings ||
+	    relaxed->num_settings > QOS_LOOP_MAX_SETTINGS)
+		goto err_mismatch;
+
+	for (n = 0; n < relaxed->num_settings; n++) {
+		if (strncmp(relaxed->settings[n].dev_name,
+			    strict->settings[n].dev_name, QOS_DEV_NAMELEN) ||
+		    strncmp(relaxed->settings[n].param_name,
+			    strict->settings[n].param_name, QOS_PARAM_NAMELEN))
+			goto err_mismatch;
+
+		memcpy(settings[n].dev_name, relaxed->settings[n].dev_name,
+		       QOS_DEV_NAMELEN);
+		memcpy(settings[n].param_name, relaxed->settings[n].param_name,
+		       QOS_PARAM_NAMELEN);
+		settings[n].relaxed = relaxed->settings[n].value;
+		settings[n].strict = strict->settings[n].value;
+	}
+	loop.num_settings = n;
+
+configure:
+	fd = open_dev();
+	err = ioctl(fd, JAILHOUSE_QOS_LOOP, &loop);
+	if (err) {
+		perror("JAILHOUSE_QOS_LOOP");
+		if (errno == ENODEV)
+			fprintf(stderr, "QoS: The loop needs a periodic "
+				"MemGuard budget on a root cell CPU.\n");
+	}
+	close(fd);
+
+out:
+	free(strict);
+	free(relaxed);
+
+	return err;
+
+err_mismatch:
+	fprintf(stderr, "QoS: Relaxed and strict settings do not match.\n");
+	err = -EINVAL;
+	goto out;
+}
+
+static int qos_cmd(int argc, char *argv[], unsigned int command)
+{
+	struct jailhouse_qos_args * qos_args;       
+	int fd, err;
+
+	if (argc <= 2)
+		return -EINVAL;
+
+	if (strcmp(argv[2], "compile") == 0)
+		return qos_compile_cmd(argc, argv);
+	if (strcmp(argv[2], "apply") == 0 || strcmp(argv[2], "restore") == 0)
+		return qos_apply_cmd(argc, argv);
+	if (strcmp(argv[2], "query") == 0)
+		return qos_query_cmd(argc, argv);
+	if (strcmp(argv[2], "snapshot") == 0)
+		return qos_snapshot_cmd(argc, argv);
+	if (strcmp(argv[2], "loop") == 0)
+		return qos_loop_cmd(argc, argv);
+
+	qos_args = qos_parse_settings(argc, argv, 2);
+	if (!qos_args)
+		return -EINVAL;
+
 	/* Read to send parameters to kernel driver */
 	fd = open_dev();
 
@@ -640,13 +1116,6 @@ apply_settings:
 	free(qos_args);
 
 	return err;
-
-exit_err:
-	free(qos_args);
-exit_noalloc:
-	fprintf(stderr, "QoS: Invalid list of parameters.\n");
-	return -EINVAL;
-	
 }
 
 static int cell_management(int argc, char *argv[])
@@ -670,6 +1139,8 @@ static int cell_management(int argc, char *argv[])
 		err = cell_simple_cmd(argc, argv, JAILHOUSE_CELL_DESTROY);
 	} else if (strcmp(argv[2], "memguard") == 0) {
 	    err = cell_memguard_cmd(argc, argv, JAILHOUSE_CELL_MEMGUARD);
+	} else if (strcmp(argv[2], "recolor") == 0) {
+		err = cell_recolor_cmd(argc, argv);
 	} else {
 		call_extension_script("cell", argc, argv);
 		help(argv[0], 1);